@@ -0,0 +1,355 @@
+/*
+ * cache_bench - Drive cache.c directly, without sockets, from 1..N threads.
+ *
+ * Every operation picks a key of Zipf popularity. Reads go through
+ * cache_find and, on a miss, insert the object the way the proxy fills
+ * the cache after a fetch; writes replace the object outright. The cache
+ * keeps its built-in capacity, so large key sets and objects keep eviction
+ * busy. Each thread count in 1, 2, 4, ... up to -t gets a fresh cache.
+ *
+ * Lock wait is measured by wrapping the rwlock calls at link time (see the
+ * Makefile): an acquisition that can't be had at once is timed until it is.
+ *
+ * usage: cache_bench [-t threads] [-d seconds] [-n keys] [-s size[:max]]
+ *                    [-w write%] [-z s]
+ */
+#include "cache.h"
+#include <math.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define SUB_BITS 3 /* Histogram: 8 buckets per power of two, as stats.c */
+#define BUCKETS (16 + 37 * (1 << SUB_BITS))
+
+typedef struct {
+  pthread_t tid;
+  unsigned long rng;
+  long finds, hits, inserts;
+  long find_hist[BUCKETS], insert_hist[BUCKETS];
+  long find_max, insert_max;
+  long locks, contended, wait_ns;
+} worker_t;
+
+static int max_threads = 8, duration = 2, nkeys = 10000, write_pct = 10;
+static long min_size = 4096, max_size = 4096;
+static double zipf_s = 1.0;
+static double *zipf_cdf;
+static cache_key_t *keys;
+static char (*paths)[32];
+static char *content;
+static volatile int running;
+static __thread worker_t *self; /* NULL outside the workers */
+
+static long now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000L + ts.tv_nsec;
+}
+
+/* Link-time wrappers, with -Wl,--wrap=pthread_rwlock_{rd,wr}lock */
+int __real_pthread_rwlock_rdlock(pthread_rwlock_t *lock);
+int __real_pthread_rwlock_wrlock(pthread_rwlock_t *lock);
+
+int __wrap_pthread_rwlock_rdlock(pthread_rwlock_t *lock) {
+  long t;
+  int rc;
+
+  if (self == NULL) {
+    return __real_pthread_rwlock_rdlock(lock);
+  }
+  self->locks++;
+  if (pthread_rwlock_tryrdlock(lock) == 0) {
+    return 0;
+  }
+  t = now_ns();
+  rc = __real_pthread_rwlock_rdlock(lock);
+  self->wait_ns += now_ns() - t;
+  self->contended++;
+  return rc;
+}
+
+int __wrap_pthread_rwlock_wrlock(pthread_rwlock_t *lock) {
+  long t;
+  int rc;
+
+  if (self == NULL) {
+    return __real_pthread_rwlock_wrlock(lock);
+  }
+  self->locks++;
+  if (pthread_rwlock_trywrlock(lock) == 0) {
+    return 0;
+  }
+  t = now_ns();
+  rc = __real_pthread_rwlock_wrlock(lock);
+  self->wait_ns += now_ns() - t;
+  self->contended++;
+  return rc;
+}
+
+static int bucket_of(unsigned long v) {
+  int m;
+
+  if (v < 16) {
+    return v;
+  }
+  if (v >> 41) {
+    v = (1UL << 41) - 1;
+  }
+  m = 63 - __builtin_clzl(v);
+  return 16 + ((m - 4) << SUB_BITS) + (int)(v >> (m - SUB_BITS)) -
+         (1 << SUB_BITS);
+}
+
+static long bucket_top(int i) {
+  int m, top;
+
+  if (i < 16) {
+    return i;
+  }
+  m = ((i - 16) >> SUB_BITS) + 4;
+  top = ((i - 16) & ((1 << SUB_BITS) - 1)) + (1 << SUB_BITS);
+  return ((long)(top + 1) << (m - SUB_BITS)) - 1;
+}
+
+static long quantile(const long *hist, long total, double q) {
+  long seen = 0, want = (long)(q * total + 0.5);
+  int i;
+
+  if (want < 1) {
+    want = 1;
+  }
+  for (i = 0; i < BUCKETS; i++) {
+    if ((seen += hist[i]) >= want) {
+      return bucket_top(i);
+    }
+  }
+  return 0;
+}
+
+/* xorshift64*: cheap, and good enough to pick keys */
+static double uniform(worker_t *w) {
+  w->rng ^= w->rng >> 12;
+  w->rng ^= w->rng << 25;
+  w->rng ^= w->rng >> 27;
+  return ((w->rng * 0x2545f4914f6cdd1dUL) >> 11) * (1.0 / 9007199254740992.0);
+}
+
+static void zipf_init(void) {
+  double sum = 0;
+  int k;
+
+  zipf_cdf = malloc(nkeys * sizeof(double));
+  for (k = 0; k < nkeys; k++) {
+    zipf_cdf[k] = sum += 1.0 / pow(k + 1, zipf_s);
+  }
+  for (k = 0; k < nkeys; k++) {
+    zipf_cdf[k] /= sum;
+  }
+}
+
+/* Key index, 0 being the most popular */
+static int zipf_next(worker_t *w) {
+  double u = uniform(w);
+  int lo = 0, hi = nkeys - 1, mid;
+
+  while (lo < hi) {
+    mid = (lo + hi) / 2;
+    if (zipf_cdf[mid] < u) {
+      lo = mid + 1;
+    } else {
+      hi = mid;
+    }
+  }
+  return lo;
+}
+
+/* Keys are built once, hash included, as the proxy does per request */
+static void keys_init(void) {
+  int k;
+
+  keys = malloc(nkeys * sizeof(cache_key_t));
+  paths = malloc(nkeys * sizeof(*paths));
+  for (k = 0; k < nkeys; k++) {
+    snprintf(paths[k], sizeof(paths[k]), "/obj/%d", k);
+    cache_key_init(&keys[k], "bench.example", 80, paths[k]);
+  }
+  content = malloc(max_size + 1);
+  memset(content, 'x', max_size);
+}
+
+/* Size of key k's object, the same on every insert */
+static size_t size_of(int k) {
+  unsigned long x = (unsigned long)k * 0x9e3779b97f4a7c15UL;
+
+  x ^= x >> 31;
+  return min_size + x % (max_size - min_size + 1);
+}
+
+static void insert(worker_t *w, int k) {
+  cache_meta_t meta;
+  long t;
+
+  memset(&meta, 0, sizeof(meta));
+  meta.expires = time(NULL) + 3600;
+  t = now_ns();
+  cache_insert(&keys[k], content, size_of(k), &meta);
+  t = now_ns() - t;
+  w->inserts++;
+  w->insert_hist[bucket_of(t)]++;
+  if (t > w->insert_max) {
+    w->insert_max = t;
+  }
+}
+
+static void *worker_main(void *vargp) {
+  worker_t *w = vargp;
+  cache_block *block;
+  long t;
+  int k;
+
+  self = w;
+  while (running) {
+    k = zipf_next(w);
+    if (uniform(w) * 100 < write_pct) {
+      insert(w, k);
+      continue;
+    }
+    t = now_ns();
+    block = cache_find(&keys[k]);
+    t = now_ns() - t;
+    w->finds++;
+    w->find_hist[bucket_of(t)]++;
+    if (t > w->find_max) {
+      w->find_max = t;
+    }
+    if (block != NULL) {
+      w->hits++;
+      cache_release(block);
+    } else {
+      insert(w, k);
+    }
+  }
+  return NULL;
+}
+
+static void report_latency(const char *name, const long *hist, long n,
+                           long max) {
+  if (n > 0) {
+    printf("  %-6s ns  p50 %ld  p99 %ld  p999 %ld  max %ld\n", name,
+           quantile(hist, n, 0.5), quantile(hist, n, 0.99),
+           quantile(hist, n, 0.999), max);
+  }
+}
+
+static void run(int nthreads) {
+  worker_t *workers = calloc(nthreads, sizeof(worker_t)), sum;
+  cache_usage_t usage;
+  long start, elapsed;
+  int i, j;
+
+  cache_init(""); /* No snapshot to load */
+  running = 1;
+  start = now_ns();
+  for (i = 0; i < nthreads; i++) {
+    workers[i].rng = 0x9e3779b97f4a7c15UL * (i + 1) ^ (unsigned long)start;
+    pthread_create(&workers[i].tid, NULL, worker_main, &workers[i]);
+  }
+  usleep(duration * 1000000);
+  running = 0;
+
+  memset(&sum, 0, sizeof(sum));
+  for (i = 0; i < nthreads; i++) {
+    worker_t *w = &workers[i];
+
+    pthread_join(w->tid, NULL);
+    sum.finds += w->finds;
+    sum.hits += w->hits;
+    sum.inserts += w->inserts;
+    sum.locks += w->locks;
+    sum.contended += w->contended;
+    sum.wait_ns += w->wait_ns;
+    for (j = 0; j < BUCKETS; j++) {
+      sum.find_hist[j] += w->find_hist[j];
+      sum.insert_hist[j] += w->insert_hist[j];
+    }
+    if (w->find_max > sum.find_max) {
+      sum.find_max = w->find_max;
+    }
+    if (w->insert_max > sum.insert_max) {
+      sum.insert_max = w->insert_max;
+    }
+  }
+  elapsed = now_ns() - start;
+  cache_usage(&usage);
+  cache_deinit();
+
+  printf("threads %d  ops %ld  %.2f Mops/s  hits %.1f%%  resident %ld  "
+         "evictions %ld\n",
+         nthreads, sum.finds + sum.inserts,
+         (sum.finds + sum.inserts) * 1e3 / elapsed,
+         sum.finds ? 100.0 * sum.hits / sum.finds : 0.0, usage.objects,
+         usage.evictions);
+  report_latency("find", sum.find_hist, sum.finds, sum.find_max);
+  report_latency("insert", sum.insert_hist, sum.inserts, sum.insert_max);
+  printf("  lock wait %.1f ms  (%.1f%% of thread time)  contended %ld of "
+         "%ld\n",
+         sum.wait_ns / 1e6, 100.0 * sum.wait_ns / ((double)elapsed * nthreads),
+         sum.contended, sum.locks);
+  free(workers);
+}
+
+int main(int argc, char **argv) {
+  int c, n;
+
+  while ((c = getopt(argc, argv, "t:d:n:s:w:z:")) != -1) {
+    switch (c) {
+    case 't':
+      max_threads = atoi(optarg);
+      break;
+    case 'd':
+      duration = atoi(optarg);
+      break;
+    case 'n':
+      nkeys = atoi(optarg);
+      break;
+    case 's':
+      if (sscanf(optarg, "%ld:%ld", &min_size, &max_size) == 1) {
+        max_size = min_size;
+      }
+      break;
+    case 'w':
+      write_pct = atoi(optarg);
+      break;
+    case 'z':
+      zipf_s = atof(optarg);
+      break;
+    default:
+      max_threads = 0;
+      optind = argc;
+    }
+  }
+  if (max_threads < 1 || duration < 1 || nkeys < 1 || min_size < 1 ||
+      max_size < min_size) {
+    fprintf(stderr,
+            "usage: %s [-t threads] [-d seconds] [-n keys] [-s size[:max]]\n"
+            "       [-w write%%] [-z s]\n",
+            argv[0]);
+    exit(1);
+  }
+  zipf_init();
+  keys_init();
+
+  printf("keys %d  size %ld..%ld  writes %d%%  zipf %.2f  %ds per step\n",
+         nkeys, min_size, max_size, write_pct, zipf_s, duration);
+  for (n = 1;; n *= 2) {
+    run(n < max_threads ? n : max_threads);
+    if (n >= max_threads) {
+      break;
+    }
+  }
+  return 0;
+}
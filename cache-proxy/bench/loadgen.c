@@ -0,0 +1,408 @@
+/*
+ * loadgen - Drive a proxy with GETs for origin objects of Zipf popularity.
+ *
+ * Each client thread owns one connection at a time and has one request in
+ * flight. Without a rate the clients run closed-loop, as fast as answers
+ * come back; with -r the total rate is split between them and latency is
+ * measured from when a request was due, not when it was sent, so a stalled
+ * proxy can't hide the requests it held up. Object popularity follows a
+ * Zipf law over -n ids: id k is asked for in proportion to 1 / k^s.
+ *
+ * The hit ratio is read off the origin (see origin.c): full bodies it sent
+ * during the run against requests the proxy answered.
+ *
+ * usage: loadgen -x proxy-host:port [-o origin-host:port] [-c clients]
+ *                [-d seconds] [-n objects] [-z s] [-k 0|1] [-r req/s]
+ */
+#include <arpa/inet.h>
+#include <math.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <time.h>
+#include <unistd.h>
+
+#define BUF_SIZE 65536
+#define SUB_BITS 3 /* Histogram: 8 buckets per power of two, as stats.c */
+#define BUCKETS (16 + 37 * (1 << SUB_BITS))
+#define IO_TIMEOUT_S 5 /* A read stalled this long counts as an error */
+
+typedef struct {
+  pthread_t tid;
+  int id;
+  unsigned long rng;
+  long requests, errors, bytes;
+  long hist[BUCKETS];
+  long max_us;
+} client_t;
+
+static struct sockaddr_in proxy_addr, origin_addr;
+static char origin_host[64];
+static int nclients = 8, duration = 10, nobjects = 10000, keep_alive = 1;
+static double zipf_s = 1.0, rate;
+static double *zipf_cdf;
+static long deadline_us;
+
+static long now_us(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000L + ts.tv_nsec / 1000;
+}
+
+static int parse_addr(const char *s, struct sockaddr_in *addr) {
+  char host[64];
+  int port;
+
+  if (sscanf(s, "%63[^:]:%d", host, &port) != 2) {
+    return -1;
+  }
+  memset(addr, 0, sizeof(*addr));
+  addr->sin_family = AF_INET;
+  addr->sin_port = htons(port);
+  return inet_pton(AF_INET, host, &addr->sin_addr) == 1 ? 0 : -1;
+}
+
+static int bucket_of(unsigned long v) {
+  int m;
+
+  if (v < 16) {
+    return v;
+  }
+  if (v >> 41) {
+    v = (1UL << 41) - 1;
+  }
+  m = 63 - __builtin_clzl(v);
+  return 16 + ((m - 4) << SUB_BITS) + (int)(v >> (m - SUB_BITS)) -
+         (1 << SUB_BITS);
+}
+
+static long bucket_top(int i) {
+  int m, top;
+
+  if (i < 16) {
+    return i;
+  }
+  m = ((i - 16) >> SUB_BITS) + 4;
+  top = ((i - 16) & ((1 << SUB_BITS) - 1)) + (1 << SUB_BITS);
+  return ((long)(top + 1) << (m - SUB_BITS)) - 1;
+}
+
+/* xorshift64*: cheap, and good enough to pick keys */
+static double uniform(client_t *c) {
+  c->rng ^= c->rng >> 12;
+  c->rng ^= c->rng << 25;
+  c->rng ^= c->rng >> 27;
+  return ((c->rng * 0x2545f4914f6cdd1dUL) >> 11) * (1.0 / 9007199254740992.0);
+}
+
+static void zipf_init(void) {
+  double sum = 0;
+  int k;
+
+  zipf_cdf = malloc(nobjects * sizeof(double));
+  for (k = 0; k < nobjects; k++) {
+    zipf_cdf[k] = sum += 1.0 / pow(k + 1, zipf_s);
+  }
+  for (k = 0; k < nobjects; k++) {
+    zipf_cdf[k] /= sum;
+  }
+}
+
+/* Object id, 1 being the most popular */
+static int zipf_next(client_t *c) {
+  double u = uniform(c);
+  int lo = 0, hi = nobjects - 1, mid;
+
+  while (lo < hi) {
+    mid = (lo + hi) / 2;
+    if (zipf_cdf[mid] < u) {
+      lo = mid + 1;
+    } else {
+      hi = mid;
+    }
+  }
+  return lo + 1;
+}
+
+/* Case-insensitive search for needle in a response head */
+static char *find(char *head, const char *needle) {
+  size_t n = strlen(needle);
+
+  for (; *head; head++) {
+    if (strncasecmp(head, needle, n) == 0) {
+      return head;
+    }
+  }
+  return NULL;
+}
+
+static int connect_to(const struct sockaddr_in *addr) {
+  int fd = socket(AF_INET, SOCK_STREAM, 0), one = 1;
+  struct timeval tv = {IO_TIMEOUT_S, 0};
+
+  if (fd < 0) {
+    return -1;
+  }
+  setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+  setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+  setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+  if (connect(fd, (const struct sockaddr *)addr, sizeof(*addr)) < 0) {
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+/*
+ * Send req on *fd (connecting first if *fd < 0) and read the whole
+ * response, using buf as scratch. Returns the body length of a 200, -1 for
+ * any other answer or failure; *fd is closed when the connection can't
+ * carry another request.
+ */
+static long exchange(int *fd, const struct sockaddr_in *addr, const char *req,
+                     char *buf, size_t size) {
+  size_t len = 0, head;
+  long body = -1, got;
+  int keep, status;
+  char *blank, *cl;
+  ssize_t n;
+
+  if (*fd < 0 && (*fd = connect_to(addr)) < 0) {
+    return -1;
+  }
+  if (write(*fd, req, strlen(req)) < 0) {
+    goto fail;
+  }
+  for (;;) {
+    if ((n = read(*fd, buf + len, size - 1 - len)) <= 0) {
+      goto fail;
+    }
+    len += n;
+    buf[len] = '\0';
+    if ((blank = strstr(buf, "\r\n\r\n")) != NULL) {
+      break;
+    }
+    if (len == size - 1) {
+      goto fail;
+    }
+  }
+  head = blank + 4 - buf;
+  *blank = '\0';
+  if ((cl = find(buf, "\r\nContent-Length:")) != NULL) {
+    body = strtol(cl + 17, NULL, 10);
+  }
+  status = strncmp(buf, "HTTP/1.", 7) == 0 ? atoi(buf + 9) : 0;
+  keep = strncmp(buf, "HTTP/1.1 ", 9) == 0 &&
+         find(buf, "\r\nConnection: close") == NULL && body >= 0;
+  /* Without a length the body runs to the close */
+  for (got = len - head; body < 0 || got < body; got += n) {
+    if ((n = read(*fd, buf, size)) < 0) {
+      goto fail;
+    }
+    if (n == 0) {
+      if (body >= 0) {
+        goto fail;
+      }
+      body = got;
+      break;
+    }
+  }
+  if (!keep) {
+    close(*fd);
+    *fd = -1;
+  }
+  return status == 200 ? body : -1;
+fail:
+  close(*fd);
+  *fd = -1;
+  return -1;
+}
+
+static void *client_main(void *vargp) {
+  client_t *c = vargp;
+  char req[512], *buf = malloc(BUF_SIZE);
+  long interval = rate > 0 ? (long)(1e6 * nclients / rate) : 0;
+  long due = now_us() + (interval ? c->id * interval / nclients : 0), t, n;
+  int fd = -1;
+
+  while ((t = now_us()) < deadline_us) {
+    if (interval) {
+      if (t < due) {
+        usleep(due - t);
+      }
+      t = due;
+      due += interval;
+    }
+    snprintf(req, sizeof(req),
+             "GET http://%s/obj/%d HTTP/1.1\r\nHost: %s\r\n"
+             "User-Agent: loadgen\r\n%s\r\n",
+             origin_host, zipf_next(c), origin_host,
+             keep_alive ? "" : "Connection: close\r\n");
+    n = exchange(&fd, &proxy_addr, req, buf, BUF_SIZE);
+    t = now_us() - t;
+    if (n < 0) {
+      c->errors++;
+      continue;
+    }
+    c->requests++;
+    c->bytes += n;
+    c->hist[bucket_of(t)]++;
+    if (t > c->max_us) {
+      c->max_us = t;
+    }
+  }
+  if (fd >= 0) {
+    close(fd);
+  }
+  free(buf);
+  return NULL;
+}
+
+/* Full bodies the origin has sent so far, -1 if it can't be asked */
+static long origin_bodies(void) {
+  char buf[1024], *p;
+  size_t len = 0;
+  ssize_t n;
+  int fd;
+
+  if ((fd = connect_to(&origin_addr)) < 0) {
+    return -1;
+  }
+  snprintf(buf, sizeof(buf),
+           "GET /__origin/stats HTTP/1.1\r\nHost: %s\r\n"
+           "Connection: close\r\n\r\n",
+           origin_host);
+  if (write(fd, buf, strlen(buf)) < 0) {
+    close(fd);
+    return -1;
+  }
+  while (len < sizeof(buf) - 1 &&
+         (n = read(fd, buf + len, sizeof(buf) - 1 - len)) > 0) {
+    len += n;
+  }
+  close(fd);
+  buf[len] = '\0';
+  return (p = strstr(buf, "\nbodies ")) ? strtol(p + 8, NULL, 10) : -1;
+}
+
+static long quantile(const long *hist, long total, double q) {
+  long seen = 0, want = (long)(q * total + 0.5);
+  int i;
+
+  if (want < 1) {
+    want = 1;
+  }
+  for (i = 0; i < BUCKETS; i++) {
+    if ((seen += hist[i]) >= want) {
+      return bucket_top(i);
+    }
+  }
+  return 0;
+}
+
+int main(int argc, char **argv) {
+  long hist[BUCKETS] = {0}, requests = 0, errors = 0, bytes = 0, max_us = 0;
+  long before, after, start;
+  const char *proxy = NULL, *origin = "127.0.0.1:80";
+  client_t *clients;
+  double secs;
+  int c, i, j;
+
+  while ((c = getopt(argc, argv, "x:o:c:d:n:z:k:r:")) != -1) {
+    switch (c) {
+    case 'x':
+      proxy = optarg;
+      break;
+    case 'o':
+      origin = optarg;
+      break;
+    case 'c':
+      nclients = atoi(optarg);
+      break;
+    case 'd':
+      duration = atoi(optarg);
+      break;
+    case 'n':
+      nobjects = atoi(optarg);
+      break;
+    case 'z':
+      zipf_s = atof(optarg);
+      break;
+    case 'k':
+      keep_alive = atoi(optarg);
+      break;
+    case 'r':
+      rate = atof(optarg);
+      break;
+    default:
+      proxy = NULL;
+      optind = argc;
+    }
+  }
+  if (proxy == NULL || parse_addr(proxy, &proxy_addr) < 0 ||
+      parse_addr(origin, &origin_addr) < 0 || nclients < 1 || nobjects < 1) {
+    fprintf(stderr,
+            "usage: %s -x proxy-host:port [-o origin-host:port] [-c clients]\n"
+            "       [-d seconds] [-n objects] [-z s] [-k 0|1] [-r req/s]\n",
+            argv[0]);
+    exit(1);
+  }
+  /* The older proxies dial port 80 and want the host alone in Host */
+  if (ntohs(origin_addr.sin_port) == 80) {
+    snprintf(origin_host, sizeof(origin_host), "%.*s",
+             (int)strcspn(origin, ":"), origin);
+  } else {
+    snprintf(origin_host, sizeof(origin_host), "%s", origin);
+  }
+  signal(SIGPIPE, SIG_IGN);
+  zipf_init();
+
+  before = origin_bodies();
+  clients = calloc(nclients, sizeof(client_t));
+  start = now_us();
+  deadline_us = start + duration * 1000000L;
+  for (i = 0; i < nclients; i++) {
+    clients[i].id = i;
+    clients[i].rng = 0x9e3779b97f4a7c15UL * (i + 1) ^ (unsigned long)start;
+    pthread_create(&clients[i].tid, NULL, client_main, &clients[i]);
+  }
+  for (i = 0; i < nclients; i++) {
+    pthread_join(clients[i].tid, NULL);
+    requests += clients[i].requests;
+    errors += clients[i].errors;
+    bytes += clients[i].bytes;
+    for (j = 0; j < BUCKETS; j++) {
+      hist[j] += clients[i].hist[j];
+    }
+    if (clients[i].max_us > max_us) {
+      max_us = clients[i].max_us;
+    }
+  }
+  secs = (now_us() - start) / 1e6;
+  after = origin_bodies();
+
+  printf("clients %d  keep-alive %d  objects %d  zipf %.2f  rate ", nclients,
+         keep_alive, nobjects, zipf_s);
+  printf(rate > 0 ? "%.0f req/s\n" : "max\n", rate);
+  printf("requests %ld  errors %ld  throughput %.1f req/s  %.2f MB/s\n",
+         requests, errors, requests / secs, bytes / secs / 1e6);
+  if (requests > 0) {
+    printf("latency us  p50 %ld  p99 %ld  p999 %ld  max %ld\n",
+           quantile(hist, requests, 0.5), quantile(hist, requests, 0.99),
+           quantile(hist, requests, 0.999), max_us);
+  }
+  if (before >= 0 && after >= 0 && requests > 0) {
+    printf("origin bodies %ld  hit ratio %.1f%%\n", after - before,
+           100.0 * (1 - (double)(after - before) / requests));
+  } else {
+    printf("origin stats unavailable, hit ratio unknown\n");
+  }
+  return 0;
+}
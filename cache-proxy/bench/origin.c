@@ -0,0 +1,272 @@
+/*
+ * origin - Local origin server stand-in for proxy benchmarks.
+ *
+ * Serves GET /obj/<id> with a body whose size is drawn once per id from the
+ * configured distribution, so every fetch of an id returns the same bytes.
+ * Responses carry Content-Length, Cache-Control, Last-Modified and an ETag;
+ * a request with If-Modified-Since or If-None-Match gets a 304. GET
+ * /__origin/stats reports the requests and full bodies served so far, which
+ * is how a load generator tells cache hits from misses for any proxy.
+ *
+ * The request target may be in origin or absolute form. Connections stay
+ * open unless the client sends Connection: close or speaks HTTP/1.0.
+ *
+ * usage: origin [-p port] [-s sizes] [-l ms] [-j ms] [-m max-age]
+ *   -s fixed:N | uniform:MIN:MAX | pareto:MIN:ALPHA:MAX  (default fixed:4096)
+ *   -l   delay added before every response, ms (default 0)
+ *   -j   extra delay drawn uniformly from [0, ms) (default 0)
+ *   -m   Cache-Control max-age in seconds (default 3600)
+ */
+#include <arpa/inet.h>
+#include <math.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#define HEAD_MAX 8192
+#define LAST_MODIFIED "Mon, 01 Jan 2024 00:00:00 GMT"
+
+enum { SIZE_FIXED, SIZE_UNIFORM, SIZE_PARETO };
+
+static struct {
+  int kind;
+  long min, max;
+  double alpha;
+} sizes = {SIZE_FIXED, 4096, 4096, 0};
+static int delay_ms, jitter_ms, max_age = 3600;
+static char *filler; /* Body bytes, as many as the largest object */
+static long nrequests, nbodies;
+
+/* 64-bit mix of id, so sizes look random but repeat for the same id */
+static unsigned long mix(unsigned long x) {
+  x ^= x >> 33;
+  x *= 0xff51afd7ed558ccdUL;
+  x ^= x >> 33;
+  x *= 0xc4ceb9fe1a85ec53UL;
+  return x ^ (x >> 33);
+}
+
+static long object_size(unsigned long id) {
+  double u = (mix(id) >> 11) * (1.0 / 9007199254740992.0); /* [0, 1) */
+  double v;
+
+  switch (sizes.kind) {
+  case SIZE_UNIFORM:
+    return sizes.min + (long)(u * (sizes.max - sizes.min + 1));
+  case SIZE_PARETO:
+    v = sizes.min / pow(1.0 - u, 1.0 / sizes.alpha);
+    return v > sizes.max ? sizes.max : (long)v;
+  default:
+    return sizes.min;
+  }
+}
+
+static void parse_sizes(const char *spec) {
+  if (sscanf(spec, "fixed:%ld", &sizes.min) == 1) {
+    sizes.kind = SIZE_FIXED;
+    sizes.max = sizes.min;
+  } else if (sscanf(spec, "uniform:%ld:%ld", &sizes.min, &sizes.max) == 2) {
+    sizes.kind = SIZE_UNIFORM;
+  } else if (sscanf(spec, "pareto:%ld:%lf:%ld", &sizes.min, &sizes.alpha,
+                    &sizes.max) == 3 &&
+             sizes.alpha > 0) {
+    sizes.kind = SIZE_PARETO;
+  } else {
+    fprintf(stderr, "origin: bad size spec %s\n", spec);
+    exit(1);
+  }
+  if (sizes.min < 0 || sizes.max < sizes.min) {
+    fprintf(stderr, "origin: bad size range in %s\n", spec);
+    exit(1);
+  }
+}
+
+/* Case-insensitive substring search; heads are scanned, not parsed */
+static int has(const char *head, const char *needle) {
+  size_t n = strlen(needle);
+
+  for (; *head; head++) {
+    if (strncasecmp(head, needle, n) == 0) {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+static int write_all(int fd, const char *buf, size_t n) {
+  ssize_t w;
+
+  while (n > 0) {
+    if ((w = write(fd, buf, n)) < 0) {
+      return -1;
+    }
+    buf += w;
+    n -= w;
+  }
+  return 0;
+}
+
+static void pause_response(unsigned *seed) {
+  long ms = delay_ms + (jitter_ms > 0 ? rand_r(seed) % jitter_ms : 0);
+  struct timespec ts = {ms / 1000, ms % 1000 * 1000000L};
+
+  if (ms > 0) {
+    nanosleep(&ts, NULL);
+  }
+}
+
+/* Answer one request head; returns whether the connection stays open */
+static int respond(int fd, char *head, unsigned *seed) {
+  char hdr[512], *path, *end;
+  int keep, n, conditional;
+  unsigned long id;
+  long size;
+
+  keep = strstr(head, " HTTP/1.1\r\n") != NULL &&
+         !has(head, "Connection: close");
+  conditional =
+      has(head, "If-Modified-Since:") || has(head, "If-None-Match:");
+  if ((path = strchr(head, ' ')) == NULL) {
+    return 0;
+  }
+  path++;
+  if (strncmp(path, "http://", 7) == 0 &&
+      (path = strchr(path + 7, '/')) == NULL) {
+    return 0;
+  }
+  __atomic_add_fetch(&nrequests, 1, __ATOMIC_RELAXED);
+
+  if (strncmp(path, "/__origin/stats", 15) == 0) {
+    char body[128];
+    int len = snprintf(body, sizeof(body), "requests %ld\nbodies %ld\n",
+                       __atomic_load_n(&nrequests, __ATOMIC_RELAXED),
+                       __atomic_load_n(&nbodies, __ATOMIC_RELAXED));
+    n = snprintf(hdr, sizeof(hdr),
+                 "HTTP/1.1 200 OK\r\nContent-Length: %d\r\n"
+                 "Cache-Control: no-store\r\n%s\r\n",
+                 len, keep ? "" : "Connection: close\r\n");
+    return write_all(fd, hdr, n) == 0 && write_all(fd, body, len) == 0 &&
+           keep;
+  }
+  if (strncmp(path, "/obj/", 5) != 0 ||
+      (id = strtoul(path + 5, &end, 10), *end != ' ' && *end != '?')) {
+    n = snprintf(hdr, sizeof(hdr),
+                 "HTTP/1.1 404 Not Found\r\nContent-Length: 0\r\n%s\r\n",
+                 keep ? "" : "Connection: close\r\n");
+    return write_all(fd, hdr, n) == 0 && keep;
+  }
+
+  size = object_size(id);
+  pause_response(seed);
+  if (conditional) {
+    n = snprintf(hdr, sizeof(hdr),
+                 "HTTP/1.1 304 Not Modified\r\nETag: \"%lu-%ld\"\r\n"
+                 "Cache-Control: max-age=%d\r\n%s\r\n",
+                 id, size, max_age, keep ? "" : "Connection: close\r\n");
+    return write_all(fd, hdr, n) == 0 && keep;
+  }
+  __atomic_add_fetch(&nbodies, 1, __ATOMIC_RELAXED);
+  n = snprintf(hdr, sizeof(hdr),
+               "HTTP/1.1 200 OK\r\nContent-Type: application/octet-stream\r\n"
+               "Content-Length: %ld\r\nCache-Control: max-age=%d\r\n"
+               "Last-Modified: " LAST_MODIFIED "\r\nETag: \"%lu-%ld\"\r\n"
+               "%s\r\n",
+               size, max_age, id, size, keep ? "" : "Connection: close\r\n");
+  return write_all(fd, hdr, n) == 0 && write_all(fd, filler, size) == 0 &&
+         keep;
+}
+
+/* One thread per connection: injected delays then only block that one */
+static void *serve(void *vargp) {
+  int fd = (int)(long)vargp;
+  char head[HEAD_MAX + 1], *blank;
+  size_t len = 0, used;
+  unsigned seed = (unsigned)fd * 2654435761u ^ (unsigned)time(NULL);
+  ssize_t n;
+
+  for (;;) {
+    head[len] = '\0';
+    if ((blank = strstr(head, "\r\n\r\n")) == NULL) {
+      if (len == HEAD_MAX || (n = read(fd, head + len, HEAD_MAX - len)) <= 0) {
+        break;
+      }
+      len += n;
+      continue;
+    }
+    blank[2] = '\0';
+    used = blank + 4 - head;
+    if (!respond(fd, head, &seed)) {
+      break;
+    }
+    /* Requests have no bodies here; pipelined heads move to the front */
+    memmove(head, head + used, len - used);
+    len -= used;
+  }
+  close(fd);
+  return NULL;
+}
+
+int main(int argc, char **argv) {
+  struct sockaddr_in addr;
+  int port = 9100, c, listenfd, fd, one = 1;
+  pthread_attr_t attr;
+  pthread_t tid;
+
+  while ((c = getopt(argc, argv, "p:s:l:j:m:")) != -1) {
+    switch (c) {
+    case 'p':
+      port = atoi(optarg);
+      break;
+    case 's':
+      parse_sizes(optarg);
+      break;
+    case 'l':
+      delay_ms = atoi(optarg);
+      break;
+    case 'j':
+      jitter_ms = atoi(optarg);
+      break;
+    case 'm':
+      max_age = atoi(optarg);
+      break;
+    default:
+      fprintf(stderr, "usage: %s [-p port] [-s sizes] [-l ms] [-j ms] "
+                      "[-m max-age]\n", argv[0]);
+      exit(1);
+    }
+  }
+  filler = malloc(sizes.max + 1);
+  memset(filler, 'x', sizes.max);
+  signal(SIGPIPE, SIG_IGN);
+
+  listenfd = socket(AF_INET, SOCK_STREAM, 0);
+  setsockopt(listenfd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  addr.sin_port = htons(port);
+  if (bind(listenfd, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+      listen(listenfd, 1024) < 0) {
+    perror("origin: bind");
+    exit(1);
+  }
+  pthread_attr_init(&attr);
+  pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+  pthread_attr_setstacksize(&attr, 64 * 1024 + HEAD_MAX);
+  while ((fd = accept(listenfd, NULL, NULL)) >= 0) {
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    if (pthread_create(&tid, &attr, serve, (void *)(long)fd) != 0) {
+      close(fd);
+    }
+  }
+  perror("origin: accept");
+  return 1;
+}
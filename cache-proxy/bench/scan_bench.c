@@ -0,0 +1,127 @@
+/*
+ * scan_bench - Compare the delimiter scanning kernels on realistic heads.
+ *
+ * Each head is walked the way the parsers walk it: line ends, then the
+ * request line's spaces and target delimiters, then each header's colon.
+ *
+ * usage: scan_bench [iterations]
+ */
+#include "scan.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+static const char *heads[] = {
+    /* Browser navigation */
+    "GET http://www.example.com/articles/2024/05/some-long-slug?ref=home&utm"
+    "_source=newsletter HTTP/1.1\r\n"
+    "Host: www.example.com\r\n"
+    "User-Agent: Mozilla/5.0 (X11; Linux x86_64) AppleWebKit/537.36 (KHTML, "
+    "like Gecko) Chrome/124.0.0.0 Safari/537.36\r\n"
+    "Accept: text/html,application/xhtml+xml,application/xml;q=0.9,image/avif"
+    ",image/webp,*/*;q=0.8\r\n"
+    "Accept-Language: en-US,en;q=0.9\r\n"
+    "Accept-Encoding: gzip, deflate, br\r\n"
+    "Referer: http://www.example.com/\r\n"
+    "Cookie: session=8f2c1e9a7b3d4f6e8a0c2e4f6a8b0d2f; prefs=dark; _ga=GA1.2."
+    "1234567890.1700000000; _gid=GA1.2.987654321.1700000000\r\n"
+    "Upgrade-Insecure-Requests: 1\r\n"
+    "Proxy-Connection: keep-alive\r\n"
+    "\r\n",
+    /* Command line client */
+    "GET http://127.0.0.1:9000/small.txt HTTP/1.1\r\n"
+    "Host: 127.0.0.1:9000\r\n"
+    "User-Agent: curl/8.5.0\r\n"
+    "Accept: */*\r\n"
+    "Proxy-Connection: Keep-Alive\r\n"
+    "\r\n",
+    /* CDN response */
+    "HTTP/1.1 200 OK\r\n"
+    "Content-Type: text/html; charset=utf-8\r\n"
+    "Content-Length: 48213\r\n"
+    "Connection: keep-alive\r\n"
+    "Date: Mon, 06 May 2024 10:15:32 GMT\r\n"
+    "Last-Modified: Sun, 05 May 2024 22:01:07 GMT\r\n"
+    "ETag: \"5f2a-61794c4b8e3c0-gzip\"\r\n"
+    "Cache-Control: public, max-age=3600, s-maxage=86400, stale-while-revali"
+    "date=60\r\n"
+    "Vary: Accept-Encoding\r\n"
+    "Age: 1432\r\n"
+    "X-Cache: HIT from edge-fra-17\r\n"
+    "Via: 1.1 varnish, 1.1 edge-fra-17\r\n"
+    "Strict-Transport-Security: max-age=31536000; includeSubDomains\r\n"
+    "\r\n",
+    /* API response */
+    "HTTP/1.1 200 OK\r\n"
+    "Content-Type: application/json\r\n"
+    "Transfer-Encoding: chunked\r\n"
+    "Set-Cookie: token=eyJhbGciOiJIUzI1NiIsInR5cCI6IkpXVCJ9.eyJzdWIiOiIxMjM0"
+    "NTY3ODkwIn0.abc; Path=/; HttpOnly; Secure\r\n"
+    "Cache-Control: private, no-cache\r\n"
+    "X-Request-Id: 3f1d2c4b-8a7e-4f6d-9c2b-1a0e8d7c6b5a\r\n"
+    "\r\n",
+};
+
+#define NHEADS (sizeof(heads) / sizeof(heads[0]))
+
+/* Walk one head; returns a sum of offsets so nothing is optimized away */
+static unsigned long walk(const char *head, size_t len) {
+  const char *p = head, *end = head + len, *nl, *q;
+  unsigned long sum = 0;
+  int first = 1;
+
+  while ((nl = scan_any(p, end, "\n")) != NULL && nl - p > 1) {
+    if (first) {
+      q = scan_any(p, nl, " ");
+      sum += q - p;
+      if (q != NULL && (q = scan_any(q + 1, nl, ":/?")) != NULL)
+        sum += q - p;
+      first = 0;
+    } else if ((q = scan_any(p, nl, ":")) != NULL) {
+      sum += q - p;
+    }
+    p = nl + 1;
+  }
+  return sum;
+}
+
+static double now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int main(int argc, char **argv) {
+  static const char *kernels[] = {"scalar", "sse2", "avx2"};
+  long iters = argc > 1 ? atol(argv[1]) : 1000000, i;
+  size_t lens[NHEADS], bytes = 0;
+  unsigned long sum, base = 0;
+  double t;
+  int k, h;
+
+  for (h = 0; h < NHEADS; h++) {
+    lens[h] = strlen(heads[h]);
+    bytes += lens[h];
+  }
+  printf("%zu heads, %zu bytes, %ld iterations\n", NHEADS, bytes, iters);
+  for (k = 0; k < sizeof(kernels) / sizeof(kernels[0]); k++) {
+    if (scan_use(kernels[k]) < 0) {
+      printf("%-8s not supported\n", kernels[k]);
+      continue;
+    }
+    sum = 0;
+    t = now();
+    for (i = 0; i < iters; i++) {
+      for (h = 0; h < NHEADS; h++)
+        sum += walk(heads[h], lens[h]);
+    }
+    t = now() - t;
+    if (base == 0)
+      base = sum;
+    printf("%-8s %8.1f ns/head %8.2f GB/s%s\n", kernels[k],
+           t * 1e9 / (iters * NHEADS), bytes * iters / t / 1e9,
+           sum == base ? "" : "  MISMATCH");
+  }
+  return 0;
+}
@@ -1,13 +1,17 @@
 #include "cache.h"
 #include "helpers.h"
+#include "log.h"
 #include <stdio.h>
 #include <string.h>
 
 #define MAX_CACHE_SIZE 1049000
 #define MAX_OBJECT_SIZE 102400
+#define CACHE_BUCKETS 4096 // index buckets, a power of two
 
 static Cache *cache;
 
+static void cache_delete_locked(void);
+
 void cache_init(const char *filename) {
   cache = Malloc(sizeof(Cache));
   cache->head = Malloc(sizeof(cache_block));
@@ -16,7 +20,9 @@ void cache_init(const char *filename) {
   cache->tail->prev = cache->head;
   cache->head->prev = NULL;
   cache->tail->next = NULL;
+  cache->buckets = Calloc(CACHE_BUCKETS, sizeof(cache_block *));
   cache->c_size = 0;
+  cache->c_count = cache->c_evicted = 0;
   pthread_rwlock_init(&cache->cache_lock, NULL);
   cache_retreive(filename);
 }
@@ -33,20 +39,66 @@ void cache_deinit(void) {
     temp = cache->head;
   }
   pthread_rwlock_destroy(&cache->cache_lock);
+  Free(cache->buckets);
   Free(cache);
 }
 
-cache_block *cache_find(char *hostname, char *path, int port) {
+static uint64_t hash_bytes(uint64_t h, const char *s) {
+  for (; *s; s++) {
+    h = (h ^ (unsigned char)*s) * 1099511628211ULL; // FNV-1a
+  }
+  return h;
+}
+
+// key for host, port and path, which must outlive it
+void cache_key_init(cache_key_t *key, const char *host, int port,
+                    const char *path) {
+  uint64_t h = hash_bytes(14695981039346656037ULL, host);
+  h = (h ^ (unsigned)port) * 1099511628211ULL;
+  key->host = host;
+  key->port = port;
+  key->path = path;
+  key->hash = hash_bytes(h, path);
+}
+
+// turn key into the key of path, which extends key's path: the hash is
+// carried on over the extra bytes rather than computed again
+void cache_key_extend(cache_key_t *key, const char *path) {
+  key->hash = hash_bytes(key->hash, path + strlen(key->path));
+  key->path = path;
+}
+
+static cache_block **bucket_of(uint64_t hash) {
+  return &cache->buckets[hash & (CACHE_BUCKETS - 1)];
+}
+
+// the block stored under key; the caller holds cache_lock
+static cache_block *cache_lookup_locked(const cache_key_t *key) {
+  cache_block *temp = *bucket_of(key->hash);
+
+  for (; temp != NULL; temp = temp->hnext) {
+    if (temp->hash == key->hash && temp->port == key->port &&
+        strcmp(temp->hostname, key->host) == 0 &&
+        strcmp(temp->path, key->path) == 0) {
+      return temp;
+    }
+  }
+  return NULL;
+}
+
+// returns a referenced block, call cache_release() once done with content
+cache_block *cache_find(const cache_key_t *key) {
   pthread_rwlock_rdlock(&cache->cache_lock);
-  cache_block *temp = cache->head->next;
+  cache_block *temp = cache_lookup_locked(key);
 
-  while (temp != cache->tail) {
-    if (strcmp(temp->hostname, hostname) == 0 &&
-        strcmp(temp->path, path) == 0 && temp->port == port) {
-      // move the block to the head
-      pthread_rwlock_unlock(&cache->cache_lock);
-      pthread_rwlock_wrlock(&cache->cache_lock);
+  if (temp != NULL) {
+    // pin the block so eviction can't free it while we are sending it
+    __atomic_add_fetch(&temp->refcnt, 1, __ATOMIC_RELAXED);
+    pthread_rwlock_unlock(&cache->cache_lock);
 
+    // move the block to the head
+    pthread_rwlock_wrlock(&cache->cache_lock);
+    if (temp->linked) {
       pthread_rwlock_wrlock(&temp->block_lock);
       temp->freq = temp->freq + 1;
       temp->prev->next = temp->next;
@@ -57,84 +109,190 @@ cache_block *cache_find(char *hostname, char *path, int port) {
 
       cache->head->next->prev = temp;
       cache->head->next = temp;
-
-      pthread_rwlock_unlock(&cache->cache_lock);
-      return temp;
     }
-    temp = temp->next;
+    pthread_rwlock_unlock(&cache->cache_lock);
+    return temp;
   }
   pthread_rwlock_unlock(&cache->cache_lock);
   return NULL;
 }
 
-void cache_insert(char *hostname, char *path, int port, char *content,
-                  size_t size, const char *filename) {
+static void cache_block_free(cache_block *block) {
+  if (block->content != NULL) {
+    Free(block->content);
+  }
+  pthread_rwlock_destroy(&block->block_lock);
+  Free(block);
+}
+
+void cache_release(cache_block *block) {
+  if (__atomic_sub_fetch(&block->refcnt, 1, __ATOMIC_ACQ_REL) == 0) {
+    cache_block_free(block);
+  }
+}
+
+// copy of block's metadata, consistent with concurrent refreshes
+void cache_get_meta(cache_block *block, cache_meta_t *meta) {
+  pthread_rwlock_rdlock(&block->block_lock);
+  *meta = block->meta;
+  pthread_rwlock_unlock(&block->block_lock);
+}
+
+// a revalidation said block is still good: update it in place, keeping
+// validators the origin didn't resend and any ban on serving it stale
+void cache_refresh(cache_block *block, const cache_meta_t *meta) {
+  pthread_rwlock_wrlock(&block->block_lock);
+  block->meta.expires = meta->expires;
+  if (meta->etag[0] != '\0') {
+    strcpy(block->meta.etag, meta->etag);
+  }
+  if (meta->last_modified[0] != '\0') {
+    strcpy(block->meta.last_modified, meta->last_modified);
+  }
+  block->meta.no_stale |= meta->no_stale;
+  pthread_rwlock_unlock(&block->block_lock);
+}
+
+// unlink temp; the caller holds cache_lock for writing
+static void cache_unlink_locked(cache_block *temp) {
+  cache_block **pp = bucket_of(temp->hash);
+
+  while (*pp != temp) {
+    pp = &(*pp)->hnext;
+  }
+  *pp = temp->hnext;
+  temp->prev->next = temp->next;
+  temp->next->prev = temp->prev;
+  cache->c_size -= temp->size;
+  cache->c_count--;
+  temp->linked = 0;
+  cache_release(temp); // freed now, or by the last reader
+}
+
+// add an object, replacing any older copy of it
+void cache_insert(const cache_key_t *key, char *content, size_t size,
+                  const cache_meta_t *meta) {
   pthread_rwlock_wrlock(&cache->cache_lock);
-  cache_block *temp = Malloc(sizeof(cache_block));
+  cache_block *temp = cache_lookup_locked(key);
+  if (temp != NULL) {
+    cache_unlink_locked(temp);
+  }
+  temp = Malloc(sizeof(cache_block));
   pthread_rwlock_init(&temp->block_lock, NULL);
-  strcpy(temp->hostname, hostname);
-  strcpy(temp->path, path);
-  temp->port = port;
+  strcpy(temp->hostname, key->host);
+  strcpy(temp->path, key->path);
+  temp->port = key->port;
+  temp->hash = key->hash;
   temp->content = Malloc(size);
   memcpy(temp->content, content, size);
   temp->size = size;
+  temp->meta = *meta;
   temp->freq = 0;
+  temp->refcnt = 1; // the list's own reference
+  temp->linked = 1;
   temp->next = cache->head->next;
   temp->prev = cache->head;
   // insert the block to the head
   cache->head->next->prev = temp;
   cache->head->next = temp;
+  temp->hnext = *bucket_of(key->hash);
+  *bucket_of(key->hash) = temp;
   cache->c_size += size;
+  cache->c_count++;
   // delete the last block if the cache is full
   while (cache->c_size > MAX_CACHE_SIZE) {
-    cache_delete();
+    cache_delete_locked();
+    cache->c_evicted++;
   }
   pthread_rwlock_unlock(&cache->cache_lock);
-  cache_save(filename);
 }
 
-void cache_delete(void) // delete the last block
-{
-  pthread_rwlock_wrlock(&cache->cache_lock);
+// unlink the last block; the caller holds cache_lock for writing
+static void cache_delete_locked(void) {
   cache_block *temp = cache->tail->prev;
   if (temp == cache->head) {
-    pthread_rwlock_unlock(&cache->cache_lock);
     return;
   }
-  temp->prev->next = cache->tail;
-  cache->tail->prev = temp->prev;
-  cache->c_size -= temp->size;
-  if (temp->content != NULL) {
-    Free(temp->content);
-  }
-  pthread_rwlock_destroy(&temp->block_lock);
-  Free(temp);
+  cache_unlink_locked(temp);
+}
+
+void cache_delete(void) // delete the last block
+{
+  pthread_rwlock_wrlock(&cache->cache_lock);
+  cache_delete_locked();
+  pthread_rwlock_unlock(&cache->cache_lock);
+}
+
+void cache_usage(cache_usage_t *usage) {
+  pthread_rwlock_rdlock(&cache->cache_lock);
+  usage->objects = cache->c_count;
+  usage->bytes = cache->c_size;
+  usage->evictions = cache->c_evicted;
   pthread_rwlock_unlock(&cache->cache_lock);
+  usage->meta_bytes = usage->objects * sizeof(cache_block) +
+                      CACHE_BUCKETS * sizeof(cache_block *);
 }
 
 void print_cache(void) {
   cache_block *temp = cache->head->next;
   while (temp != cache->tail) {
-    printf("! hostname: %s, path: %s, port: %d, size: %ld, freq: %d\n",
-           temp->hostname, temp->path, temp->port, temp->size, temp->freq);
+    log_debug("! hostname: %s, path: %s, port: %d, size: %ld, freq: %d",
+              temp->hostname, temp->path, temp->port, temp->size, temp->freq);
     temp = temp->next;
   }
 }
 
+// a snapshot starts with this header; blocks are stored as raw structs, so
+// one written by a build with another layout is of no use. Snapshots
+// without it predate the metadata, Vary markers and hash index, whose
+// fields moved everything after hostname. Bump the version whenever the
+// meaning of a field changes; block_size catches most other changes
+#define CACHE_MAGIC "PXCACHE"
+#define CACHE_VERSION 2 // 2: cache_meta_t.no_stale
+
+typedef struct cache_file_head {
+  char magic[8];
+  uint32_t version;
+  uint32_t block_size; // sizeof(cache_block) of the writer
+} cache_file_head_t;
+
+// write a snapshot of the whole cache, replacing the previous one
 void cache_save(const char *filename) {
-  FILE *file = fopen(filename, "ab");
+  cache_file_head_t head = {CACHE_MAGIC, CACHE_VERSION, sizeof(cache_block)};
+  cache_block **blocks, *temp, copy;
+  char tmpname[MAXLINE];
+  long n = 0, i;
+
+  snprintf(tmpname, sizeof(tmpname), "%s.tmp", filename);
+  FILE *file = fopen(tmpname, "wb");
   if (file == NULL) {
     return;
   }
 
-  cache_block *temp = cache->head->next;
-  while (temp != cache->tail) {
-    fwrite(temp, sizeof(cache_block), 1, file);
+  // pin every block under the lock and write them once it is released, so
+  // requests don't wait on the disk; pinned content outlives eviction
+  pthread_rwlock_rdlock(&cache->cache_lock);
+  blocks = Malloc((cache->c_count + 1) * sizeof(cache_block *));
+  for (temp = cache->head->next; temp != cache->tail; temp = temp->next) {
+    __atomic_add_fetch(&temp->refcnt, 1, __ATOMIC_RELAXED);
+    blocks[n++] = temp;
+  }
+  pthread_rwlock_unlock(&cache->cache_lock);
+
+  fwrite(&head, sizeof(head), 1, file);
+  for (i = 0; i < n; i++) {
+    temp = blocks[i];
+    pthread_rwlock_rdlock(&temp->block_lock); // meta may be refreshing
+    copy = *temp;
+    pthread_rwlock_unlock(&temp->block_lock);
+    fwrite(&copy, sizeof(cache_block), 1, file);
     fwrite(temp->content, temp->size, 1, file);
-    temp = temp->next;
+    cache_release(temp);
   }
+  Free(blocks);
 
   fclose(file);
+  rename(tmpname, filename);
 }
 
 void cache_retreive(const char *filename) {
@@ -142,17 +300,29 @@ void cache_retreive(const char *filename) {
   if (file == NULL) {
     return;
   }
+  cache_file_head_t head;
+  if (fread(&head, sizeof(head), 1, file) != 1 ||
+      memcmp(head.magic, CACHE_MAGIC, sizeof(head.magic)) != 0 ||
+      head.version != CACHE_VERSION ||
+      head.block_size != sizeof(cache_block)) {
+    log_warn("Ignoring cache snapshot %s: not written by this build",
+             filename);
+    fclose(file);
+    return;
+  }
   cache_block temp;
+  cache_key_t key;
   while (fread(&temp, sizeof(cache_block), 1, file) == 1) {
     temp.content = malloc(temp.size); // Allocate memory for content
-    if (temp.content == NULL) {
+    if (temp.content == NULL && temp.size > 0) {
       // Handle allocation failure
       fclose(file);
       return;
     }
     fread(temp.content, temp.size, 1, file); // Read content from file
-    cache_insert(temp.hostname, temp.path, temp.port, temp.content, temp.size,
-                 filename);
+    cache_key_init(&key, temp.hostname, temp.port, temp.path);
+    cache_insert(&key, temp.content, temp.size, &temp.meta);
+    free(temp.content);
   }
   fclose(file);
 }
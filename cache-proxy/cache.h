@@ -1,32 +1,83 @@
+/* $begin cache.h */
+#ifndef __CACHE_H__
+#define __CACHE_H__
+
 #include "helpers.h"
+#include <stdint.h>
 #include <stdlib.h>
+#include <time.h>
+
+// what the cache keeps about an object besides its bytes
+typedef struct cache_meta {
+  time_t expires;         // fresh until then; wall clock so it survives saves
+  char etag[256];         // validators from the origin, "" when absent
+  char last_modified[64];
+  char vary[256];         // set on a URL's marker: the names its variants
+                          // are keyed by; the marker holds no content
+  int no_stale;           // the origin must approve every reuse once stale
+} cache_meta_t;
+
+// where an object lives: the request's canonical host, port and path, and
+// a hash of them computed once per request and used by every cache layer
+typedef struct cache_key {
+  const char *host;
+  const char *path;
+  int port;
+  uint64_t hash;
+} cache_key_t;
 
 typedef struct cache_block {
   int freq; // frequency of access
   int port;
+  uint64_t hash;             // of hostname, port and path
+  struct cache_block *hnext; // bucket chain of the index
   char hostname[MAXLINE];
   char path[MAXLINE];
   char *content;            // the content of the cache block (the response)
   size_t size;              // the size of the content
+  cache_meta_t meta;        // guarded by block_lock
+  int refcnt;               // list link + readers still sending content
+  int linked;               // still reachable from the cache list
   struct cache_block *prev; // the prev cache block
   struct cache_block *next; // the next cache block
   pthread_rwlock_t block_lock;
 } cache_block;
 
-typedef struct cache {         // the cache is a double linked list
-  struct cache_block *head;    // the head of the cache
-  struct cache_block *tail;    // the tail of the cache
-  size_t c_size;               // the total size of the cache
-  pthread_rwlock_t cache_lock; // the lock of the cache
+typedef struct cache {          // the cache is a double linked list
+  struct cache_block *head;     // the head of the cache
+  struct cache_block *tail;     // the tail of the cache
+  struct cache_block **buckets; // hash index over the list
+  size_t c_size;                // the total size of the cache
+  long c_count;                 // blocks in the list
+  long c_evicted;               // blocks evicted to make room, ever
+  pthread_rwlock_t cache_lock;  // the lock of the cache
 } Cache;
 
+// occupancy numbers for the stats report
+typedef struct cache_usage {
+  long objects;      // blocks, variant markers included
+  size_t bytes;      // content bytes
+  size_t meta_bytes; // block headers and the hash index
+  long evictions;
+} cache_usage_t;
+
 void cache_init(const char *filename); // initialize the cache
 void cache_deinit(void);               // free the cache
 void print_cache(void);                // for debugging
 
-void cache_insert(char *hostname, char *path, int port, char *content,
-                  size_t size, const char *filename);
-cache_block *cache_find(char *hostname, char *path, int port);
+void cache_key_init(cache_key_t *key, const char *host, int port,
+                    const char *path);
+void cache_key_extend(cache_key_t *key, const char *path);
+void cache_insert(const cache_key_t *key, char *content, size_t size,
+                  const cache_meta_t *meta);
+cache_block *cache_find(const cache_key_t *key);
+void cache_release(cache_block *block); // drop a reference from cache_find
+void cache_get_meta(cache_block *block, cache_meta_t *meta);
+void cache_refresh(cache_block *block, const cache_meta_t *meta);
 void cache_delete(void);
+void cache_usage(cache_usage_t *usage);
 void cache_save(const char *filename);
 void cache_retreive(const char *filename);
+
+#endif
+/* $end cache.h */
@@ -0,0 +1,179 @@
+#include "chunked.h"
+#include <limits.h>
+#include <stdio.h>
+#include <string.h>
+
+enum {
+  CH_SIZE,       /* Hex digits of a chunk size */
+  CH_EXT,        /* Chunk extensions, ignored, up to the line end */
+  CH_SIZE_LF,    /* The LF ending a size line */
+  CH_DATA,       /* left bytes of data */
+  CH_DATA_CR,    /* The CRLF after a chunk's data */
+  CH_DATA_LF,
+  CH_LINE_START, /* Start of a trailer line, or of the final empty line */
+  CH_LINE,       /* Inside a trailer line */
+  CH_END_LF,     /* The LF ending the body */
+  CH_DONE
+};
+
+static int hex_digit(char c) {
+  if (c >= '0' && c <= '9')
+    return c - '0';
+  if (c >= 'a' && c <= 'f')
+    return c - 'a' + 10;
+  if (c >= 'A' && c <= 'F')
+    return c - 'A' + 10;
+  return -1;
+}
+
+void chunk_init(chunk_dec_t *d) {
+  d->state = CH_SIZE;
+  d->left = -1; /* No digit seen yet */
+  d->done = 0;
+  d->trailer_len = 0;
+}
+
+/* Add c to the trailer line being read; a line that doesn't fit whole,
+ * with the CRLF it is stored with, is dropped when it ends */
+static void trailer_byte(chunk_dec_t *d, char c) {
+  if (c != '\n') {
+    if (d->trailer_len + 2 < CHUNK_TRAILER_MAX)
+      d->trailer[d->trailer_len++] = c;
+    else
+      d->line_over = 1;
+    return;
+  }
+  if (d->trailer_len > d->line_start && d->trailer[d->trailer_len - 1] == '\r')
+    d->trailer_len--;
+  if (d->line_over) {
+    d->trailer_len = d->line_start;
+  } else {
+    d->trailer[d->trailer_len++] = '\r';
+    d->trailer[d->trailer_len++] = '\n';
+  }
+}
+
+/*
+ * chunk_decode - Decode the n bytes at buf. The chunk data among them is
+ *     moved to the front of buf, and its length returned; *used is set to
+ *     the bytes consumed, which is n unless the body ended before them.
+ *     Returns -1 on a malformed body.
+ */
+ssize_t chunk_decode(chunk_dec_t *d, char *buf, size_t n, size_t *used) {
+  size_t i = 0, out = 0, k;
+  int x;
+  char c;
+
+  while (i < n && d->state != CH_DONE) {
+    if (d->state == CH_DATA) {
+      k = n - i < (size_t)d->left ? n - i : (size_t)d->left;
+      memmove(buf + out, buf + i, k);
+      out += k;
+      i += k;
+      if ((d->left -= k) == 0)
+        d->state = CH_DATA_CR;
+      continue;
+    }
+    c = buf[i++];
+    switch (d->state) {
+    case CH_SIZE:
+      if ((x = hex_digit(c)) >= 0) {
+        if (d->left > (LONG_MAX - 15) / 16)
+          return -1;
+        d->left = (d->left < 0 ? 0 : d->left * 16) + x;
+        break;
+      }
+      if (d->left < 0)
+        return -1;
+      if (c == ';' || c == ' ' || c == '\t')
+        d->state = CH_EXT;
+      else if (c == '\r')
+        d->state = CH_SIZE_LF;
+      else if (c == '\n')
+        d->state = d->left > 0 ? CH_DATA : CH_LINE_START;
+      else
+        return -1;
+      break;
+    case CH_EXT:
+      if (c == '\r')
+        d->state = CH_SIZE_LF;
+      else if (c == '\n')
+        d->state = d->left > 0 ? CH_DATA : CH_LINE_START;
+      break;
+    case CH_SIZE_LF:
+      if (c != '\n')
+        return -1;
+      d->state = d->left > 0 ? CH_DATA : CH_LINE_START;
+      break;
+    case CH_DATA_CR:
+      if (c == '\r') {
+        d->state = CH_DATA_LF;
+        break;
+      }
+      /* Fall through: a bare LF is tolerated */
+    case CH_DATA_LF:
+      if (c != '\n')
+        return -1;
+      d->state = CH_SIZE;
+      d->left = -1;
+      break;
+    case CH_LINE_START:
+      if (c == '\r') {
+        d->state = CH_END_LF;
+        break;
+      }
+      if (c == '\n') {
+        d->state = CH_DONE;
+        break;
+      }
+      d->line_start = d->trailer_len;
+      d->line_over = 0;
+      d->state = CH_LINE;
+      /* Fall through */
+    case CH_LINE:
+      trailer_byte(d, c);
+      if (c == '\n')
+        d->state = CH_LINE_START;
+      break;
+    case CH_END_LF:
+      if (c != '\n')
+        return -1;
+      d->state = CH_DONE;
+      break;
+    }
+  }
+  d->done = d->state == CH_DONE;
+  *used = i;
+  return out;
+}
+
+/* Data bytes of the current chunk the decoder waits for, 0 if it waits for
+ * framing instead */
+long chunk_pending(const chunk_dec_t *d) {
+  return d->state == CH_DATA ? d->left : 0;
+}
+
+/* Account for n data bytes of the current chunk moved past the decoder */
+void chunk_skip(chunk_dec_t *d, long n) {
+  if ((d->left -= n) == 0)
+    d->state = CH_DATA_CR;
+}
+
+/* Write the size line of a len byte chunk to buf; returns its length */
+int chunk_head(char *buf, size_t len) {
+  return sprintf(buf, "%zx\r\n", len);
+}
+
+/* Write the last chunk, the trailer d kept (if any) and the final CRLF to
+ * buf; returns their length, or -1 if size is too small */
+int chunk_tail(const chunk_dec_t *d, char *buf, size_t size) {
+  size_t len = d != NULL ? d->trailer_len : 0;
+
+  if (len + 5 > size)
+    return -1;
+  memcpy(buf, "0\r\n", 3);
+  if (len > 0)
+    memcpy(buf + 3, d->trailer, len);
+  memcpy(buf + 3 + len, "\r\n", 2);
+  return len + 5;
+}
@@ -0,0 +1,38 @@
+/* $begin chunked.h */
+#ifndef __CHUNKED_H__
+#define __CHUNKED_H__
+
+#include <sys/types.h>
+
+/*
+ * Streaming codec for the chunked transfer coding (RFC 9112 7.1). The
+ * decoder is a state machine fed whatever bytes have arrived, so a body may
+ * be split anywhere: inside a size line, a chunk's data or the trailer.
+ * Decoding is done in place, the data of each call moved to the front of
+ * its input. Trailer fields are kept, up to CHUNK_TRAILER_MAX bytes, for
+ * whoever encodes the body again.
+ */
+
+#define CHUNK_TRAILER_MAX 1024
+#define CHUNK_HEAD_MAX 20 /* Longest chunk size line chunk_head() writes */
+
+typedef struct {
+  int state;
+  long left;         /* Data bytes still due in the current chunk */
+  int done;          /* The last chunk and the trailer section were seen */
+  size_t trailer_len;
+  size_t line_start; /* Where the trailer line being read starts */
+  int line_over;     /* ... and that it doesn't fit */
+  char trailer[CHUNK_TRAILER_MAX]; /* Trailer lines, each ending in CRLF */
+} chunk_dec_t;
+
+void chunk_init(chunk_dec_t *d);
+ssize_t chunk_decode(chunk_dec_t *d, char *buf, size_t n, size_t *used);
+long chunk_pending(const chunk_dec_t *d);
+void chunk_skip(chunk_dec_t *d, long n);
+
+int chunk_head(char *buf, size_t len);
+int chunk_tail(const chunk_dec_t *d, char *buf, size_t size);
+
+#endif
+/* $end chunked.h */
@@ -0,0 +1,583 @@
+#if !defined(__x86_64__) && defined(__APPLE__)
+#define _XOPEN_SOURCE 600 /* ucontext is hidden behind it on macOS */
+#endif
+#include "co.h"
+#include "helpers.h"
+#include "timer.h"
+#include <poll.h>
+#include <stdint.h>
+#ifdef __linux__
+#include <sys/epoll.h>
+#endif
+#ifndef __x86_64__
+#include <ucontext.h>
+#endif
+
+#define CO_MAX_EVENTS 256
+
+struct co {
+#ifdef __x86_64__
+  void *sp; /* Saved stack pointer while switched out */
+#else
+  ucontext_t uc;
+#endif
+  char *stack; /* Base of the mapping, guard page included */
+  co_fn fn;
+  void *arg;
+  int done;
+  int waiting; /* Parked on wait_fds until I/O or its timer fires */
+  const int *wait_fds;
+  int wait_nfds;
+  int wait_events;
+  int wait_soft; /* The timer is the caller's own limit, not a timeout */
+  int timed_out;
+  uint64_t deadline; /* Absolute limit for any wait, 0 if none */
+  int idle_ms;       /* Limit for each single wait, 0 if none */
+  wtimer_t timer;
+  co_sched_t *sched; /* Owner; coroutines never migrate */
+  int parked;        /* In co_park(), woken only by co_unpark() or, in
+                        co_park_deadline(), its timer */
+  int permit;        /* co_unpark() arrived before co_park() */
+  int in_inbox;
+  void *local; /* See co_set_local */
+  struct co *inbox_next;
+  struct co *next; /* Run queue / poll waiter link */
+};
+
+struct co_sched {
+#ifdef __x86_64__
+  void *sp;
+#else
+  ucontext_t uc;
+#endif
+  co_t *current;
+  co_t *ready_head, *ready_tail;
+  char *stacks[CO_STACK_POOL]; /* Free stacks ready for reuse */
+  int nstacks;
+  int nlive;
+  int wake_rd, wake_wr; /* Self-pipe used by co_sched_wake */
+  int wake_pending;
+  wheel_t wheel; /* Wait timeouts of this scheduler's coroutines */
+  long expired;  /* Waits that ended in ETIMEDOUT */
+  co_t *inbox;   /* Unparked from other threads, see co_unpark */
+#ifdef __linux__
+  int epfd;
+#else
+  co_t *waiters; /* Coroutines parked on a descriptor */
+#endif
+};
+
+static __thread co_sched_t *this_sched;
+
+/*
+ * Context switch. On x86-64 we save the callee-saved registers on the
+ * outgoing stack and swap stack pointers, which avoids the sigprocmask
+ * syscall that swapcontext() makes on every switch.
+ */
+#ifdef __x86_64__
+#ifdef __APPLE__
+#define CO_SYM(name) "_" #name
+#else
+#define CO_SYM(name) #name
+#endif
+void co_swap(void **from_sp, void *to_sp);
+__asm__(".text\n"
+        ".globl " CO_SYM(co_swap) "\n" CO_SYM(co_swap) ":\n"
+        "  pushq %rbp\n"
+        "  pushq %rbx\n"
+        "  pushq %r12\n"
+        "  pushq %r13\n"
+        "  pushq %r14\n"
+        "  pushq %r15\n"
+        "  movq %rsp, (%rdi)\n"
+        "  movq %rsi, %rsp\n"
+        "  popq %r15\n"
+        "  popq %r14\n"
+        "  popq %r13\n"
+        "  popq %r12\n"
+        "  popq %rbx\n"
+        "  popq %rbp\n"
+        "  ret\n");
+#endif
+
+static void co_entry(void);
+
+static long page_size(void) {
+  static long sz;
+  if (sz == 0)
+    sz = sysconf(_SC_PAGESIZE);
+  return sz;
+}
+
+/* Take a stack from the pool, or map a fresh one with a guard page */
+static char *stack_get(co_sched_t *s) {
+  char *stack;
+
+  if (s->nstacks > 0)
+    return s->stacks[--s->nstacks];
+  stack = Mmap(NULL, CO_STACK_SIZE + page_size(), PROT_READ | PROT_WRITE,
+               MAP_PRIVATE | MAP_ANON, -1, 0);
+  if (mprotect(stack, page_size(), PROT_NONE) < 0)
+    unix_error("mprotect error");
+  return stack;
+}
+
+static void stack_put(co_sched_t *s, char *stack) {
+  if (s->nstacks < CO_STACK_POOL)
+    s->stacks[s->nstacks++] = stack;
+  else
+    Munmap(stack, CO_STACK_SIZE + page_size());
+}
+
+static void ready_push(co_sched_t *s, co_t *co) {
+  co->next = NULL;
+  if (s->ready_tail)
+    s->ready_tail->next = co;
+  else
+    s->ready_head = co;
+  s->ready_tail = co;
+}
+
+static co_t *ready_pop(co_sched_t *s) {
+  co_t *co = s->ready_head;
+  if (co) {
+    s->ready_head = co->next;
+    if (s->ready_head == NULL)
+      s->ready_tail = NULL;
+  }
+  return co;
+}
+
+/* Switch from the running coroutine back to the scheduler loop */
+static void switch_out(co_sched_t *s, co_t *co) {
+#ifdef __x86_64__
+  co_swap(&co->sp, s->sp);
+#else
+  swapcontext(&co->uc, &s->uc);
+#endif
+}
+
+/* Run co until it yields, parks or finishes */
+static void switch_in(co_sched_t *s, co_t *co) {
+  s->current = co;
+#ifdef __x86_64__
+  co_swap(&s->sp, co->sp);
+#else
+  swapcontext(&s->uc, &co->uc);
+#endif
+  s->current = NULL;
+  if (co->done) {
+    stack_put(s, co->stack);
+    Free(co);
+    s->nlive--;
+  }
+}
+
+static void co_entry(void) {
+  co_sched_t *s = this_sched;
+  co_t *co = s->current;
+
+  co->fn(co->arg);
+  co->done = 1;
+  switch_out(s, co); /* Never returns */
+}
+
+co_sched_t *co_sched_create(void) {
+  co_sched_t *s = Calloc(1, sizeof(co_sched_t));
+  int fds[2];
+
+  if (pipe(fds) < 0)
+    unix_error("pipe error");
+  s->wake_rd = fds[0];
+  s->wake_wr = fds[1];
+  co_nonblock(s->wake_rd);
+  co_nonblock(s->wake_wr);
+  wheel_init(&s->wheel, wheel_clock());
+#ifdef __linux__
+  struct epoll_event ev = {.events = EPOLLIN, .data.ptr = NULL};
+  if ((s->epfd = epoll_create1(EPOLL_CLOEXEC)) < 0)
+    unix_error("epoll_create1 error");
+  if (epoll_ctl(s->epfd, EPOLL_CTL_ADD, s->wake_rd, &ev) < 0)
+    unix_error("epoll_ctl error");
+#endif
+  this_sched = s;
+  return s;
+}
+
+void co_sched_wake(co_sched_t *s) {
+  if (__atomic_exchange_n(&s->wake_pending, 1, __ATOMIC_ACQ_REL) == 0) {
+    char c = 0;
+    if (write(s->wake_wr, &c, 1) < 0 && errno != EAGAIN)
+      unix_error("co_sched_wake error");
+  }
+}
+
+int co_sched_load(co_sched_t *s) {
+  return __atomic_load_n(&s->nlive, __ATOMIC_RELAXED);
+}
+
+/* Empty the self-pipe, then re-enable wakes. Clearing the flag last means a
+ * wake that lands meanwhile either leaves a byte behind or finds us awake */
+static void drain_wake(co_sched_t *s) {
+  char buf[64];
+
+  while (read(s->wake_rd, buf, sizeof(buf)) > 0)
+    ;
+  __atomic_store_n(&s->wake_pending, 0, __ATOMIC_SEQ_CST);
+}
+
+/* Wait up to timeout ms for I/O and move the woken coroutines to the queue */
+static void reactor_poll(co_sched_t *s, int timeout) {
+#ifdef __linux__
+  struct epoll_event evs[CO_MAX_EVENTS];
+  int i, n;
+
+  if ((n = epoll_wait(s->epfd, evs, CO_MAX_EVENTS, timeout)) < 0) {
+    if (errno != EINTR)
+      unix_error("epoll_wait error");
+    return;
+  }
+  for (i = 0; i < n; i++) {
+    co_t *co = evs[i].data.ptr;
+    if (co == NULL) {
+      drain_wake(s);
+      continue;
+    }
+    if (co->waiting) {
+      co->waiting = 0;
+      ready_push(s, co);
+    }
+  }
+#else
+  struct pollfd pfds[CO_MAX_EVENTS + 1];
+  co_t *cos[CO_MAX_EVENTS + 1], *co, **pp;
+  int i, n = 1;
+
+  pfds[0].fd = s->wake_rd;
+  pfds[0].events = POLLIN;
+  for (co = s->waiters; co; co = co->next) {
+    for (i = 0; i < co->wait_nfds && n <= CO_MAX_EVENTS; i++, n++) {
+      pfds[n].fd = co->wait_fds[i];
+      pfds[n].events = (co->wait_events & CO_READ ? POLLIN : 0) |
+                       (co->wait_events & CO_WRITE ? POLLOUT : 0);
+      cos[n] = co;
+    }
+  }
+  if (poll(pfds, n, timeout) < 0) {
+    if (errno != EINTR)
+      unix_error("poll error");
+    return;
+  }
+  if (pfds[0].revents)
+    drain_wake(s);
+  for (i = 1; i < n; i++) {
+    if (pfds[i].revents == 0 || !cos[i]->waiting)
+      continue; /* Quiet, or woken through another of its descriptors */
+    for (pp = &s->waiters; *pp != cos[i]; pp = &(*pp)->next)
+      ;
+    *pp = cos[i]->next;
+    cos[i]->waiting = 0;
+    ready_push(s, cos[i]);
+  }
+#endif
+}
+
+/* Timer callback: the coroutine waited too long, wake it with ETIMEDOUT */
+static void wait_expired(wtimer_t *t) {
+  co_t *co = t->arg;
+  co_sched_t *s = this_sched;
+
+  if (co->parked) { /* In co_park_deadline() */
+    co->parked = 0;
+    co->timed_out = 1;
+    s->expired++;
+    ready_push(s, co);
+    return;
+  }
+  if (!co->waiting)
+    return;
+#ifndef __linux__
+  co_t **pp;
+  for (pp = &s->waiters; *pp != co; pp = &(*pp)->next)
+    ;
+  *pp = co->next;
+#endif
+  co->waiting = 0;
+  co->timed_out = 1;
+  if (!co->wait_soft)
+    s->expired++;
+  ready_push(s, co);
+}
+
+/* Owner side of co_unpark: make parked coroutines runnable again */
+static void drain_inbox(co_sched_t *s) {
+  co_t *co = __atomic_exchange_n(&s->inbox, NULL, __ATOMIC_ACQUIRE), *next;
+
+  for (; co != NULL; co = next) {
+    next = co->inbox_next;
+    __atomic_store_n(&co->in_inbox, 0, __ATOMIC_RELEASE);
+    if (co->parked) {
+      co->parked = 0;
+      ready_push(s, co);
+    } else {
+      co->permit = 1; /* Not parked yet: its co_park returns at once */
+    }
+  }
+}
+
+/*
+ * co_sched_run - Scheduler loop. The idle hook is called once per round so
+ *     the owner can hand over new work; it never returns.
+ */
+void co_sched_run(co_sched_t *s, co_idle_fn idle, void *arg) {
+  co_t *co, *last;
+
+  while (1) {
+    if (idle)
+      idle(s, arg);
+    /* Run only what is queued now, so a yielding coroutine can't starve I/O */
+    last = s->ready_tail;
+    while (last && (co = ready_pop(s)) != NULL) {
+      switch_in(s, co);
+      if (co == last)
+        break;
+    }
+    reactor_poll(s, s->ready_head ? 0
+                                   : wheel_timeout(&s->wheel, wheel_clock()));
+    wheel_advance(&s->wheel, wheel_clock());
+    drain_inbox(s);
+  }
+}
+
+co_t *co_spawn(co_fn fn, void *arg) {
+  co_sched_t *s = this_sched;
+  co_t *co = Calloc(1, sizeof(co_t));
+
+  co->fn = fn;
+  co->arg = arg;
+  co->sched = s;
+  co->timer.fn = wait_expired;
+  co->timer.arg = co;
+  co->stack = stack_get(s);
+#ifdef __x86_64__
+  /* Initial frame popped by co_swap: six registers, then co_entry as the
+   * return address, leaving the stack aligned as if co_entry was called */
+  void **sp = (void **)(co->stack + page_size() + CO_STACK_SIZE - 64);
+  memset(sp, 0, 64);
+  sp[6] = (void *)co_entry;
+  co->sp = sp;
+#else
+  getcontext(&co->uc);
+  co->uc.uc_stack.ss_sp = co->stack + page_size();
+  co->uc.uc_stack.ss_size = CO_STACK_SIZE;
+  co->uc.uc_link = NULL;
+  makecontext(&co->uc, co_entry, 0);
+#endif
+  s->nlive++;
+  ready_push(s, co);
+  return co;
+}
+
+co_t *co_current(void) { return this_sched ? this_sched->current : NULL; }
+
+void co_set_local(void *p) { this_sched->current->local = p; }
+
+void *co_local(void) {
+  co_t *co = co_current();
+  return co ? co->local : NULL;
+}
+
+void co_yield(void) {
+  co_sched_t *s = this_sched;
+  co_t *co = s->current;
+
+  ready_push(s, co);
+  switch_out(s, co);
+}
+
+/*
+ * co_wait_fd - Park the running coroutine until fd is readable (CO_READ) or
+ *     writable (CO_WRITE). Returns 0 once ready, -1 with errno set on error,
+ *     or with errno ETIMEDOUT if the coroutine's deadline or idle limit hits.
+ */
+int co_wait_fd(int fd, int events) {
+  return co_wait_any(&fd, 1, events, 0) < 0 ? -1 : 0;
+}
+
+/*
+ * co_wait_any - Like co_wait_fd, for the first of n descriptors, and for
+ *     at most ms if ms > 0. Returns the index of a ready descriptor, n if
+ *     ms passed first, or -1 with errno set as co_wait_fd does.
+ */
+int co_wait_any(const int *fds, int n, int events, int ms) {
+  co_sched_t *s = this_sched;
+  co_t *co = s->current;
+  uint64_t now = 0, expires = 0;
+  int i;
+
+  if (co->deadline || co->idle_ms || ms > 0) {
+    now = wheel_clock();
+    if (co->idle_ms)
+      expires = now + co->idle_ms;
+    if (co->deadline && (expires == 0 || co->deadline < expires))
+      expires = co->deadline;
+    if (expires != 0 && expires <= now) {
+      s->expired++;
+      errno = ETIMEDOUT;
+      return -1;
+    }
+  }
+  co->wait_soft = ms > 0 && (expires == 0 || now + ms < expires);
+  if (co->wait_soft)
+    expires = now + ms;
+  co->wait_fds = fds;
+  co->wait_nfds = n;
+  co->wait_events = events;
+#ifdef __linux__
+  struct epoll_event ev;
+  ev.events = EPOLLONESHOT | (events & CO_READ ? EPOLLIN | EPOLLRDHUP : 0) |
+              (events & CO_WRITE ? EPOLLOUT : 0);
+  ev.data.ptr = co;
+  /* Descriptors stay registered (disarmed) between waits */
+  for (i = 0; i < n; i++) {
+    if (epoll_ctl(s->epfd, EPOLL_CTL_MOD, fds[i], &ev) < 0) {
+      if (errno != ENOENT ||
+          epoll_ctl(s->epfd, EPOLL_CTL_ADD, fds[i], &ev) < 0) {
+        /* Those already armed would wake us after we gave up waiting */
+        int err = errno;
+        while (--i >= 0)
+          epoll_ctl(s->epfd, EPOLL_CTL_DEL, fds[i], NULL);
+        errno = err;
+        return -1;
+      }
+    }
+  }
+#else
+  co->next = s->waiters;
+  s->waiters = co;
+#endif
+  if (expires)
+    wheel_add(&s->wheel, &co->timer, expires);
+  co->waiting = 1;
+  switch_out(s, co);
+#ifdef __linux__
+  /* The others may still be armed; don't let them wake us later */
+  for (i = 0; i < n; i++) {
+    if (co->timed_out || n > 1)
+      epoll_ctl(s->epfd, EPOLL_CTL_DEL, fds[i], NULL);
+  }
+#endif
+  if (co->timed_out) {
+    co->timed_out = 0;
+    if (co->wait_soft)
+      return n;
+    errno = ETIMEDOUT;
+    return -1;
+  }
+  wheel_del(&s->wheel, &co->timer);
+  if (n == 1)
+    return 0;
+
+  /* Find out which one woke us */
+  struct pollfd pfds[n];
+  for (i = 0; i < n; i++) {
+    pfds[i].fd = fds[i];
+    pfds[i].events = (events & CO_READ ? POLLIN : 0) |
+                     (events & CO_WRITE ? POLLOUT : 0);
+  }
+  if (poll(pfds, n, 0) > 0) {
+    for (i = 0; i < n; i++) {
+      if (pfds[i].revents)
+        return i;
+    }
+  }
+  return co_wait_any(fds, n, events, ms); /* Readiness went away; rewait */
+}
+
+/*
+ * co_park - Suspend the running coroutine until some thread calls
+ *     co_unpark() on it. An unpark that comes first is remembered, so each
+ *     co_park pairs with exactly one co_unpark.
+ */
+void co_park(void) {
+  co_sched_t *s = this_sched;
+  co_t *co = s->current;
+
+  if (co->permit) {
+    co->permit = 0;
+    return;
+  }
+  co->parked = 1;
+  switch_out(s, co);
+}
+
+/*
+ * co_park_deadline - co_park() that gives up when the coroutine's deadline
+ *     passes: returns 0 once unparked, or -1 with errno ETIMEDOUT. A
+ *     co_unpark() still due after a timeout is remembered as usual, so the
+ *     caller must make sure none is coming, or park again to take it.
+ */
+int co_park_deadline(void) {
+  co_sched_t *s = this_sched;
+  co_t *co = s->current;
+
+  if (co->permit) {
+    co->permit = 0;
+    return 0;
+  }
+  if (co->deadline == 0) {
+    co_park();
+    return 0;
+  }
+  if (co->deadline <= wheel_clock()) {
+    s->expired++;
+    errno = ETIMEDOUT;
+    return -1;
+  }
+  wheel_add(&s->wheel, &co->timer, co->deadline);
+  co->parked = 1;
+  switch_out(s, co);
+  if (co->timed_out) {
+    co->timed_out = 0;
+    errno = ETIMEDOUT;
+    return -1;
+  }
+  wheel_del(&s->wheel, &co->timer);
+  return 0;
+}
+
+/* Wake a parked coroutine; safe from any thread */
+void co_unpark(co_t *co) {
+  co_sched_t *s = co->sched;
+  co_t *head;
+
+  if (__atomic_exchange_n(&co->in_inbox, 1, __ATOMIC_ACQ_REL))
+    return; /* Already on its way */
+  head = __atomic_load_n(&s->inbox, __ATOMIC_RELAXED);
+  do {
+    co->inbox_next = head;
+  } while (!__atomic_compare_exchange_n(&s->inbox, &head, co, 1,
+                                        __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+  co_sched_wake(s);
+}
+
+/* Limit every later wait of the running coroutine to end by now + ms */
+void co_deadline(int ms) {
+  co_t *co = co_current();
+  co->deadline = ms > 0 ? wheel_clock() + ms : 0;
+}
+
+/* Limit each single later wait of the running coroutine to ms */
+void co_idle_timeout(int ms) { co_current()->idle_ms = ms > 0 ? ms : 0; }
+
+long co_sched_expired(co_sched_t *s) {
+  return __atomic_load_n(&s->expired, __ATOMIC_RELAXED);
+}
+
+/* Put fd in non-blocking mode so rio can yield instead of blocking */
+int co_nonblock(int fd) {
+  int flags = fcntl(fd, F_GETFL, 0);
+  if (flags < 0)
+    return -1;
+  return fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+}
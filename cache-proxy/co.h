@@ -0,0 +1,51 @@
+/* $begin co.h */
+#ifndef __CO_H__
+#define __CO_H__
+
+#include <stddef.h>
+
+/*
+ * Stackful coroutines multiplexed over a per-thread scheduler. Each worker
+ * thread owns one scheduler: a run queue, a pool of mmap'd stacks and an
+ * I/O reactor (epoll on Linux, poll elsewhere). A coroutine that would block
+ * on a socket parks itself with co_wait_fd() and the scheduler runs another
+ * one until the descriptor becomes ready.
+ */
+
+#define CO_STACK_SIZE (256 * 1024) /* Virtual size; only touched pages cost */
+#define CO_STACK_POOL 64           /* Cached stacks kept per scheduler */
+
+#define CO_READ 1
+#define CO_WRITE 2
+
+typedef struct co co_t;
+typedef struct co_sched co_sched_t;
+typedef void (*co_fn)(void *arg);
+typedef void (*co_idle_fn)(co_sched_t *s, void *arg);
+
+/* Scheduler life cycle; a scheduler is bound to the thread that creates it */
+co_sched_t *co_sched_create(void);
+void co_sched_run(co_sched_t *s, co_idle_fn idle, void *arg);
+void co_sched_wake(co_sched_t *s);    /* Safe to call from any thread */
+int co_sched_load(co_sched_t *s);     /* Number of live coroutines */
+long co_sched_expired(co_sched_t *s); /* Waits ended by a timeout */
+
+/* Coroutine operations; all of them act on the calling thread's scheduler */
+co_t *co_spawn(co_fn fn, void *arg);
+co_t *co_current(void); /* NULL when not running inside a coroutine */
+void co_yield(void);
+int co_wait_fd(int fd, int events);
+int co_wait_any(const int *fds, int n, int events, int ms);
+void co_deadline(int ms);     /* Later waits fail after ms; 0 clears */
+void co_idle_timeout(int ms); /* Each wait may take at most ms; 0 clears */
+void co_park(void);
+int co_park_deadline(void); /* co_park bounded by the deadline */
+void co_unpark(co_t *co); /* Safe to call from any thread */
+int co_nonblock(int fd);
+
+/* One pointer of coroutine-local data, NULL in a new coroutine */
+void co_set_local(void *p);
+void *co_local(void); /* NULL outside coroutines too */
+
+#endif
+/* $end co.h */
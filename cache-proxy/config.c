@@ -0,0 +1,112 @@
+#include "config.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+config_t conf = {
+    .header_timeout = 10000,
+    .connect_timeout = 5000,
+    .connect_stagger = 250,
+    .first_byte_timeout = 30000,
+    .idle_timeout = 30000,
+    .keepalive_timeout = 5000,
+    .client_max_requests = 100,
+    .pool_max_idle = 256,
+    .pool_max_per_host = 8,
+    .pool_idle_timeout = 10000,
+    .dns_threads = 2,
+    .dns_cache_size = 1024,
+    .dns_default_ttl = 60000,
+    .dns_min_ttl = 1000,
+    .dns_max_ttl = 3600000,
+    .dns_negative_ttl = 5000,
+    .cache_ttl = 60000,
+    .neg_cache_size = 262144,
+    .neg_cache_ttl = 10000,
+    .neg_cache_5xx_ttl = 2000,
+    .cache_sort_query = 0,
+    .tunnel_idle_timeout = 300000,
+    .log_level = 2,
+    .trace_sample = 0,
+    .connect_ports = "443",
+    .cache_strip_params = "",
+    .log_file = "",
+};
+
+static const struct {
+  const char *name;
+  int *value;
+  const char **text; /* For options that take a string instead */
+} options[] = {
+    {"header_timeout", &conf.header_timeout},
+    {"connect_timeout", &conf.connect_timeout},
+    {"connect_stagger", &conf.connect_stagger},
+    {"first_byte_timeout", &conf.first_byte_timeout},
+    {"idle_timeout", &conf.idle_timeout},
+    {"keepalive_timeout", &conf.keepalive_timeout},
+    {"client_max_requests", &conf.client_max_requests},
+    {"pool_max_idle", &conf.pool_max_idle},
+    {"pool_max_per_host", &conf.pool_max_per_host},
+    {"pool_idle_timeout", &conf.pool_idle_timeout},
+    {"dns_threads", &conf.dns_threads},
+    {"dns_cache_size", &conf.dns_cache_size},
+    {"dns_default_ttl", &conf.dns_default_ttl},
+    {"dns_min_ttl", &conf.dns_min_ttl},
+    {"dns_max_ttl", &conf.dns_max_ttl},
+    {"dns_negative_ttl", &conf.dns_negative_ttl},
+    {"cache_ttl", &conf.cache_ttl},
+    {"neg_cache_size", &conf.neg_cache_size},
+    {"neg_cache_ttl", &conf.neg_cache_ttl},
+    {"neg_cache_5xx_ttl", &conf.neg_cache_5xx_ttl},
+    {"cache_sort_query", &conf.cache_sort_query},
+    {"tunnel_idle_timeout", &conf.tunnel_idle_timeout},
+    {"log_level", &conf.log_level},
+    {"trace_sample", &conf.trace_sample},
+    {"connect_ports", NULL, &conf.connect_ports},
+    {"cache_strip_params", NULL, &conf.cache_strip_params},
+    {"log_file", NULL, &conf.log_file},
+};
+
+/* Apply name=value arguments after the port; exits on unknown names */
+void config_parse(int argc, char **argv) {
+  int i;
+  size_t j;
+
+  for (i = 2; i < argc; i++) {
+    char *eq = strchr(argv[i], '=');
+    if (eq == NULL) {
+      continue; /* Replacement policy argument, see README */
+    }
+    for (j = 0; j < sizeof(options) / sizeof(options[0]); j++) {
+      if (strlen(options[j].name) == (size_t)(eq - argv[i]) &&
+          strncmp(options[j].name, argv[i], eq - argv[i]) == 0) {
+        if (options[j].text) {
+          *options[j].text = eq + 1;
+        } else {
+          *options[j].value = atoi(eq + 1);
+        }
+        break;
+      }
+    }
+    if (j == sizeof(options) / sizeof(options[0])) {
+      fprintf(stderr, "unknown option: %s\n", argv[i]);
+      exit(1);
+    }
+  }
+}
+
+/* True if port is in the comma-separated connect_ports list ("*": any) */
+int config_connect_allowed(int port) {
+  const char *p;
+  char *end;
+
+  if (strcmp(conf.connect_ports, "*") == 0) {
+    return 1;
+  }
+  for (p = conf.connect_ports; *p; p = *end ? end + 1 : end) {
+    if (strtol(p, &end, 10) == port && end != p) {
+      return 1;
+    }
+  }
+  return 0;
+}
@@ -0,0 +1,48 @@
+/* $begin config.h */
+#ifndef __CONFIG_H__
+#define __CONFIG_H__
+
+/*
+ * Runtime knobs. Every one can be overridden on the command line as
+ * name=value after the port, e.g. ./proxy 8080 idle_timeout=5000
+ */
+typedef struct {
+  int header_timeout;      /* ms for a client to send its request line */
+  int connect_timeout;     /* ms to connect to the origin */
+  int connect_stagger;     /* ms before racing the next origin address */
+  int first_byte_timeout;  /* ms from request sent to first response byte */
+  int idle_timeout;        /* ms a transfer may stall in either direction */
+  int keepalive_timeout;   /* ms an idle client connection is kept open */
+  int client_max_requests; /* Requests served on one client connection */
+  int pool_max_idle;       /* Idle origin connections kept in total */
+  int pool_max_per_host;   /* Idle origin connections kept per host:port */
+  int pool_idle_timeout;   /* ms an origin connection may stay idle */
+  int dns_threads;         /* Helper threads doing name lookups */
+  int dns_cache_size;      /* Hostnames kept in the resolver cache */
+  int dns_default_ttl;     /* ms to keep an answer without a known TTL */
+  int dns_min_ttl;         /* Bounds applied to TTLs from DNS, in ms */
+  int dns_max_ttl;
+  int dns_negative_ttl;    /* ms to remember a failed lookup */
+  int cache_ttl;           /* ms fresh when a response gives no lifetime */
+  int neg_cache_size;      /* Bytes of error responses kept */
+  int neg_cache_ttl;       /* ms a 404-like response is kept at most */
+  int neg_cache_5xx_ttl;   /* ms a server error is kept at most */
+  int cache_sort_query;    /* Key queries by sorted parameters */
+  int tunnel_idle_timeout; /* ms a CONNECT tunnel may carry no bytes */
+  int log_level;           /* 0 errors, 1 warnings, 2 info, 3 debug */
+  int trace_sample;        /* Trace the phases of 1 in N requests; 0 off */
+  /* Ports CONNECT may reach, comma-separated, e.g. "443,8443"; "*": any */
+  const char *connect_ports;
+  /* Query parameters left out of cache keys, e.g. "utm_source,fbclid" */
+  const char *cache_strip_params;
+  /* File the log is appended to; "" for standard output */
+  const char *log_file;
+} config_t;
+
+extern config_t conf;
+
+void config_parse(int argc, char **argv);
+int config_connect_allowed(int port);
+
+#endif
+/* $end config.h */
@@ -0,0 +1,413 @@
+#include "dns.h"
+#include "co.h"
+#include "config.h"
+#include "helpers.h"
+#include "timer.h"
+#include <arpa/nameser.h>
+#include <resolv.h>
+
+#define DNS_SHARDS 16
+#define DNS_ANSWER_SIZE 4096
+
+/*
+ * A coroutine parked on a lookup in flight; lives on its stack. The helper
+ * takes it off the entry and fills it in under the shard lock, and wakes
+ * it after: a waiter whose deadline passes first unlinks itself, and one
+ * that finds itself already taken waits for that wake-up.
+ */
+typedef struct dns_waiter {
+  co_t *co;
+  int port;
+  struct addrinfo *result;
+  int err;
+  struct dns_waiter *next;
+} dns_waiter_t;
+
+typedef struct dns_entry {
+  struct addrinfo *ai;   /* Cached answer, port 0; NULL if none */
+  int err;               /* EAI_* code of a cached failure */
+  uint64_t expires;      /* ms; the entry is fresh until then */
+  uint64_t ttl;          /* ms the answer was good for */
+  unsigned hits;         /* Uses since the last lookup */
+  int busy;              /* A helper owns it: lookup or refresh in flight */
+  int family;            /* Family that connected fastest last time */
+  dns_waiter_t *waiters; /* Coroutines waiting for that lookup */
+  struct dns_entry *next;
+  char host[];
+} dns_entry_t;
+
+typedef struct dns_job {
+  dns_entry_t *entry;
+  struct dns_job *next;
+} dns_job_t;
+
+static struct {
+  pthread_mutex_t lock;
+  dns_entry_t *head;
+  int count;
+} shards[DNS_SHARDS];
+
+static struct {
+  pthread_mutex_t lock;
+  pthread_cond_t ready;
+  dns_job_t *head, *tail;
+} jobs = {PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, NULL, NULL};
+
+static pthread_once_t init_once = PTHREAD_ONCE_INIT;
+static long ncached;
+
+static void *dns_helper(void *vargp);
+
+static void dns_init(void) {
+  pthread_t tid;
+  int i;
+
+  for (i = 0; i < DNS_SHARDS; i++)
+    pthread_mutex_init(&shards[i].lock, NULL);
+  for (i = 0; i < conf.dns_threads; i++)
+    Pthread_create(&tid, NULL, dns_helper, NULL);
+}
+
+static int shard_of(const char *host) {
+  unsigned h = 2166136261u; /* FNV-1a */
+  for (; *host; host++)
+    h = (h ^ (unsigned char)tolower(*host)) * 16777619u;
+  return h % DNS_SHARDS;
+}
+
+/*
+ * ai_copy - Copy list with every address pointing at port. Families are
+ *     interleaved, starting with first (RFC 8305 section 4), so that a
+ *     staggered connect tries the other family early.
+ */
+static struct addrinfo *ai_copy(const struct addrinfo *src, int port,
+                                int first) {
+  struct addrinfo *head[2] = {NULL, NULL}, **tail[2], *ai, *list, **lt;
+  int k;
+
+  tail[0] = &head[0];
+  tail[1] = &head[1];
+  for (; src != NULL; src = src->ai_next) {
+    ai = Calloc(1, sizeof(struct addrinfo) + sizeof(struct sockaddr_storage));
+    *ai = *src;
+    ai->ai_next = NULL;
+    ai->ai_canonname = NULL;
+    ai->ai_addr = (struct sockaddr *)(ai + 1);
+    memcpy(ai->ai_addr, src->ai_addr, src->ai_addrlen);
+    if (ai->ai_family == AF_INET)
+      ((struct sockaddr_in *)ai->ai_addr)->sin_port = htons(port);
+    else if (ai->ai_family == AF_INET6)
+      ((struct sockaddr_in6 *)ai->ai_addr)->sin6_port = htons(port);
+    k = ai->ai_family != first;
+    *tail[k] = ai;
+    tail[k] = &ai->ai_next;
+  }
+
+  /* Merge, alternating between the two */
+  list = NULL;
+  lt = &list;
+  for (k = head[0] ? 0 : 1; head[0] || head[1]; k = head[!k] ? !k : k) {
+    ai = head[k];
+    head[k] = ai->ai_next;
+    ai->ai_next = NULL;
+    *lt = ai;
+    lt = &ai->ai_next;
+  }
+  return list;
+}
+
+void dns_free(struct addrinfo *list) {
+  struct addrinfo *next;
+  for (; list != NULL; list = next) {
+    next = list->ai_next;
+    Free(list);
+  }
+}
+
+static int resolve(const char *host, struct addrinfo **res) {
+  struct addrinfo hints, *list;
+  int rc;
+
+  memset(&hints, 0, sizeof(struct addrinfo));
+  hints.ai_socktype = SOCK_STREAM;
+  hints.ai_flags = AI_ADDRCONFIG;
+  if ((rc = getaddrinfo(host, NULL, &hints, &list)) != 0)
+    return rc;
+  *res = ai_copy(list, 0, AF_INET6);
+  freeaddrinfo(list);
+  return 0;
+}
+
+/*
+ * query_ttl - TTL in ms of host's A (or else AAAA) records. getaddrinfo()
+ *     doesn't report TTLs, so ask the resolver directly; names it can't
+ *     answer (e.g. from /etc/hosts) get conf.dns_default_ttl.
+ */
+static uint64_t query_ttl(const char *host) {
+  static const int types[] = {ns_t_a, ns_t_aaaa};
+  unsigned char answer[DNS_ANSWER_SIZE];
+  struct __res_state rs;
+  uint64_t ttl = 0;
+  ns_msg msg;
+  ns_rr rr;
+  int i, t, n;
+
+  memset(&rs, 0, sizeof(rs));
+  if (res_ninit(&rs) < 0)
+    return conf.dns_default_ttl;
+  rs.retry = 1; /* Off the critical path, but don't tie up a helper */
+  rs.retrans = 1;
+  for (t = 0; t < 2 && ttl == 0; t++) {
+    n = res_nquery(&rs, host, ns_c_in, types[t], answer, sizeof(answer));
+    if (n < 0 || ns_initparse(answer, n, &msg) < 0)
+      continue;
+    for (i = 0; i < ns_msg_count(msg, ns_s_an); i++) {
+      if (ns_parserr(&msg, ns_s_an, i, &rr) == 0 &&
+          (ttl == 0 || ns_rr_ttl(rr) * 1000ULL < ttl))
+        ttl = ns_rr_ttl(rr) * 1000ULL;
+    }
+  }
+  res_nclose(&rs);
+  if (ttl == 0)
+    ttl = conf.dns_default_ttl;
+  if (ttl < (uint64_t)conf.dns_min_ttl)
+    ttl = conf.dns_min_ttl;
+  if (ttl > (uint64_t)conf.dns_max_ttl)
+    ttl = conf.dns_max_ttl;
+  return ttl;
+}
+
+/* Queue a lookup for e; the caller holds its shard lock and set busy */
+static void job_push(dns_entry_t *e) {
+  dns_job_t *job = Malloc(sizeof(dns_job_t));
+
+  job->entry = e;
+  job->next = NULL;
+  pthread_mutex_lock(&jobs.lock);
+  if (jobs.tail)
+    jobs.tail->next = job;
+  else
+    jobs.head = job;
+  jobs.tail = job;
+  pthread_cond_signal(&jobs.ready);
+  pthread_mutex_unlock(&jobs.lock);
+}
+
+static dns_entry_t *job_pop(void) {
+  dns_job_t *job;
+  dns_entry_t *e;
+
+  pthread_mutex_lock(&jobs.lock);
+  while (jobs.head == NULL)
+    pthread_cond_wait(&jobs.ready, &jobs.lock);
+  job = jobs.head;
+  jobs.head = job->next;
+  if (jobs.head == NULL)
+    jobs.tail = NULL;
+  pthread_mutex_unlock(&jobs.lock);
+  e = job->entry;
+  Free(job);
+  return e;
+}
+
+/*
+ * dns_helper - Helper thread: resolve queued names, hand the answer to
+ *     every waiting coroutine, then learn the TTL in the background.
+ */
+static void *dns_helper(void *vargp) {
+  dns_entry_t *e;
+  dns_waiter_t *w, *next;
+  struct addrinfo *list = NULL;
+  int rc, s;
+
+  Pthread_detach(pthread_self());
+  while (1) {
+    e = job_pop();
+    s = shard_of(e->host);
+    rc = resolve(e->host, &list);
+
+    pthread_mutex_lock(&shards[s].lock);
+    if (rc == 0) {
+      dns_free(e->ai);
+      e->ai = list;
+      e->err = 0;
+      e->ttl = conf.dns_default_ttl; /* Until query_ttl() says otherwise */
+      e->expires = wheel_clock() + e->ttl;
+    } else if (e->ai == NULL || wheel_clock() >= e->expires) {
+      dns_free(e->ai); /* Failed and nothing fresh left: cache the error */
+      e->ai = NULL;
+      e->err = rc;
+      e->expires = wheel_clock() + conf.dns_negative_ttl;
+    }
+    e->hits = 0;
+    w = e->waiters;
+    e->waiters = NULL;
+    for (next = w; next != NULL; next = next->next) {
+      next->err = e->ai ? 0 : e->err;
+      next->result = e->ai ? ai_copy(e->ai, next->port, e->family) : NULL;
+    }
+    pthread_mutex_unlock(&shards[s].lock);
+    for (; w != NULL; w = next) {
+      next = w->next; /* w is gone once its coroutine runs */
+      co_unpark(w->co);
+    }
+
+    if (rc == 0) {
+      uint64_t ttl = query_ttl(e->host);
+      pthread_mutex_lock(&shards[s].lock);
+      e->expires += ttl - e->ttl;
+      e->ttl = ttl;
+      e->busy = 0;
+      pthread_mutex_unlock(&shards[s].lock);
+    } else {
+      pthread_mutex_lock(&shards[s].lock);
+      e->busy = 0;
+      pthread_mutex_unlock(&shards[s].lock);
+    }
+  }
+  return NULL;
+}
+
+/* host's entry; the caller holds shard s's lock */
+static dns_entry_t *shard_find(int s, const char *host) {
+  dns_entry_t *e;
+
+  for (e = shards[s].head; e != NULL; e = e->next) {
+    if (strcasecmp(e->host, host) == 0)
+      break;
+  }
+  return e;
+}
+
+/* Make room in a full shard: expired entries first, then any idle one */
+static void shard_evict(int s, uint64_t now) {
+  dns_entry_t **pp, *e;
+  int pass;
+
+  for (pass = 0; pass < 2; pass++) {
+    for (pp = &shards[s].head; (e = *pp) != NULL;) {
+      if (!e->busy && (pass == 1 || e->expires <= now)) {
+        *pp = e->next;
+        dns_free(e->ai);
+        Free(e);
+        shards[s].count--;
+        __atomic_sub_fetch(&ncached, 1, __ATOMIC_RELAXED);
+        if (pass == 1)
+          return;
+      } else {
+        pp = &e->next;
+      }
+    }
+    if (shards[s].count < conf.dns_cache_size / DNS_SHARDS + 1)
+      return;
+  }
+}
+
+/*
+ * dns_lookup - getaddrinfo() for SOCK_STREAM through the cache. Returns a
+ *     list to pass to dns_free(), or NULL with *err set to an EAI_* code.
+ */
+struct addrinfo *dns_lookup(const char *host, const char *port, int *err) {
+  struct addrinfo hints, *list, *result;
+  unsigned char addr[sizeof(struct in6_addr)];
+  int s, portnum = atoi(port);
+  dns_waiter_t w, **pp;
+  dns_entry_t *e;
+  uint64_t now;
+
+  /* Literal addresses need no lookup at all */
+  if (inet_pton(AF_INET, host, addr) == 1 ||
+      inet_pton(AF_INET6, host, addr) == 1) {
+    memset(&hints, 0, sizeof(struct addrinfo));
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = AI_NUMERICHOST | AI_NUMERICSERV;
+    if ((*err = getaddrinfo(host, port, &hints, &list)) != 0)
+      return NULL;
+    result = ai_copy(list, portnum, AF_INET6);
+    freeaddrinfo(list);
+    return result;
+  }
+
+  Pthread_once(&init_once, dns_init);
+  s = shard_of(host);
+  now = wheel_clock();
+  pthread_mutex_lock(&shards[s].lock);
+  e = shard_find(s, host);
+  if (e != NULL && now < e->expires) {
+    e->hits++;
+    /* Popular and about to expire: refresh ahead of time */
+    if (e->ai != NULL && !e->busy && e->hits >= 2 &&
+        (e->expires - now) * 8 < e->ttl) {
+      e->busy = 1;
+      job_push(e);
+    }
+    *err = e->err;
+    result = e->ai ? ai_copy(e->ai, portnum, e->family) : NULL;
+    pthread_mutex_unlock(&shards[s].lock);
+    return result;
+  }
+  if (co_current() == NULL) { /* Can't park: resolve in place, uncached */
+    pthread_mutex_unlock(&shards[s].lock);
+    if ((*err = resolve(host, &list)) != 0)
+      return NULL;
+    result = ai_copy(list, portnum, AF_INET6);
+    dns_free(list);
+    return result;
+  }
+  if (e == NULL) {
+    if (shards[s].count >= conf.dns_cache_size / DNS_SHARDS + 1)
+      shard_evict(s, now);
+    e = Calloc(1, sizeof(dns_entry_t) + strlen(host) + 1);
+    e->family = AF_INET6; /* RFC 8305 default until one wins */
+    strcpy(e->host, host);
+    e->next = shards[s].head;
+    shards[s].head = e;
+    shards[s].count++;
+    __atomic_add_fetch(&ncached, 1, __ATOMIC_RELAXED);
+  }
+  if (!e->busy) {
+    e->busy = 1;
+    job_push(e);
+  }
+  w.co = co_current();
+  w.port = portnum;
+  w.next = e->waiters;
+  e->waiters = &w;
+  pthread_mutex_unlock(&shards[s].lock);
+
+  if (co_park_deadline() < 0) {
+    /* e may be gone: once the helper has answered, it is evictable. Only
+       a busy entry has waiters, and those the shard never evicts, so if w
+       is still waiting, e is still host's entry */
+    pthread_mutex_lock(&shards[s].lock);
+    pp = NULL;
+    if ((e = shard_find(s, host)) != NULL) {
+      for (pp = &e->waiters; *pp != NULL && *pp != &w; pp = &(*pp)->next)
+        ;
+    }
+    if (pp != NULL && *pp == &w) {
+      *pp = w.next;
+      pthread_mutex_unlock(&shards[s].lock);
+      *err = EAI_SYSTEM; /* errno says ETIMEDOUT */
+      return NULL;
+    }
+    pthread_mutex_unlock(&shards[s].lock);
+    co_park(); /* Answered meanwhile; the helper is about to wake us */
+  }
+  *err = w.err;
+  return w.result;
+}
+
+/* Remember that host answered fastest over family */
+void dns_prefer(const char *host, int family) {
+  int s = shard_of(host);
+  dns_entry_t *e;
+
+  Pthread_once(&init_once, dns_init);
+  pthread_mutex_lock(&shards[s].lock);
+  if ((e = shard_find(s, host)) != NULL)
+    e->family = family;
+  pthread_mutex_unlock(&shards[s].lock);
+}
+
+long dns_cached(void) { return __atomic_load_n(&ncached, __ATOMIC_RELAXED); }
@@ -0,0 +1,24 @@
+/* $begin dns.h */
+#ifndef __DNS_H__
+#define __DNS_H__
+
+#include <netdb.h>
+
+/*
+ * Resolver cache keyed by hostname. Answers are kept for their DNS TTL,
+ * failures for conf.dns_negative_ttl. Lookups run on a small pool of helper
+ * threads: a coroutine that misses parks until its answer arrives, or its
+ * co_deadline() passes, instead of blocking its scheduler, and concurrent
+ * misses for one name share a single lookup. Names that keep being used
+ * are refreshed in the background shortly before they expire. Each name
+ * also remembers which address family connected first, and later answers
+ * list that family first.
+ */
+
+struct addrinfo *dns_lookup(const char *host, const char *port, int *err);
+void dns_free(struct addrinfo *list);
+void dns_prefer(const char *host, int family);
+long dns_cached(void); /* Names in the cache */
+
+#endif
+/* $end dns.h */
@@ -0,0 +1,98 @@
+#!/bin/bash
+#
+# driver.sh - Benchmark the three proxies of this repository against a local
+# origin: cache-proxy (this directory), first-cache and proxy.
+#
+# Each proxy runs in turn, in a scratch directory of its own, with the same
+# origin behind it and the same load in front; the load generator reports
+# throughput, latency quantiles and the hit ratio seen at the origin.
+#
+# usage: ./driver.sh [loadgen options]     e.g. ./driver.sh -c 32 -d 20 -z 1.1
+#
+# Environment:
+#   PROXIES      which to run, default "cache-proxy first-cache proxy"
+#   ORIGIN_OPTS  origin options, default "-s pareto:1024:1.2:262144 -l 1"
+#   ORIGIN_PORT  port the origin listens on, default 80
+#   PROXY_PORT   first port for the proxies under test, default 15213; each
+#                gets the next one, as the older two can't rebind a port
+#                that still has connections in TIME_WAIT
+#
+# first-cache and proxy always dial port 80 and close after one response,
+# so they are only run when the origin listens on port 80 (as root), and
+# are driven without keep-alive.
+
+set -e
+cd "$(dirname "$0")"
+
+PROXIES=${PROXIES:-"cache-proxy first-cache proxy"}
+ORIGIN_OPTS=${ORIGIN_OPTS:-"-s pareto:1024:1.2:262144 -l 1"}
+ORIGIN_PORT=${ORIGIN_PORT:-80}
+PROXY_PORT=${PROXY_PORT:-15213}
+CC=${CC:-gcc}
+
+work=$(mktemp -d)
+origin_pid=
+proxy_pid=
+cleanup() {
+  [ -n "$proxy_pid" ] && kill "$proxy_pid" 2>/dev/null
+  [ -n "$origin_pid" ] && kill "$origin_pid" 2>/dev/null
+  rm -rf "$work"
+}
+trap cleanup EXIT INT TERM
+
+# Wait until something accepts connections on port $1
+wait_port() {
+  i=0
+  while ! (exec 3<>"/dev/tcp/127.0.0.1/$1") 2>/dev/null; do
+    i=$((i + 1))
+    if [ $i -gt 50 ]; then
+      echo "nothing listening on port $1" >&2
+      return 1
+    fi
+    sleep 0.1
+  done
+}
+
+make -s proxy bench
+$CC -O2 -o "$work/first-cache" ../first-cache/proxy_cache.c -lpthread
+$CC -O2 -o "$work/proxy" ../proxy/proxy.c -lpthread
+
+bench/origin -p "$ORIGIN_PORT" $ORIGIN_OPTS &
+origin_pid=$!
+wait_port "$ORIGIN_PORT"
+kill -0 $origin_pid # it may have failed to bind, with another server there
+
+for name in $PROXIES; do
+  mkdir -p "$work/run-$name"
+  case $name in
+  cache-proxy)
+    bin=$PWD/proxy
+    keep=1
+    ;;
+  first-cache | proxy)
+    if [ "$ORIGIN_PORT" != 80 ]; then
+      echo "== $name skipped, it needs the origin on port 80"
+      continue
+    fi
+    bin=$work/$name
+    keep=0
+    ;;
+  *)
+    echo "unknown proxy $name" >&2
+    exit 1
+    ;;
+  esac
+  (cd "$work/run-$name" && exec "$bin" "$PROXY_PORT" >/dev/null 2>&1) &
+  proxy_pid=$!
+  wait_port "$PROXY_PORT"
+
+  echo "== $name"
+  bench/loadgen -x "127.0.0.1:$PROXY_PORT" -o "127.0.0.1:$ORIGIN_PORT" \
+    -k $keep "$@"
+  echo
+
+  kill "$proxy_pid"
+  wait "$proxy_pid" 2>/dev/null || true
+  proxy_pid=
+  PROXY_PORT=$((PROXY_PORT + 1))
+done
@@ -1,4 +1,12 @@
 #include "helpers.h"
+#include "co.h"
+#include "config.h"
+#include "dns.h"
+#include "log.h"
+#include "scan.h"
+#include "splice.h"
+#include "trace.h"
+#include <poll.h>
 
 /**************************
  * Error-handling functions
@@ -643,6 +651,27 @@ void V(sem_t *sem) {
  * The Rio package - Robust I/O functions
  ****************************************/
 
+/*
+ * rio_wait - Wait until fd is ready for events (CO_READ or CO_WRITE). Inside
+ *    a coroutine this parks the coroutine and lets its scheduler run others,
+ *    which turns every rio call on a non-blocking descriptor into a yield
+ *    point; elsewhere it simply blocks in poll().
+ */
+/* $begin rio_wait */
+int rio_wait(int fd, int events) {
+  struct pollfd pfd;
+
+  if (co_current() != NULL)
+    return co_wait_fd(fd, events);
+  pfd.fd = fd;
+  pfd.events =
+      (events & CO_READ ? POLLIN : 0) | (events & CO_WRITE ? POLLOUT : 0);
+  if (poll(&pfd, 1, -1) < 0 && errno != EINTR)
+    return -1;
+  return 0;
+}
+/* $end rio_wait */
+
 /*
  * rio_readn - Robustly read n bytes (unbuffered)
  */
@@ -656,6 +685,8 @@ ssize_t rio_readn(int fd, void *usrbuf, size_t n) {
     if ((nread = read(fd, bufp, nleft)) < 0) {
       if (errno == EINTR) /* Interrupted by sig handler return */
         nread = 0;        /* and call read() again */
+      else if (errno == EAGAIN && rio_wait(fd, CO_READ) == 0)
+        nread = 0; /* Non-blocking fd is readable again */
       else
         return -1; /* errno set by read() */
     } else if (nread == 0)
@@ -680,6 +711,8 @@ ssize_t rio_writen(int fd, void *usrbuf, size_t n) {
     if ((nwritten = write(fd, bufp, nleft)) <= 0) {
       if (errno == EINTR) /* Interrupted by sig handler return */
         nwritten = 0;     /* and call write() again */
+      else if (errno == EAGAIN && rio_wait(fd, CO_WRITE) == 0)
+        nwritten = 0; /* Non-blocking fd is writable again */
       else
         return -1; /* errno set by write() */
     }
@@ -690,6 +723,112 @@ ssize_t rio_writen(int fd, void *usrbuf, size_t n) {
 }
 /* $end rio_writen */
 
+/*
+ * rio_writev - Robustly write all of iov (unbuffered); iov is consumed
+ */
+ssize_t rio_writev(int fd, struct iovec *iov, int iovcnt) {
+  ssize_t nwritten, total = 0;
+
+  while (iovcnt > 0) {
+    if ((nwritten = writev(fd, iov, iovcnt)) < 0) {
+      if (errno == EINTR || (errno == EAGAIN && rio_wait(fd, CO_WRITE) == 0))
+        continue;
+      return -1;
+    }
+    total += nwritten;
+    while (iovcnt > 0 && (size_t)nwritten >= iov->iov_len) {
+      nwritten -= iov->iov_len;
+      iov++;
+      iovcnt--;
+    }
+    if (iovcnt > 0) {
+      iov->iov_base = (char *)iov->iov_base + nwritten;
+      iov->iov_len -= nwritten;
+    }
+  }
+  return total;
+}
+
+/*
+ * rio_splice - Move len bytes (or everything up to EOF if len < 0) from
+ *     infd to outfd. On Linux the data goes through a pipe with splice()
+ *     and never enters user space. Returns the number of bytes moved, or
+ *     -1 with errno set; a short count means infd hit EOF first.
+ */
+#ifdef __linux__
+#define SPLICE_PIPES 8 /* Empty pipes cached per thread */
+static __thread int splice_pipes[SPLICE_PIPES][2];
+static __thread int splice_npipes;
+
+ssize_t rio_splice(int infd, int outfd, ssize_t len) {
+  int p[2], ok = 0;
+  ssize_t n, m, total = 0;
+  size_t want;
+
+  if (splice_npipes > 0) {
+    splice_npipes--;
+    p[0] = splice_pipes[splice_npipes][0];
+    p[1] = splice_pipes[splice_npipes][1];
+  } else if (pipe(p) < 0) {
+    return -1;
+  }
+  while (len != 0) {
+    want = len < 0 || len > 65536 ? 65536 : len;
+    n = splice_move(infd, p[1], want);
+    if (n == 0) /* EOF */
+      break;
+    if (n < 0) {
+      if (errno == EINTR || (errno == EAGAIN && rio_wait(infd, CO_READ) == 0))
+        continue;
+      goto out;
+    }
+    total += n;
+    if (len > 0)
+      len -= n;
+    while (n > 0) { /* Drain the pipe before reading more */
+      m = splice_move(p[0], outfd, n);
+      if (m < 0) {
+        if (errno == EINTR ||
+            (errno == EAGAIN && rio_wait(outfd, CO_WRITE) == 0))
+          continue;
+        goto out;
+      }
+      n -= m;
+    }
+  }
+  ok = 1;
+out:
+  if (ok && splice_npipes < SPLICE_PIPES) { /* Only empty pipes go back */
+    splice_pipes[splice_npipes][0] = p[0];
+    splice_pipes[splice_npipes][1] = p[1];
+    splice_npipes++;
+  } else {
+    n = errno;
+    close(p[0]);
+    close(p[1]);
+    errno = n;
+  }
+  return ok ? total : -1;
+}
+#else
+ssize_t rio_splice(int infd, int outfd, ssize_t len) {
+  char buf[MAXBUF];
+  ssize_t n, total = 0;
+
+  while (len != 0) {
+    n = rio_readn(infd, buf, len < 0 || len > MAXBUF ? MAXBUF : len);
+    if (n <= 0)
+      return n < 0 ? -1 : total;
+    if (rio_writen(outfd, buf, n) < 0)
+      return -1;
+    total += n;
+    if (len > 0)
+      len -= n;
+  }
+  return total;
+}
+#endif
+
 /*
  * rio_read - This is a wrapper for the Unix read() function that
  *    transfers min(n, rio_cnt) bytes from an internal buffer to a user
@@ -705,6 +844,8 @@ static ssize_t rio_read(rio_t *rp, char *usrbuf, size_t n) {
   while (rp->rio_cnt <= 0) { /* Refill if buf is empty */
     rp->rio_cnt = read(rp->rio_fd, rp->rio_buf, sizeof(rp->rio_buf));
     if (rp->rio_cnt < 0) {
+      if (errno == EAGAIN && rio_wait(rp->rio_fd, CO_READ) == 0)
+        continue; /* Non-blocking fd is readable again */
       if (errno != EINTR) /* Interrupted by sig handler return */
         return -1;
     } else if (rp->rio_cnt == 0) /* EOF */
@@ -724,6 +865,34 @@ static ssize_t rio_read(rio_t *rp, char *usrbuf, size_t n) {
 }
 /* $end rio_read */
 
+/*
+ * rio_fill - Read more bytes into rp's buffer without consuming any, first
+ *    moving the unread bytes to its start so callers can parse them in
+ *    place. Returns the number of bytes added, 0 on EOF or when the buffer
+ *    is already full, -1 on error.
+ */
+/* $begin rio_fill */
+ssize_t rio_fill(rio_t *rp) {
+  ssize_t n;
+
+  if (rp->rio_bufptr != rp->rio_buf) {
+    memmove(rp->rio_buf, rp->rio_bufptr, rp->rio_cnt);
+    rp->rio_bufptr = rp->rio_buf;
+  }
+  if (rp->rio_cnt == RIO_BUFSIZE)
+    return 0;
+  while ((n = read(rp->rio_fd, rp->rio_buf + rp->rio_cnt,
+                   RIO_BUFSIZE - rp->rio_cnt)) < 0) {
+    if (errno == EAGAIN && rio_wait(rp->rio_fd, CO_READ) == 0)
+      continue; /* Non-blocking fd is readable again */
+    if (errno != EINTR)
+      return -1;
+  }
+  rp->rio_cnt += n;
+  return n;
+}
+/* $end rio_fill */
+
 /*
  * rio_readinitb - Associate a descriptor with a read buffer and reset buffer
  */
@@ -757,30 +926,34 @@ ssize_t rio_readnb(rio_t *rp, void *usrbuf, size_t n) {
 /* $end rio_readnb */
 
 /*
- * rio_readlineb - Robustly read a text line (buffered)
+ * rio_readlineb - Robustly read a text line (buffered); the line end is
+ *    searched for in the whole buffer at once rather than byte by byte
  */
 /* $begin rio_readlineb */
 ssize_t rio_readlineb(rio_t *rp, void *usrbuf, size_t maxlen) {
-  int n, rc;
-  char c, *bufp = usrbuf;
-
-  for (n = 1; n < maxlen; n++) {
-    if ((rc = rio_read(rp, &c, 1)) == 1) {
-      *bufp++ = c;
-      if (c == '\n') {
-        n++;
-        break;
-      }
-    } else if (rc == 0) {
-      if (n == 1)
-        return 0; /* EOF, no data read */
-      else
-        break; /* EOF, some data was read */
-    } else
-      return -1; /* Error */
+  char *bufp = usrbuf;
+  const char *nl = NULL;
+  size_t n = 0, cnt;
+
+  while (nl == NULL && n + 1 < maxlen) {
+    if (rp->rio_cnt <= 0) {
+      if (rio_read(rp, bufp, 0) < 0)
+        return -1; /* Error */
+      if (rp->rio_cnt == 0)
+        break; /* EOF, with or without data read */
+    }
+    cnt = rp->rio_cnt;
+    if (cnt > maxlen - 1 - n)
+      cnt = maxlen - 1 - n;
+    if ((nl = scan_any(rp->rio_bufptr, rp->rio_bufptr + cnt, "\n")) != NULL)
+      cnt = nl + 1 - rp->rio_bufptr;
+    memcpy(bufp + n, rp->rio_bufptr, cnt);
+    rp->rio_bufptr += cnt;
+    rp->rio_cnt -= cnt;
+    n += cnt;
   }
-  *bufp = 0;
-  return n - 1;
+  bufp[n] = 0;
+  return n;
 }
 /* $end rio_readlineb */
 
@@ -821,10 +994,82 @@ ssize_t Rio_readlineb(rio_t *rp, void *usrbuf, size_t maxlen) {
 /********************************
  * Client/server helper functions
  ********************************/
+/*
+ * connect_race - Connect to the first address of list that answers, in the
+ *     style of RFC 8305: start one non-blocking attempt, and each time
+ *     stagger ms pass (or an attempt fails) without a winner start the next
+ *     one too. The first to connect wins and the others are closed. Returns
+ *     the descriptor and sets *family, or -1 with errno set.
+ */
+#define RACE_MAX 8 /* Attempts in flight at once */
+static int connect_race(struct addrinfo *list, int stagger, int *family) {
+  int fds[RACE_MAX], fams[RACE_MAX];
+  int n = 0, i, fd, winner = -1, err = ECONNREFUSED, soerr;
+  socklen_t len;
+  struct addrinfo *p = list;
+
+  while (winner < 0 && (p != NULL || n > 0)) {
+    /* Start the next attempt */
+    if (p != NULL && n < RACE_MAX) {
+      fd = socket(p->ai_family, p->ai_socktype, p->ai_protocol);
+      if (fd >= 0) {
+        co_nonblock(fd);
+        if (connect(fd, p->ai_addr, p->ai_addrlen) == 0) {
+          winner = fd;
+          *family = p->ai_family;
+          break;
+        }
+        if (errno == EINPROGRESS) {
+          fds[n] = fd;
+          fams[n++] = p->ai_family;
+        } else {
+          err = errno;
+          close(fd);
+        }
+      } else {
+        err = errno;
+      }
+      p = p->ai_next;
+      if (n == 0)
+        continue;
+    }
+
+    /* Wait for one to finish; give the next address its turn after stagger */
+    if ((i = co_wait_any(fds, n, CO_WRITE, p ? stagger : 0)) < 0) {
+      err = errno; /* Deadline: give up on all of them */
+      break;
+    }
+    if (i == n)
+      continue;
+    soerr = 0;
+    len = sizeof(soerr);
+    if (getsockopt(fds[i], SOL_SOCKET, SO_ERROR, &soerr, &len) < 0)
+      soerr = errno;
+    if (soerr == 0) {
+      winner = fds[i];
+      *family = fams[i];
+    } else {
+      err = soerr;
+      close(fds[i]);
+    }
+    n--;
+    fds[i] = fds[n];
+    fams[i] = fams[n];
+  }
+
+  /* Cancel the losers */
+  for (i = 0; i < n; i++)
+    close(fds[i]);
+  if (winner < 0)
+    errno = err;
+  return winner;
+}
+
 /*
  * open_clientfd - Open connection to server at <hostname, port> and
  *     return a socket descriptor ready for reading and writing. This
- *     function is reentrant and protocol-independent.
+ *     function is reentrant and protocol-independent. Inside a coroutine
+ *     the addresses are raced with connect_race().
  *
  *     On error, returns:
  *       -2 for getaddrinfo error
@@ -832,19 +1077,30 @@ ssize_t Rio_readlineb(rio_t *rp, void *usrbuf, size_t maxlen) {
  */
 /* $begin open_clientfd */
 int open_clientfd(char *hostname, char *port) {
-  int clientfd, rc;
-  struct addrinfo hints, *listp, *p;
-
-  /* Get a list of potential server addresses */
-  memset(&hints, 0, sizeof(struct addrinfo));
-  hints.ai_socktype = SOCK_STREAM; /* Open a connection */
-  hints.ai_flags = AI_NUMERICSERV; /* ... using a numeric port arg. */
-  hints.ai_flags |= AI_ADDRCONFIG; /* Recommended for connections */
-  if ((rc = getaddrinfo(hostname, port, &hints, &listp)) != 0) {
-    fprintf(stderr, "getaddrinfo failed (%s:%s): %s\n", hostname, port,
-            gai_strerror(rc));
+  int clientfd, rc, family, err;
+  struct addrinfo *listp, *p;
+
+  /* Get a list of potential server addresses, through the resolver cache */
+  if ((listp = dns_lookup(hostname, port, &rc)) == NULL) {
+    err = errno; /* Callers tell a resolver timeout by ETIMEDOUT */
+    log_warn("getaddrinfo failed (%s:%s): %s", hostname, port,
+             rc == EAI_SYSTEM ? strerror(err) : gai_strerror(rc));
+    errno = err;
     return -2;
   }
+  trace_phase(TP_CONNECT);
+
+  if (co_current() != NULL) {
+    clientfd = connect_race(listp, conf.connect_stagger, &family);
+    rc = errno;
+    dns_free(listp);
+    if (clientfd < 0) {
+      errno = rc;
+      return -1;
+    }
+    dns_prefer(hostname, family);
+    return clientfd;
+  }
 
   /* Walk the list for one that we can successfully connect to */
   for (p = listp; p; p = p->ai_next) {
@@ -857,17 +1113,22 @@ int open_clientfd(char *hostname, char *port) {
       break; /* Success */
     if (close(clientfd) <
         0) { /* Connect failed, try another */ // line:netp:openclientfd:closefd
-      fprintf(stderr, "open_clientfd: close failed: %s\n", strerror(errno));
+      rc = errno;
+      log_error("open_clientfd: close failed: %s", strerror(rc));
+      dns_free(listp);
+      errno = rc;
       return -1;
     }
   }
 
   /* Clean up */
-  freeaddrinfo(listp);
-  if (!p) /* All connects failed */
+  rc = errno;
+  dns_free(listp);
+  if (!p) { /* All connects failed */
+    errno = rc;
     return -1;
-  else /* The last connect succeeded */
-    return clientfd;
+  }
+  return clientfd; /* The last connect succeeded */
 }
 /* $end open_clientfd */
 
@@ -890,8 +1151,7 @@ int open_listenfd(char *port) {
   hints.ai_flags = AI_PASSIVE | AI_ADDRCONFIG; /* ... on any IP address */
   hints.ai_flags |= AI_NUMERICSERV;            /* ... using port number */
   if ((rc = getaddrinfo(NULL, port, &hints, &listp)) != 0) {
-    fprintf(stderr, "getaddrinfo failed (port %s): %s\n", port,
-            gai_strerror(rc));
+    log_error("getaddrinfo failed (port %s): %s", port, gai_strerror(rc));
     return -2;
   }
 
@@ -909,7 +1169,10 @@ int open_listenfd(char *port) {
     if (bind(listenfd, p->ai_addr, p->ai_addrlen) == 0)
       break;                   /* Success */
     if (close(listenfd) < 0) { /* Bind failed, try the next */
-      fprintf(stderr, "open_listenfd close failed: %s\n", strerror(errno));
+      rc = errno;
+      log_error("open_listenfd close failed: %s", strerror(rc));
+      freeaddrinfo(listp);
+      errno = rc;
       return -1;
     }
   }
@@ -0,0 +1,758 @@
+#include "http.h"
+#include "scan.h"
+#include <ctype.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+#define HTTP_MAX_QUERY 8192 /* A whole request head fits in this much */
+#define HTTP_MAX_PARAMS 64  /* Queries with more are not reordered */
+
+/* Hop-by-hop headers (RFC 7230 6.1) that must not be forwarded */
+static const char *hop_headers[] = {
+    "Connection",          "Keep-Alive",         "Proxy-Connection",
+    "Proxy-Authorization", "Proxy-Authenticate", "TE",
+    "Trailer",             "Upgrade"};
+
+/* True if line is a header named name (case-insensitive) */
+int http_header_is(const char *line, const char *name) {
+  size_t len = strlen(name);
+  return strncasecmp(line, name, len) == 0 && line[len] == ':';
+}
+
+/* Case-insensitive search for token inside the n bytes of a header value */
+static int has_token_n(const char *v, size_t n, const char *token) {
+  size_t len = strlen(token);
+  for (; n >= len; v++, n--) {
+    if (strncasecmp(v, token, len) == 0)
+      return 1;
+  }
+  return 0;
+}
+
+static int has_token(const char *v, const char *token) {
+  return has_token_n(v, strlen(v), token);
+}
+
+static const char *header_value(const char *line) {
+  const char *v = strchr(line, ':') + 1;
+  while (*v == ' ' || *v == '\t')
+    v++;
+  return v;
+}
+
+/* Copy header value v without its line end; too long values are dropped */
+static void copy_value(char *dst, size_t size, const char *v) {
+  size_t len = strcspn(v, "\r\n");
+  if (len >= size)
+    len = 0;
+  memcpy(dst, v, len);
+  dst[len] = '\0';
+}
+
+/* True if span s of buf is str (case-insensitive) */
+int http_span_is(const char *buf, http_span_t s, const char *str) {
+  return strlen(str) == s.len && strncasecmp(buf + s.off, str, s.len) == 0;
+}
+
+static http_span_t span(const char *buf, const char *p, const char *end) {
+  http_span_t s = {(unsigned)(p - buf), (unsigned)(end - p)};
+  return s;
+}
+
+void http_req_init(http_req_t *r) {
+  memset(r, 0, offsetof(http_req_t, fields));
+}
+
+/* Split an absolute-form target, "scheme://host[:port][/path][?query]" */
+static int split_target(http_req_t *r, const char *buf) {
+  const char *p = buf + r->target.off, *end = p + r->target.len, *q;
+  long port = 0;
+
+  for (q = p; q < end && isalpha((unsigned char)*q); q++)
+    ;
+  if (q == p || end - q < 3 || memcmp(q, "://", 3) != 0)
+    return -1;
+  r->scheme = span(buf, p, q);
+  p = q + 3;
+  if (p < end && *p == '[') {
+    if ((q = memchr(p, ']', end - p)) == NULL)
+      return -1;
+    r->host = span(buf, p + 1, q++);
+  } else {
+    if ((q = scan_any(p, end, ":/?")) == NULL)
+      q = end;
+    r->host = span(buf, p, q);
+  }
+  if (r->host.len == 0 || (q < end && *q != ':' && *q != '/' && *q != '?'))
+    return -1;
+  if (q < end && *q == ':') {
+    for (p = ++q; q < end && q - p < 5 && isdigit((unsigned char)*q); q++)
+      port = port * 10 + *q - '0';
+    if ((q < end && *q != '/' && *q != '?') || (q > p && port == 0) ||
+        port > 65535)
+      return -1;
+  }
+  r->path = span(buf, q, end);
+  r->port = port ? port : 80;
+  return 0;
+}
+
+/* "METHOD target HTTP/1.x" between p and end */
+static int parse_request_line(http_req_t *r, const char *buf, const char *p,
+                              const char *end) {
+  const char *sp1, *sp2;
+
+  if ((sp1 = scan_any(p, end, " ")) == NULL || sp1 == p)
+    return -1;
+  if ((sp2 = scan_any(sp1 + 1, end, " ")) == NULL || sp2 == sp1 + 1)
+    return -1;
+  if (end - sp2 != 9 || memcmp(sp2 + 1, "HTTP/1.", 7) != 0 ||
+      !isdigit((unsigned char)sp2[8]))
+    return -1;
+  r->method = span(buf, p, sp1);
+  r->target = span(buf, sp1 + 1, sp2);
+  r->minor = sp2[8] - '0';
+  split_target(r, buf); /* port stays 0 unless absolute-form */
+  return 0;
+}
+
+/* "Name: value" between p and end; next is where the following line starts */
+static int parse_field(http_req_t *r, const char *buf, const char *p,
+                       const char *end, const char *next) {
+  http_field_t *f;
+  const char *colon, *q;
+
+  /* A name holds no whitespace, which also rejects obsolete line folding */
+  if ((colon = scan_any(p, end, ":")) == NULL || colon == p)
+    return HTTP_PARSE_BAD;
+  for (q = p; q < colon; q++) {
+    if (*q == ' ' || *q == '\t')
+      return HTTP_PARSE_BAD;
+  }
+  if (r->nfields == HTTP_MAX_FIELDS)
+    return HTTP_PARSE_LARGE;
+  f = &r->fields[r->nfields++];
+  f->line = span(buf, p, next);
+  f->name = span(buf, p, colon);
+  for (q = colon + 1; q < end && (*q == ' ' || *q == '\t'); q++)
+    ;
+  while (end > q && (end[-1] == ' ' || end[-1] == '\t'))
+    end--;
+  f->value = span(buf, q, end);
+  return 0;
+}
+
+/*
+ * http_req_parse - Parse the len bytes of buf, a request head so far, on
+ *     from where the last call for r stopped; each line is searched for its
+ *     end only once. Returns one of the HTTP_PARSE_* codes.
+ */
+int http_req_parse(http_req_t *r, const char *buf, size_t len) {
+  const char *p, *end, *nl;
+  unsigned next;
+  int rc;
+
+  while ((nl = scan_any(buf + r->scan, buf + len, "\n")) != NULL) {
+    p = buf + r->start;
+    end = nl > p && nl[-1] == '\r' ? nl - 1 : nl;
+    next = nl + 1 - buf;
+    if (r->lines == 0) {
+      /* Empty lines ahead of a request are ignored (RFC 9112 2.2) */
+      if (end > p && parse_request_line(r, buf, p, end) < 0)
+        return HTTP_PARSE_BAD;
+      r->lines = end > p;
+    } else if (end == p) {
+      r->head_len = next;
+      return HTTP_PARSE_DONE;
+    } else {
+      if ((rc = parse_field(r, buf, p, end, nl + 1)) < 0)
+        return rc;
+      r->lines++;
+    }
+    r->start = r->scan = next;
+  }
+  r->scan = len;
+  return HTTP_PARSE_MORE;
+}
+
+static int hex_value(char c) {
+  if (isdigit((unsigned char)c))
+    return c - '0';
+  c = tolower((unsigned char)c);
+  return c >= 'a' && c <= 'f' ? c - 'a' + 10 : -1;
+}
+
+/* Decode escaped unreserved characters and uppercase the hex digits of the
+ * rest (RFC 3986 6.2.2.1-2); returns the new length */
+static size_t normalize_escapes(char *s, size_t n) {
+  static const char hex[] = "0123456789ABCDEF";
+  size_t i, o = 0;
+  int hi, lo, c;
+
+  for (i = 0; i < n; i++) {
+    if (s[i] != '%' || i + 2 >= n ||
+        (hi = hex_value(s[i + 1])) < 0 || (lo = hex_value(s[i + 2])) < 0) {
+      s[o++] = s[i];
+      continue;
+    }
+    c = hi * 16 + lo;
+    if (isalnum(c) || c == '-' || c == '.' || c == '_' || c == '~') {
+      s[o++] = c;
+    } else {
+      s[o++] = '%';
+      s[o++] = hex[hi];
+      s[o++] = hex[lo];
+    }
+    i += 2;
+  }
+  return o;
+}
+
+/* Remove "." and ".." segments from the absolute path in the n bytes at p
+ * (RFC 3986 5.2.4); returns the new length */
+static size_t remove_dot_segments(char *p, size_t n) {
+  char *in = p, *end = p + n, *out = p;
+
+  while (in < end) {
+    if (end - in >= 2 && in[0] == '/' && in[1] == '.' &&
+        (end - in == 2 || in[2] == '/')) {
+      in += 2; /* "/." */
+    } else if (end - in >= 3 && in[0] == '/' && in[1] == '.' &&
+               in[2] == '.' && (end - in == 3 || in[3] == '/')) {
+      in += 3; /* "/..": drop the last segment written */
+      while (out > p && *--out != '/')
+        ;
+    } else {
+      do
+        *out++ = *in++;
+      while (in < end && *in != '/');
+      continue;
+    }
+    if (in == end)
+      *out++ = '/';
+  }
+  return out - p;
+}
+
+/* True if the query parameter of n bytes at q is named in list */
+static int param_listed(const char *q, size_t n, const char *list) {
+  size_t name = strcspn(q, "=&"), len;
+
+  if (name > n)
+    name = n;
+  while (*list) {
+    len = strcspn(list, ",");
+    if (len == name && strncmp(list, q, len) == 0)
+      return 1;
+    list += len + (list[len] == ',');
+  }
+  return 0;
+}
+
+/* Order parameters by name; ones of the same name keep their order, which
+ * may matter to the origin */
+static int param_cmp(const void *a, const void *b) {
+  const char *x = *(const char **)a, *y = *(const char **)b;
+  size_t nx = strcspn(x, "=&"), ny = strcspn(y, "=&");
+  int c = strncmp(x, y, nx < ny ? nx : ny);
+
+  if (c == 0)
+    c = (nx > ny) - (nx < ny);
+  return c != 0 ? c : (x > y) - (x < y);
+}
+
+/*
+ * http_normalize_path - Rewrite a request's path and query, in place, into
+ *     the canonical form cache keys are built from: escapes normalized, dot
+ *     segments removed and, in the query, the parameters named in strip
+ *     (comma-separated) dropped and the rest sorted if sort is set.
+ *     Equivalent URLs then share one cache entry.
+ */
+void http_normalize_path(char *path, const char *strip, int sort) {
+  char query[HTTP_MAX_QUERY], *params[HTTP_MAX_PARAMS], *q, *o;
+  size_t n = normalize_escapes(path, strlen(path)), plen, len;
+  int i, np = 0;
+
+  path[n] = '\0';
+  plen = strcspn(path, "?");
+  q = path + plen;
+  plen = remove_dot_segments(path, plen);
+  if (*q == '\0') {
+    path[plen] = '\0';
+    return;
+  }
+  /* Split the query into its parameters, keeping the ones not stripped */
+  len = strlen(q + 1);
+  if (len >= sizeof(query))
+    len = sizeof(query) - 1;
+  memcpy(query, q + 1, len);
+  query[len] = '\0';
+  for (o = query; np < HTTP_MAX_PARAMS; o += len + 1) {
+    len = strcspn(o, "&");
+    if (len > 0 && !param_listed(o, len, strip))
+      params[np++] = o;
+    if (o[len] == '\0')
+      break;
+  }
+  if (np == HTTP_MAX_PARAMS) { /* Too many to reorder; leave the query alone */
+    memmove(path + plen, q, strlen(q) + 1);
+    return;
+  }
+  if (sort)
+    qsort(params, np, sizeof(params[0]), param_cmp);
+  o = path + plen;
+  for (i = 0; i < np; i++) {
+    *o++ = i == 0 ? '?' : '&';
+    len = strcspn(params[i], "&");
+    memcpy(o, params[i], len);
+    o += len;
+  }
+  *o = '\0';
+}
+
+/* Digits-only number in n bytes at v, -1 if it is not one */
+static long span_long(const char *v, size_t n) {
+  long x = 0;
+
+  if (n == 0 || n > 18)
+    return -1;
+  for (; n > 0; v++, n--) {
+    if (!isdigit((unsigned char)*v))
+      return -1;
+    x = x * 10 + *v - '0';
+  }
+  return x;
+}
+
+/*
+ * http_req_head - Fill h from the parsed head r of buf. Returns -1 if the
+ *     head has a Content-Length that isn't a plain number, or several that
+ *     disagree: where its body ends would then be a guess, and a guess that
+ *     differs from the origin's lets a request hide inside another one
+ *     (RFC 7230 3.3.3).
+ */
+int http_req_head(const http_req_t *r, const char *buf, req_head_t *h) {
+  const http_field_t *f;
+  const char *v;
+  long len;
+  int i;
+
+  h->minor = r->minor;
+  h->content_length = -1;
+  h->chunked = 0;
+  h->keep_alive = r->minor >= 1;
+  for (i = 0; i < r->nfields; i++) {
+    f = &r->fields[i];
+    v = buf + f->value.off;
+    if (http_span_is(buf, f->name, "Content-Length")) {
+      len = span_long(v, f->value.len);
+      if (len < 0 || (h->content_length >= 0 && h->content_length != len))
+        return -1;
+      h->content_length = len;
+    } else if (http_span_is(buf, f->name, "Transfer-Encoding")) {
+      h->chunked = has_token_n(v, f->value.len, "chunked");
+    } else if (http_span_is(buf, f->name, "Connection") ||
+               http_span_is(buf, f->name, "Proxy-Connection")) {
+      if (has_token_n(v, f->value.len, "close"))
+        h->keep_alive = 0;
+      else if (has_token_n(v, f->value.len, "keep-alive"))
+        h->keep_alive = 1;
+    }
+  }
+  return 0;
+}
+
+/* True if directive name starts v, followed by a delimiter */
+static int is_directive(const char *v, const char *name) {
+  size_t len = strlen(name);
+  return strncasecmp(v, name, len) == 0 && strchr(",= \t\r\n", v[len]) != NULL;
+}
+
+/* Pick out the Cache-Control directives that matter to a shared cache */
+static void parse_cache_control(const char *v, resp_head_t *h) {
+  while (*v && *v != '\r' && *v != '\n') {
+    if (*v == ',' || *v == ' ' || *v == '\t') {
+      v++;
+      continue;
+    }
+    if (is_directive(v, "max-age"))
+      h->max_age = strtol(v + 8, NULL, 10);
+    else if (is_directive(v, "s-maxage"))
+      h->s_maxage = strtol(v + 9, NULL, 10);
+    else if (is_directive(v, "no-store"))
+      h->no_store = 1;
+    else if (is_directive(v, "no-cache"))
+      h->no_cache = 1;
+    else if (is_directive(v, "must-revalidate") ||
+             is_directive(v, "proxy-revalidate"))
+      h->must_revalidate = 1;
+    else if (is_directive(v, "private"))
+      h->is_private = 1;
+    else if (is_directive(v, "public"))
+      h->is_public = 1;
+    v += strcspn(v, ",\r\n"); /* Next directive */
+  }
+}
+
+/* Parse an IMF-fixdate, "Sun, 06 Nov 1994 08:49:37 GMT"; -1 if invalid */
+time_t http_parse_date(const char *v) {
+  static const char months[] = "JanFebMarAprMayJunJulAugSepOctNovDec";
+  char mon[4];
+  const char *m;
+  int d, y, hh, mi, ss, mo;
+  long era, yoe, doy, doe;
+
+  if (sscanf(v, "%*3s, %d %3s %d %d:%d:%d GMT", &d, mon, &y, &hh, &mi,
+             &ss) != 6)
+    return -1;
+  if ((m = strstr(months, mon)) == NULL || (m - months) % 3 != 0)
+    return -1;
+  mo = (m - months) / 3 + 1;
+  /* Days since 1970-01-01 of a proleptic Gregorian date */
+  y -= mo <= 2;
+  era = y / 400;
+  yoe = y - era * 400;
+  doy = (153 * (mo > 2 ? mo - 3 : mo + 9) + 2) / 5 + d - 1;
+  doe = yoe * 365 + yoe / 4 - yoe / 100 + doy;
+  return (time_t)(era * 146097 + doe - 719468) * 86400 + hh * 3600 + mi * 60 +
+         ss;
+}
+
+/* Copy the value of header line, without its line end, into dst */
+void http_header_copy(const char *line, char *dst, size_t size) {
+  copy_value(dst, size, header_value(line));
+}
+
+/*
+ * http_parse_range - Parse a Range value ("bytes=0-99,200-,-50") against a
+ *     body of len bytes into at most max ranges. Returns how many can be
+ *     satisfied (0: none, a 416), or -1 if the header is to be ignored and
+ *     the whole body sent.
+ */
+int http_parse_range(const char *v, long len, http_range_t *r, int max) {
+  char *end;
+  long a, b;
+  int n = 0;
+
+  while (*v == ' ' || *v == '\t')
+    v++;
+  if (strncasecmp(v, "bytes=", 6) != 0)
+    return -1;
+  for (v += 6;; v++) {
+    while (*v == ' ' || *v == '\t')
+      v++;
+    if (*v == '-') { /* Suffix: the last b bytes */
+      b = strtol(v + 1, &end, 10);
+      if (end == v + 1)
+        return -1;
+      a = len - b < 0 ? 0 : len - b;
+      b = b > 0 ? len - 1 : -1;
+    } else {
+      a = strtol(v, &end, 10);
+      if (end == v || *end != '-')
+        return -1;
+      v = end + 1;
+      if (isdigit((unsigned char)*v)) {
+        b = strtol(v, &end, 10);
+        if (b < a)
+          return -1;
+      } else {
+        b = len - 1;
+        end = (char *)v;
+      }
+      if (b > len - 1)
+        b = len - 1;
+    }
+    if (a <= b && a < len) {
+      if (n == max)
+        return -1; /* Too many pieces to be worth it */
+      r[n].first = a;
+      r[n].last = b;
+      n++;
+    }
+    for (v = end; *v == ' ' || *v == '\t'; v++)
+      ;
+    if (*v != ',')
+      break;
+  }
+  return *v == '\0' || *v == '\r' || *v == '\n' ? n : -1;
+}
+
+/* Parse "HTTP/1.x 200 OK"; returns 0 on success, -1 if malformed */
+int http_parse_status(const char *line, resp_head_t *h) {
+  h->content_length = -1;
+  h->chunked = 0;
+  h->etag[0] = '\0';
+  h->last_modified[0] = '\0';
+  h->max_age = h->s_maxage = h->age = -1;
+  h->date = h->expires = -1;
+  h->no_store = h->no_cache = h->is_private = h->is_public = 0;
+  h->must_revalidate = 0;
+  h->set_cookie = 0;
+  h->range_total = -1;
+  h->vary[0] = '\0';
+  if (sscanf(line, "HTTP/1.%d %d", &h->minor, &h->status) != 2)
+    return -1;
+  h->keep_alive = h->minor >= 1; /* 1.1 is persistent unless told not */
+  return 0;
+}
+
+/* Append the names of a Vary value to h->vary; "*" or too many names make
+ * the response vary on anything */
+static void add_vary(resp_head_t *h, const char *v) {
+  size_t len = strlen(h->vary), n;
+
+  while (strcmp(h->vary, "*") != 0) {
+    v += strspn(v, ", \t");
+    if ((n = strcspn(v, ", \t\r\n")) == 0)
+      return;
+    if ((n == 1 && *v == '*') || len + n + 2 > sizeof(h->vary)) {
+      strcpy(h->vary, "*");
+      return;
+    }
+    if (len > 0)
+      h->vary[len++] = ',';
+    for (; n > 0; n--)
+      h->vary[len++] = tolower((unsigned char)*v++);
+    h->vary[len] = '\0';
+  }
+}
+
+/* Update h from one response header line */
+void http_parse_resp_header(const char *line, resp_head_t *h) {
+  const char *v = scan_any(line, line + strlen(line), ":");
+
+  if (v == NULL)
+    return;
+  for (v++; *v == ' ' || *v == '\t'; v++)
+    ;
+  if (http_header_is(line, "Content-Length")) {
+    h->content_length = strtol(v, NULL, 10);
+  } else if (http_header_is(line, "Transfer-Encoding")) {
+    h->chunked = has_token(v, "chunked");
+  } else if (http_header_is(line, "Connection")) {
+    if (has_token(v, "close"))
+      h->keep_alive = 0;
+    else if (has_token(v, "keep-alive"))
+      h->keep_alive = 1;
+  } else if (http_header_is(line, "ETag")) {
+    copy_value(h->etag, sizeof(h->etag), v);
+  } else if (http_header_is(line, "Last-Modified")) {
+    copy_value(h->last_modified, sizeof(h->last_modified), v);
+  } else if (http_header_is(line, "Cache-Control")) {
+    parse_cache_control(v, h);
+  } else if (http_header_is(line, "Pragma")) {
+    h->no_cache |= has_token(v, "no-cache");
+  } else if (http_header_is(line, "Expires")) {
+    h->expires = http_parse_date(v);
+    if (h->expires < 0)
+      h->expires = 0;
+  } else if (http_header_is(line, "Date")) {
+    h->date = http_parse_date(v);
+  } else if (http_header_is(line, "Age")) {
+    h->age = strtol(v, NULL, 10);
+  } else if (http_header_is(line, "Set-Cookie")) {
+    h->set_cookie = 1;
+  } else if (http_header_is(line, "Vary")) {
+    add_vary(h, v);
+  } else if (http_header_is(line, "Content-Range")) {
+    if ((v = scan_any(v, v + strlen(v), "/")) != NULL && v[1] != '*')
+      h->range_total = strtol(v + 1, NULL, 10);
+  }
+}
+
+/* Nothing in the response keeps a shared cache from storing it */
+static int shareable(const resp_head_t *h, int authorized) {
+  if (h->no_store || h->is_private || h->set_cookie ||
+      strcmp(h->vary, "*") == 0)
+    return 0;
+  if (authorized && !h->is_public && h->s_maxage < 0)
+    return 0;
+  return 1;
+}
+
+/*
+ * http_cacheable - May a shared cache store this response? authorized is
+ *     true if the request carried Authorization.
+ */
+int http_cacheable(const resp_head_t *h, int authorized) {
+  switch (h->status) {
+  case 200: case 203: case 300: case 301: case 410:
+    return shareable(h, authorized);
+  default:
+    return 0;
+  }
+}
+
+/*
+ * http_negative - May a shared cache keep this error response for a short
+ *     while, to spare the origin repeated requests for a missing or failing
+ *     URL? Transient 5xx errors qualify as well as 404-like ones.
+ */
+int http_negative(const resp_head_t *h, int authorized) {
+  switch (h->status) {
+  case 404: case 405: case 414: case 501:
+  case 500: case 502: case 503: case 504:
+    return shareable(h, authorized);
+  default:
+    return 0;
+  }
+}
+
+/*
+ * http_freshness - Seconds the response stays fresh from now (RFC 9111
+ *     4.2): s-maxage, then max-age, then Expires, then a tenth of the time
+ *     since Last-Modified, and fallback when the response says nothing.
+ *     Time it already spent in other caches (Age) is deducted.
+ */
+long http_freshness(const resp_head_t *h, time_t now, long fallback) {
+  time_t date = h->date >= 0 ? h->date : now, lm;
+  long lifetime;
+
+  if (h->no_cache)
+    return 0;
+  if (h->s_maxage >= 0)
+    lifetime = h->s_maxage;
+  else if (h->max_age >= 0)
+    lifetime = h->max_age;
+  else if (h->expires >= 0)
+    lifetime = h->expires > date ? h->expires - date : 0;
+  else if ((lm = http_parse_date(h->last_modified)) >= 0 && lm < date)
+    lifetime = (date - lm) / 10 < HTTP_HEURISTIC_MAX ? (date - lm) / 10
+                                                      : HTTP_HEURISTIC_MAX;
+  else
+    lifetime = fallback;
+  if (h->age > 0)
+    lifetime -= h->age;
+  return lifetime > 0 ? lifetime : 0;
+}
+
+/* Responses to GET without a body: 1xx, 204 and 304 */
+int http_has_body(const resp_head_t *h) {
+  return !(h->status / 100 == 1 || h->status == 204 || h->status == 304);
+}
+
+/* Append the n bytes at src to key, keeping count in *len; -1 if full */
+static int key_add(char *key, size_t size, size_t *len, const char *src,
+                   size_t n) {
+  if (*len + n >= size)
+    return -1;
+  memcpy(key + *len, src, n);
+  *len += n;
+  key[*len] = '\0';
+  return 0;
+}
+
+/*
+ * Append header value v, up to its line end, with whitespace trimmed and
+ * runs of it collapsed, and none around commas. Values of the Accept
+ * family are case-insensitive and get lowercased too.
+ */
+static int key_add_value(char *key, size_t size, size_t *len, const char *v,
+                         int fold) {
+  const char *end = v + strcspn(v, "\r\n");
+  int space = 0;
+  char c;
+
+  for (; v < end; v++) {
+    if (*v == ' ' || *v == '\t') {
+      space = 1;
+      continue;
+    }
+    c = fold ? tolower((unsigned char)*v) : *v;
+    if (space && c != ',' && *len > 0 && key[*len - 1] != ',' &&
+        key[*len - 1] != '=' && key_add(key, size, len, " ", 1) < 0)
+      return -1;
+    space = 0;
+    if (key_add(key, size, len, &c, 1) < 0)
+      return -1;
+  }
+  return 0;
+}
+
+/*
+ * http_variant_key - Build the key of the variant of path that a request
+ *     with header lines hdrs (len bytes) selects, for a response that
+ *     varies on the names in vary: the path, then "\nname=value" for each
+ *     name, with repeated headers joined by commas. A line end can't be
+ *     part of a path, so variants never collide with plain URLs. Returns -1
+ *     if the key doesn't fit in size bytes.
+ */
+int http_variant_key(const char *vary, const char *hdrs, size_t len,
+                     const char *path, char *key, size_t size) {
+  const char *name = vary, *line, *end = hdrs + len, *eol;
+  size_t klen = 0, n;
+  int found;
+
+  if (key_add(key, size, &klen, path, strlen(path)) < 0)
+    return -1;
+  for (; *name; name += n + (name[n] == ',')) {
+    n = strcspn(name, ",");
+    if (key_add(key, size, &klen, "\n", 1) < 0 ||
+        key_add(key, size, &klen, name, n) < 0 ||
+        key_add(key, size, &klen, "=", 1) < 0)
+      return -1;
+    found = 0;
+    for (line = hdrs; line < end; line = eol + 1) {
+      if ((eol = memchr(line, '\n', end - line)) == NULL)
+        break;
+      if (strncasecmp(line, name, n) != 0 || line[n] != ':')
+        continue;
+      if ((found++ && key_add(key, size, &klen, ",", 1) < 0) ||
+          key_add_value(key, size, &klen, header_value(line),
+                        strncmp(name, "accept", 6) == 0) < 0)
+        return -1;
+    }
+  }
+  return 0;
+}
+
+/* True if the client header line goes on to the origin unchanged; the
+ * proxy writes its own Host, User-Agent and Connection, and doesn't
+ * forward request bodies */
+int http_is_forwarded(const char *line) {
+  return strchr(line, ':') != NULL && !http_is_hop_header(line) &&
+         !http_header_is(line, "Host") &&
+         !http_header_is(line, "User-Agent") &&
+         !http_header_is(line, "Content-Length") &&
+         !http_header_is(line, "Transfer-Encoding");
+}
+
+int http_is_hop_header(const char *line) {
+  size_t i;
+  for (i = 0; i < sizeof(hop_headers) / sizeof(hop_headers[0]); i++) {
+    if (http_header_is(line, hop_headers[i]))
+      return 1;
+  }
+  return 0;
+}
+
+/*
+ * http_connection_lists - Does a Connection header of request hr list the
+ *     field called name among its options? Such fields are meant for this
+ *     hop only (RFC 7230 6.1).
+ */
+int http_connection_lists(const http_req_t *hr, const char *buf,
+                          http_span_t name) {
+  const char *v, *end, *tok;
+  int i;
+
+  for (i = 0; i < hr->nfields; i++) {
+    if (!http_span_is(buf, hr->fields[i].name, "Connection"))
+      continue;
+    v = buf + hr->fields[i].value.off;
+    end = v + hr->fields[i].value.len;
+    while (v < end) {
+      while (v < end && (*v == ',' || *v == ' ' || *v == '\t'))
+        v++;
+      for (tok = v; v < end && *v != ',' && *v != ' ' && *v != '\t'; v++)
+        ;
+      if (v > tok && (size_t)(v - tok) == name.len &&
+          strncasecmp(tok, buf + name.off, name.len) == 0)
+        return 1;
+    }
+  }
+  return 0;
+}
@@ -0,0 +1,113 @@
+/* $begin http.h */
+#ifndef __HTTP_H__
+#define __HTTP_H__
+
+#include <stddef.h>
+#include <time.h>
+
+#define HTTP_HEURISTIC_MAX 86400 /* Cap on Last-Modified based lifetimes, s */
+
+/* What the proxy needs to know about an origin response head */
+typedef struct {
+  int status;
+  int minor;           /* HTTP/1.<minor> */
+  long content_length; /* -1 when absent */
+  int chunked;         /* Transfer-Encoding: chunked */
+  int keep_alive;      /* Connection may carry another request */
+  char etag[256];      /* Validators, "" when absent */
+  char last_modified[64];
+  /* Freshness and cacheability; -1 marks absent numbers and dates */
+  long max_age;
+  long s_maxage;
+  long age;
+  time_t date;
+  time_t expires; /* An unparsable Expires reads as already expired */
+  int no_store;
+  int no_cache;
+  int must_revalidate; /* must-revalidate or proxy-revalidate */
+  int is_private;
+  int is_public;
+  int set_cookie;
+  long range_total; /* Full length from a 206's Content-Range, -1 if unknown */
+  char vary[256];   /* Vary names, lowercase and comma-separated; "*": any */
+} resp_head_t;
+
+/* One byte range, both ends inclusive */
+typedef struct {
+  long first;
+  long last;
+} http_range_t;
+
+/* What the proxy needs to know about a client request head */
+typedef struct {
+  int minor;           /* HTTP/1.<minor> */
+  long content_length; /* -1 when absent */
+  int chunked;         /* Transfer-Encoding: chunked */
+  int keep_alive;      /* Client wants to send another request */
+} req_head_t;
+
+/* A view into the buffer a request was parsed from */
+typedef struct {
+  unsigned off;
+  unsigned len;
+} http_span_t;
+
+typedef struct {
+  http_span_t line;  /* The whole line, line end included */
+  http_span_t name;
+  http_span_t value; /* Without surrounding whitespace */
+} http_field_t;
+
+#define HTTP_MAX_FIELDS 100
+
+#define HTTP_PARSE_MORE 0   /* Head incomplete, call again with more bytes */
+#define HTTP_PARSE_DONE 1   /* Head complete, head_len bytes long */
+#define HTTP_PARSE_BAD -1   /* Malformed request line or header */
+#define HTTP_PARSE_LARGE -2 /* More than HTTP_MAX_FIELDS headers */
+
+/*
+ * Incremental parse state of a request head. Nothing is copied: every part
+ * is a span relative to the start of the head, so the caller may move the
+ * bytes between calls as long as the head stays at the start.
+ */
+typedef struct {
+  unsigned start; /* Line being parsed */
+  unsigned scan;  /* Bytes of it already searched for a line end */
+  int lines;      /* Complete lines so far */
+  unsigned head_len;
+  http_span_t method;
+  http_span_t target;
+  int minor; /* HTTP/1.<minor> */
+  /* Parts of an absolute-form target; path is empty when the URI has none */
+  http_span_t scheme;
+  http_span_t host; /* An IPv6 literal without its brackets */
+  http_span_t path;
+  int port;         /* 0 if not absolute-form, 80 when not given */
+  int nfields;
+  http_field_t fields[HTTP_MAX_FIELDS];
+} http_req_t;
+
+void http_req_init(http_req_t *r);
+int http_req_parse(http_req_t *r, const char *buf, size_t len);
+int http_req_head(const http_req_t *r, const char *buf, req_head_t *h);
+int http_span_is(const char *buf, http_span_t s, const char *str);
+int http_parse_status(const char *line, resp_head_t *h);
+void http_parse_resp_header(const char *line, resp_head_t *h);
+int http_has_body(const resp_head_t *h);
+int http_cacheable(const resp_head_t *h, int authorized);
+int http_negative(const resp_head_t *h, int authorized);
+long http_freshness(const resp_head_t *h, time_t now, long fallback);
+time_t http_parse_date(const char *v);
+int http_parse_range(const char *v, long len, http_range_t *r, int max);
+void http_header_copy(const char *line, char *dst, size_t size);
+void http_normalize_path(char *path, const char *strip, int sort);
+int http_variant_key(const char *vary, const char *hdrs, size_t len,
+                     const char *path, char *key, size_t size);
+int http_is_hop_header(const char *line);
+int http_is_forwarded(const char *line);
+int http_connection_lists(const http_req_t *hr, const char *buf,
+                          http_span_t name);
+int http_header_is(const char *line, const char *name);
+
+#endif
+/* $end http.h */
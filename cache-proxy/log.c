@@ -0,0 +1,169 @@
+#include "log.h"
+#include "helpers.h"
+#include <stdarg.h>
+
+#define LOG_TEXT_SIZE (LOG_RECORD_SIZE - 16)
+
+typedef struct {
+  long sec;      /* Wall clock time of the record */
+  int msec;
+  short level;
+  short len;     /* Text bytes, without a newline */
+  char text[LOG_TEXT_SIZE];
+} log_rec_t;
+
+/*
+ * One producer, the owning thread, and one consumer, the drain thread: head
+ * is only written by the first and tail only by the second, so a release
+ * store on either publishes the records in between.
+ */
+typedef struct log_ring {
+  log_rec_t recs[LOG_RING_SIZE];
+  unsigned long head; /* Next record to fill */
+  unsigned long tail; /* Next record to drain */
+  long dropped;       /* Records that found the ring full */
+  long reported;      /* Drops already told about; drain thread only */
+  int id;
+  struct log_ring *next;
+} log_ring_t;
+
+int log_threshold = LOG_INFO;
+
+static const char *level_names[] = {"ERROR", "WARN", "INFO", "DEBUG"};
+static log_ring_t *rings; /* Pushed at the front, never removed */
+static int nrings;
+static __thread log_ring_t *this_ring;
+static FILE *out;
+static pthread_mutex_t drain_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static log_ring_t *ring_new(void) {
+  log_ring_t *r = Malloc(sizeof(log_ring_t));
+
+  r->head = r->tail = 0;
+  r->dropped = r->reported = 0;
+  r->id = __atomic_fetch_add(&nrings, 1, __ATOMIC_RELAXED);
+  r->next = __atomic_load_n(&rings, __ATOMIC_RELAXED);
+  while (!__atomic_compare_exchange_n(&rings, &r->next, r, 1, __ATOMIC_RELEASE,
+                                      __ATOMIC_RELAXED)) {
+  }
+  return this_ring = r;
+}
+
+/*
+ * log_write - Format a record into the calling thread's ring. Call it
+ *     through the log_* macros, which skip disabled levels.
+ */
+void log_write(int level, const char *fmt, ...) {
+  log_ring_t *r = this_ring ? this_ring : ring_new();
+  unsigned long head = r->head;
+  struct timespec ts;
+  log_rec_t *rec;
+  va_list ap;
+  int n;
+
+  if (head - __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE) == LOG_RING_SIZE) {
+    __atomic_add_fetch(&r->dropped, 1, __ATOMIC_RELAXED);
+    return;
+  }
+  rec = &r->recs[head & (LOG_RING_SIZE - 1)];
+  clock_gettime(CLOCK_REALTIME, &ts); /* vDSO, no system call */
+  rec->sec = ts.tv_sec;
+  rec->msec = ts.tv_nsec / 1000000;
+  rec->level = level;
+  va_start(ap, fmt);
+  n = vsnprintf(rec->text, LOG_TEXT_SIZE, fmt, ap);
+  va_end(ap);
+  if (n < 0) {
+    n = 0;
+  } else if (n >= LOG_TEXT_SIZE) {
+    n = LOG_TEXT_SIZE - 1; /* Truncated */
+  }
+  while (n > 0 && rec->text[n - 1] == '\n') {
+    n--;
+  }
+  rec->len = n;
+  __atomic_store_n(&r->head, head + 1, __ATOMIC_RELEASE);
+}
+
+/* Write out every record published so far; returns how many there were */
+static long drain(void) {
+  static long last_sec = -1;
+  static char stamp[32];
+  log_ring_t *r;
+  log_rec_t *rec;
+  unsigned long head, tail;
+  long n = 0, dropped;
+  struct tm tm;
+
+  for (r = __atomic_load_n(&rings, __ATOMIC_ACQUIRE); r; r = r->next) {
+    head = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+    for (tail = r->tail; tail != head; tail++, n++) {
+      rec = &r->recs[tail & (LOG_RING_SIZE - 1)];
+      if (rec->sec != last_sec) {
+        last_sec = rec->sec;
+        localtime_r(&(time_t){rec->sec}, &tm);
+        strftime(stamp, sizeof(stamp), "%Y-%m-%d %H:%M:%S", &tm);
+      }
+      fprintf(out, "%s.%03d %-5s [%d] %.*s\n", stamp, rec->msec,
+              level_names[rec->level], r->id, rec->len, rec->text);
+    }
+    __atomic_store_n(&r->tail, tail, __ATOMIC_RELEASE);
+    dropped = __atomic_load_n(&r->dropped, __ATOMIC_RELAXED);
+    if (dropped != r->reported) {
+      fprintf(out, "%s.000 WARN  [%d] %ld log records dropped, ring full\n",
+              stamp, r->id, dropped - r->reported);
+      r->reported = dropped;
+    }
+  }
+  if (n > 0) {
+    fflush(out);
+  }
+  return n;
+}
+
+static void *log_main(void *vargp) {
+  struct timespec nap = {0, LOG_DRAIN_MS * 1000000L};
+  long n;
+
+  for (;;) {
+    pthread_mutex_lock(&drain_lock);
+    n = drain();
+    pthread_mutex_unlock(&drain_lock);
+    if (n == 0) {
+      nanosleep(&nap, NULL);
+    }
+  }
+  return NULL;
+}
+
+void log_flush(void) {
+  pthread_mutex_lock(&drain_lock);
+  if (out != NULL) {
+    drain();
+  }
+  pthread_mutex_unlock(&drain_lock);
+}
+
+long log_dropped(void) {
+  log_ring_t *r;
+  long n = 0;
+
+  for (r = __atomic_load_n(&rings, __ATOMIC_ACQUIRE); r; r = r->next) {
+    n += __atomic_load_n(&r->dropped, __ATOMIC_RELAXED);
+  }
+  return n;
+}
+
+void log_init(const char *path, int level) {
+  pthread_t tid;
+
+  log_threshold = level;
+  if (path[0] == '\0') {
+    out = stdout;
+  } else if ((out = fopen(path, "a")) == NULL) {
+    unix_error("log_init: fopen error");
+  }
+  setvbuf(out, NULL, _IOFBF, 1 << 16);
+  atexit(log_flush);
+  Pthread_create(&tid, NULL, log_main, NULL);
+}
@@ -0,0 +1,52 @@
+/* $begin log.h */
+#ifndef __LOG_H__
+#define __LOG_H__
+
+/*
+ * Leveled logging kept off the request path. A thread formats each record
+ * into a ring of its own, with no lock and no system call; one background
+ * thread drains all rings to the log file. A record that finds its ring
+ * full is dropped and counted, so a slow disk never stalls a request.
+ *
+ * Records above LOG_COMPILE_LEVEL compile to nothing; those above the
+ * runtime level cost a load and a branch, their arguments go unevaluated.
+ */
+
+#define LOG_ERROR 0
+#define LOG_WARN 1
+#define LOG_INFO 2
+#define LOG_DEBUG 3
+
+#ifndef LOG_COMPILE_LEVEL
+#define LOG_COMPILE_LEVEL LOG_DEBUG
+#endif
+
+#define LOG_RECORD_SIZE 256 /* Bytes per record, header included */
+#define LOG_RING_SIZE 1024  /* Records per thread, a power of two */
+#define LOG_DRAIN_MS 10     /* Drain thread's nap when all rings are empty */
+
+extern int log_threshold; /* Runtime level, set by log_init */
+
+#define LOG_ENABLED(level)                                                     \
+  ((level) <= LOG_COMPILE_LEVEL && (level) <= log_threshold)
+
+#define LOG(level, ...)                                                        \
+  do {                                                                         \
+    if (LOG_ENABLED(level))                                                    \
+      log_write(level, __VA_ARGS__);                                           \
+  } while (0)
+
+#define log_error(...) LOG(LOG_ERROR, __VA_ARGS__)
+#define log_warn(...) LOG(LOG_WARN, __VA_ARGS__)
+#define log_info(...) LOG(LOG_INFO, __VA_ARGS__)
+#define log_debug(...) LOG(LOG_DEBUG, __VA_ARGS__)
+
+/* Open path ("" for stdout) and start draining; records before are kept */
+void log_init(const char *path, int level);
+void log_write(int level, const char *fmt, ...)
+    __attribute__((format(printf, 2, 3)));
+void log_flush(void);   /* Drain everything written so far, synchronously */
+long log_dropped(void); /* Records lost to full rings since start */
+
+#endif
+/* $end log.h */
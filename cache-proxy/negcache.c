@@ -0,0 +1,137 @@
+#include "negcache.h"
+#include "config.h"
+#include "helpers.h"
+#include "timer.h"
+
+#define NEG_BUCKETS 256
+
+typedef struct neg_entry {
+  uint64_t expires; /* ms */
+  char *resp;       /* The whole response, head and body */
+  size_t len;
+  uint64_t hash;
+  int port;
+  struct neg_entry *next;          /* Bucket chain */
+  struct neg_entry *newer, *older; /* LRU list */
+  char key[];                      /* host '\0' path */
+} neg_entry_t;
+
+/* One lock is plenty: entries are few and every operation is short */
+static struct {
+  pthread_mutex_t lock;
+  neg_entry_t *buckets[NEG_BUCKETS];
+  neg_entry_t lru; /* List head: lru.older is the most recently used */
+  size_t size;     /* Response bytes held */
+  long count;
+} neg = {PTHREAD_MUTEX_INITIALIZER,
+         {NULL},
+         {.newer = &neg.lru, .older = &neg.lru}};
+
+/* The link pointing at key's entry, or at the end of its chain */
+static neg_entry_t **slot_locked(const cache_key_t *key) {
+  neg_entry_t **pp = &neg.buckets[key->hash % NEG_BUCKETS], *e;
+
+  for (; (e = *pp) != NULL; pp = &e->next) {
+    if (e->hash == key->hash && e->port == key->port &&
+        strcmp(e->key, key->host) == 0 &&
+        strcmp(e->key + strlen(e->key) + 1, key->path) == 0)
+      break;
+  }
+  return pp;
+}
+
+static void lru_unlink(neg_entry_t *e) {
+  e->newer->older = e->older;
+  e->older->newer = e->newer;
+}
+
+static void lru_push(neg_entry_t *e) {
+  e->newer = &neg.lru;
+  e->older = neg.lru.older;
+  neg.lru.older->newer = e;
+  neg.lru.older = e;
+}
+
+/* Unlink the entry *pp points at and free it */
+static void drop_locked(neg_entry_t **pp) {
+  neg_entry_t *e = *pp;
+
+  *pp = e->next;
+  lru_unlink(e);
+  neg.size -= e->len;
+  __atomic_sub_fetch(&neg.count, 1, __ATOMIC_RELAXED);
+  Free(e->resp);
+  Free(e);
+}
+
+char *neg_find(const cache_key_t *key, size_t *len) {
+  neg_entry_t **pp, *e;
+  char *copy = NULL;
+
+  pthread_mutex_lock(&neg.lock);
+  pp = slot_locked(key);
+  if ((e = *pp) != NULL && e->expires <= wheel_clock()) {
+    drop_locked(pp);
+  } else if (e != NULL) {
+    lru_unlink(e);
+    lru_push(e);
+    copy = Malloc(e->len);
+    memcpy(copy, e->resp, e->len);
+    *len = e->len;
+  }
+  pthread_mutex_unlock(&neg.lock);
+  return copy;
+}
+
+void neg_insert(const cache_key_t *key, const char *resp, size_t len,
+                int ttl_ms) {
+  size_t hlen = strlen(key->host) + 1, plen = strlen(key->path) + 1;
+  neg_entry_t **pp, *e;
+  cache_key_t lru;
+
+  if (len > NEG_MAX_OBJECT || len > (size_t)conf.neg_cache_size ||
+      ttl_ms <= 0)
+    return;
+  e = Malloc(sizeof(*e) + hlen + plen);
+  e->expires = wheel_clock() + ttl_ms;
+  e->resp = Malloc(len);
+  memcpy(e->resp, resp, len);
+  e->len = len;
+  e->hash = key->hash;
+  e->port = key->port;
+  memcpy(e->key, key->host, hlen);
+  memcpy(e->key + hlen, key->path, plen);
+
+  pthread_mutex_lock(&neg.lock);
+  pp = slot_locked(key);
+  if (*pp != NULL)
+    drop_locked(pp);
+  e->next = neg.buckets[key->hash % NEG_BUCKETS];
+  neg.buckets[key->hash % NEG_BUCKETS] = e;
+  lru_push(e);
+  neg.size += len;
+  __atomic_add_fetch(&neg.count, 1, __ATOMIC_RELAXED);
+  /* Evict from the least recently used end until back under budget */
+  while (neg.size > (size_t)conf.neg_cache_size) {
+    e = neg.lru.newer;
+    lru.host = e->key;
+    lru.path = e->key + strlen(e->key) + 1;
+    lru.port = e->port;
+    lru.hash = e->hash;
+    drop_locked(slot_locked(&lru));
+  }
+  pthread_mutex_unlock(&neg.lock);
+}
+
+void neg_remove(const cache_key_t *key) {
+  neg_entry_t **pp;
+
+  pthread_mutex_lock(&neg.lock);
+  if (*(pp = slot_locked(key)) != NULL)
+    drop_locked(pp);
+  pthread_mutex_unlock(&neg.lock);
+}
+
+long neg_cached(void) {
+  return __atomic_load_n(&neg.count, __ATOMIC_RELAXED);
+}
@@ -0,0 +1,25 @@
+/* $begin negcache.h */
+#ifndef __NEGCACHE_H__
+#define __NEGCACHE_H__
+
+#include "cache.h"
+
+/*
+ * Negative cache: error responses (404, 503, ...) kept for a few seconds so
+ * that clients asking again and again for a missing or failing URL don't
+ * each reach the origin. It lives apart from the main cache, with its own
+ * byte budget (conf.neg_cache_size) and LRU eviction, so errors never push
+ * real objects out.
+ */
+
+#define NEG_MAX_OBJECT 16384 /* Larger error responses are not kept */
+
+/* Copy of the response cached under key, to be freed; NULL if none */
+char *neg_find(const cache_key_t *key, size_t *len);
+void neg_insert(const cache_key_t *key, const char *resp, size_t len,
+                int ttl_ms);
+void neg_remove(const cache_key_t *key);
+long neg_cached(void); /* Responses in the cache */
+
+#endif
+/* $end negcache.h */
@@ -1,230 +1,1354 @@
 #include "cache.h"
+#include "chunked.h"
+#include "log.h"
+#include "stats.h"
+#include "co.h"
+#include "config.h"
 #include "helpers.h"
-#include "sbuf.h"
+#include "http.h"
+#include "negcache.h"
+#include "trace.h"
+#include "tunnel.h"
+#include "upool.h"
+#include "workers.h"
+#include <stdint.h>
+#include <netinet/tcp.h>
 #include <stdio.h>
 #include <strings.h>
 
 /* Recommended max cache and object sizes */
 #define MAX_CACHE_SIZE 1049000
 #define MAX_OBJECT_SIZE 102400
-#define SBUFSIZE 32
+#define NTHREADS 8     // number of working threads
+#define MAX_TASKS 4096 // connections one worker multiplexes at most
 /* Cache file name */
 #define CACHE_FILE "cache"
+#define MAX_RANGES 16 // more pieces than this get the whole object
+#define FILL_SLOTS 64 // background fills running at once
+#define BOUNDARY "CACHE_PROXY_BYTERANGES"
+#define STATS_PATH "/__proxy/stats" // answered by the proxy itself
+#define TRACE_PATH "/__proxy/trace" // likewise
 
-const int NTHREADS = 8; // number of working threads
-sbuf_t sbuf;            // shared buffer of connected descriptors
+// connection phases guarded by a timeout, in the order of their
+// ST_TIMEOUT_* counters
+enum { T_HEADER, T_CONNECT, T_FIRST_BYTE, T_IDLE, T_PHASES };
+static const char *phase_names[T_PHASES] = {"header read", "connect",
+                                            "first byte", "idle transfer"};
+
+// cache fills ask the persist thread for a snapshot; saves asked for while
+// one is being written share the next one
+static int persist_pending;
+static pthread_mutex_t persist_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t persist_ready = PTHREAD_COND_INITIALIZER;
+
+// objects being fetched in full in the background after a Range miss, by
+// key hash, so that concurrent misses start a single fill
+static uint64_t fills[FILL_SLOTS];
+static int nfills;
+static pthread_mutex_t fill_lock = PTHREAD_MUTEX_INITIALIZER;
 static const char *user_agent_hdr =
     "User-Agent: Mozilla/5.0 (Macintosh; Intel Mac OS X 10_15_7) "
     "AppleWebKit/537.36 (KHTML, like Gecko) Chrome/105.0.0.0 Safari/537.36\r\n";
-static const char *connection_hdr = "Connection: close\r\n";
-static const char *proxy_connection_hdr = "Proxy-Connection: close\r\n";
+static const char *connection_hdr = "Connection: keep-alive\r\n";
+static const char *client_close_hdr = "Connection: close\r\n";
+static const char *client_keepalive_hdr = "Connection: keep-alive\r\n";
+
+// a response on its way from the origin to the client and into the cache
+typedef struct {
+  int fd;         // client
+  char *obj;      // copy kept for the cache, MAX_OBJECT_SIZE bytes
+  size_t obj_len; // bytes relayed so far
+  int keep_alive; // client connection stays open after this response
+  int revalidate; // the request carries the cached copy's validators
+  int quiet;      // ... and the origin said 304: nothing goes to the client
+  int te_chunked; // the client speaks HTTP/1.1 and can take a chunked body
+  int chunk_out;  // this body goes to the client chunked
+  size_t head_len;  // bytes of obj taken by the response head
+  resp_head_t head; // the origin's response head, filled in by fetch
+} relay_t;
+
+// client headers that go on to the origin, kept as raw lines
+typedef struct {
+  char buf[MAXBUF];
+  size_t len;
+  char range[256];    // Range value, "" if none
+  char if_range[256]; // If-Range value, "" if none
+  int auth; // carries Authorization: shared caching needs the origin's say
+} fwd_hdrs_t;
 
 // Helper and thread functions
-int handle_uri(char *uri, char *hostname, char *path, int *port);
-void handle_proxy(int fd);
-void *thread(void *vargp);
+int handle_proxy(int fd, rio_t *rp, int nreq);
+void handle_connect(int fd, rio_t *rp, char *target);
+void spawn_connection(void *vargp);
+void task(void *vargp);
+void *persist(void *vargp);
+void persist_request(void);
+void fill(void *vargp);
+int timed_out(int phase);
+int fetch(char *hostname, int port, char *path, fwd_hdrs_t *fwd, relay_t *r);
 
 int main(int argc, char **argv) {
-  int i, listenfd, connfd;
+  int listenfd, connfd;
   socklen_t clientlen;
   struct sockaddr_storage clientaddr;
   char client_hostname[MAXLINE], client_port[MAXLINE];
   pthread_t tid;
 
   if (argc < 2) {
-    fprintf(stderr, "usage: %s <port>\n", argv[0]);
+    fprintf(stderr, "usage: %s <port> [name=value ...]\n", argv[0]);
     exit(0);
   }
+  config_parse(argc, argv);
+  log_init(conf.log_file, conf.log_level);
+  trace_init(conf.trace_sample);
 
   listenfd = Open_listenfd(argv[1]);
-  printf(">Server started listening port %s\n", argv[1]);
-  sbuf_init(&sbuf, SBUFSIZE);
-  printf(">Shared buffer initialized\n");
-
+  log_info("Server started listening port %s", argv[1]);
   cache_init(CACHE_FILE);
-  printf(">Cache initialized\n");
+  Pthread_create(&tid, NULL, persist, NULL);
+  log_info("Cache initialized");
 
-  for (i = 0; i < NTHREADS; i++) { /* Create worker threads */
-    int *id = Malloc(sizeof(int));
-    *id = i;
-    Pthread_create(&tid, NULL, thread, (void *)id);
-  }
-  printf(">Worker threads created\n");
+  workers_init(NTHREADS, MAX_TASKS);
+  log_info("Worker threads created");
 
   Signal(SIGPIPE, SIG_IGN); // Ignore SIGPIPE
 
   while (1) {
     clientlen = sizeof(struct sockaddr_storage); /* Important! */
     connfd = Accept(listenfd, (SA *)&clientaddr, &clientlen);
-    Getnameinfo((SA *)&clientaddr, clientlen, client_hostname, MAXLINE,
-                client_port, MAXLINE, 0);
-    sbuf_insert(&sbuf, connfd); /* Insert connfd in buffer */
-    printf(">cilentfd %d in queue \n", connfd);
-    printf(">Accepted connection from (%s, %s)\n", client_hostname,
-           client_port);
-  }
-  sbuf_deinit(&sbuf);
+    trace_accept(connfd);
+    workers_submit(spawn_connection, (void *)(intptr_t)connfd);
+    // numeric, and only when someone reads it: a reverse lookup would
+    // hold up the accept loop
+    if (LOG_ENABLED(LOG_DEBUG)) {
+      Getnameinfo((SA *)&clientaddr, clientlen, client_hostname, MAXLINE,
+                  client_port, MAXLINE, NI_NUMERICHOST | NI_NUMERICSERV);
+      log_debug("Accepted connection from (%s, %s), clientfd %d in queue",
+                client_hostname, client_port, connfd);
+    }
+  }
   cache_deinit();
   exit(0);
 }
 
-void *thread(void *vargp) {
+// first stage of a connection, run by whichever worker picks it up
+void spawn_connection(void *vargp) {
+  int connfd = (int)(intptr_t)vargp, one = 1;
+  co_nonblock(connfd);
+  // responses go out in pieces; don't let Nagle hold back the last one
+  setsockopt(connfd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+  co_spawn(task, vargp);
+}
+
+// one coroutine per connection, so handle_proxy can stay sequential;
+// requests on a persistent connection, pipelined or not, are served in
+// order, and the rio buffer carries bytes read ahead from one to the next
+void task(void *vargp) {
+  int connfd = (int)(intptr_t)vargp, nreq;
+  rio_t rio_client;
+  trace_t trace;
+
+  log_debug("Task >> handling clientfd[%d]", connfd);
+  stats_add(ST_CONN_OPENED, 1);
+  trace_attach(&trace, connfd);
+  rio_readinitb(&rio_client, connfd);
+  for (nreq = 1; handle_proxy(connfd, &rio_client, nreq); nreq++) {
+    trace_end();
+  }
+  trace_end();
+  Close(connfd);
+  stats_add(ST_CONN_CLOSED, 1);
+  log_debug("Task << clientfd[%d] closed", connfd);
+}
+
+// snapshot thread: cache_save blocks on the disk, which would stall every
+// connection of a worker's scheduler, so it runs here instead
+void *persist(void *vargp) {
+  uint64_t start;
+
   Pthread_detach(pthread_self());
-  int id = *((int *)vargp);
-  Free(vargp);
   while (1) {
-    int connfd = sbuf_remove(&sbuf);
-    printf("Working thread[%d] >> handling cilentfd[%d]\n", id, connfd);
-    handle_proxy(connfd);
-    Close(connfd);
-    printf("Working thread[%d] << cilentfd[%d] closed!\n", id, connfd);
+    pthread_mutex_lock(&persist_lock);
+    while (!persist_pending) {
+      pthread_cond_wait(&persist_ready, &persist_lock);
+    }
+    __atomic_store_n(&persist_pending, 0, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&persist_lock);
+    start = trace_now();
+    cache_save(CACHE_FILE);
+    trace_span(TP_SAVE, start);
   }
   return NULL;
 }
 
-void handle_proxy(int fd) {
-  char buf[MAXLINE], method[MAXLINE], uri[MAXLINE], version[MAXLINE];
-  char hostname[MAXLINE], path[MAXLINE], port[MAXLINE];
-  char server_buf[MAXLINE], obj[MAX_OBJECT_SIZE];
-  rio_t rio_cilent, rio_server;
-  int serverfd;
-  int port_int;
-  size_t n, obj_len = 0;
+// ask for a snapshot after a cache insert; cheap when one is already due
+void persist_request(void) {
+  if (__atomic_load_n(&persist_pending, __ATOMIC_ACQUIRE)) {
+    return;
+  }
+  pthread_mutex_lock(&persist_lock);
+  __atomic_store_n(&persist_pending, 1, __ATOMIC_RELAXED);
+  pthread_cond_signal(&persist_ready);
+  pthread_mutex_unlock(&persist_lock);
+}
 
-  rio_readinitb(&rio_cilent, fd);
-  rio_readlineb(&rio_cilent, buf, MAXLINE);
+// count a connection lost to an expired deadline; true if errno says so
+int timed_out(int phase) {
+  if (errno != ETIMEDOUT) {
+    return 0;
+  }
+  stats_add(ST_TIMEOUT_HEADER + phase, 1);
+  log_warn("408: %s timeout", phase_names[phase]);
+  return 1;
+}
 
-  sscanf(buf, "%s %s %s", method, uri, version);
-  printf("Request line:\n");
-  printf("%s", buf);
-  if (strcasecmp(method, "GET") != 0) {
-    printf("501: Proxy does not implement this method\n");
-    return;
+// keep n more bytes of the response for the cache, while they fit
+static void keep(relay_t *r, void *buf, size_t n) {
+  r->obj_len += n;
+  if (r->obj_len <= MAX_OBJECT_SIZE) {
+    memcpy(r->obj + r->obj_len - n, buf, n);
   }
-  if (!handle_uri(uri, hostname, path, &port_int)) {
-    printf("400: Proxy could not parse the request\n");
-    return;
+}
+
+// send n response bytes to the client and append them to the cache copy
+// (fd < 0: a background fill, cache copy only)
+static int relay(relay_t *r, void *buf, size_t n) {
+  if (r->quiet) {
+    return 0;
+  }
+  keep(r, buf, n);
+  return r->fd >= 0 && rio_writen(r->fd, buf, n) < 0 ? -1 : 0;
+}
+
+// relay n body bytes, as a chunk of their own if the client gets chunks;
+// the cache always keeps them plain
+static int relay_body(relay_t *r, void *buf, size_t n) {
+  char head[CHUNK_HEAD_MAX];
+  struct iovec iov[3];
+
+  if (!r->chunk_out || r->quiet || r->fd < 0 || n == 0) {
+    return relay(r, buf, n);
+  }
+  keep(r, buf, n);
+  iov[0].iov_base = head;
+  iov[0].iov_len = chunk_head(head, n);
+  iov[1].iov_base = buf;
+  iov[1].iov_len = n;
+  iov[2].iov_base = "\r\n";
+  iov[2].iov_len = 2;
+  return rio_writev(r->fd, iov, 3) < 0 ? -1 : 0;
+}
+
+// the object is too big for the cache: move the rest of the body (len
+// bytes, or up to EOF if len < 0) to the client without copying it
+static int relay_splice(rio_t *rp, relay_t *r, long len) {
+  ssize_t n = rp->rio_cnt;
+
+  if (r->fd < 0) {
+    return -1; // nobody to send it to, and too big to keep
+  }
+  // whatever rio already read ahead goes first
+  if (len >= 0 && n > len) {
+    n = len;
+  }
+  if (n > 0) {
+    if (rio_writen(r->fd, rp->rio_bufptr, n) < 0) {
+      return -1;
+    }
+    rp->rio_bufptr += n;
+    rp->rio_cnt -= n;
+    r->obj_len += n;
+    if (len > 0) {
+      len -= n;
+    }
+  }
+  if (len == 0) {
+    return 0;
+  }
+  if ((n = rio_splice(rp->rio_fd, r->fd, len)) < 0) {
+    return -1;
+  }
+  r->obj_len += n;
+  return len > 0 && n < len ? -1 : 0; // origin closed early
+}
+
+// relay exactly len body bytes
+static int relay_length(rio_t *rp, relay_t *r, long len) {
+  char buf[MAXBUF];
+  ssize_t n;
+
+  if (r->obj_len + len > MAX_OBJECT_SIZE) {
+    return relay_splice(rp, r, len);
+  }
+  while (len > 0) {
+    n = rio_readnb(rp, buf, len < MAXBUF ? len : MAXBUF);
+    if (n <= 0 || relay(r, buf, n) < 0) {
+      return -1;
+    }
+    len -= n;
+  }
+  return 0;
+}
+
+// relay a chunked body, decoded where it lies in the rio buffer: the cache
+// keeps it plain, a client that takes chunks gets it chunked again, along
+// with its trailer, and any other client plain up to the connection's end
+static int relay_chunked(rio_t *rp, relay_t *r) {
+  char tail[CHUNK_TRAILER_MAX + 5];
+  chunk_dec_t d;
+  size_t used;
+  ssize_t n;
+  long left;
+
+  chunk_init(&d);
+  while (!d.done) {
+    if (r->fd < 0 && r->obj_len > MAX_OBJECT_SIZE) {
+      return -1; // nobody to send it to, and too big to keep
+    }
+    if (rp->rio_cnt == 0 && (left = chunk_pending(&d)) > MAXBUF &&
+        r->obj_len + left > MAX_OBJECT_SIZE && r->fd >= 0 && !r->quiet) {
+      // a big chunk of an object the cache can't take: its data moves
+      // to the client without a copy, framed by a chunk of our own
+      n = chunk_head(tail, left);
+      if ((r->chunk_out && rio_writen(r->fd, tail, n) < 0) ||
+          rio_splice(rp->rio_fd, r->fd, left) < left ||
+          (r->chunk_out && rio_writen(r->fd, "\r\n", 2) < 0)) {
+        return -1;
+      }
+      r->obj_len += left;
+      chunk_skip(&d, left);
+      continue;
+    }
+    if (rp->rio_cnt == 0 && rio_fill(rp) <= 0) {
+      return -1;
+    }
+    if ((n = chunk_decode(&d, rp->rio_bufptr, rp->rio_cnt, &used)) < 0) {
+      log_warn("502: Malformed chunked body from server");
+      return -1;
+    }
+    if (n > 0 && relay_body(r, rp->rio_bufptr, n) < 0) {
+      return -1;
+    }
+    rp->rio_bufptr += used;
+    rp->rio_cnt -= used;
+  }
+  if (r->chunk_out && !r->quiet && r->fd >= 0) {
+    n = chunk_tail(&d, tail, sizeof(tail));
+    return rio_writen(r->fd, tail, n) < 0 ? -1 : 0;
+  }
+  return 0;
+}
+
+// relay a body delimited by the origin closing the connection
+static int relay_eof(rio_t *rp, relay_t *r) {
+  char buf[MAXBUF];
+  ssize_t n;
+
+  while ((n = rio_readnb(rp, buf, MAXBUF)) > 0) {
+    if (relay_body(r, buf, n) < 0) {
+      return -1;
+    }
+    // chunks need a copy to be framed; a plain body can be spliced
+    if (r->obj_len > MAX_OBJECT_SIZE && !r->chunk_out) {
+      return relay_splice(rp, r, -1);
+    }
+  }
+  if (n < 0) {
+    return -1;
+  }
+  if (r->chunk_out && !r->quiet && r->fd >= 0) {
+    n = chunk_tail(NULL, buf, sizeof(buf));
+    return rio_writen(r->fd, buf, n) < 0 ? -1 : 0;
+  }
+  return 0;
+}
+
+// relay the response head after its status line, minus hop-by-hop headers
+static int relay_head(rio_t *rp, relay_t *r, resp_head_t *head) {
+  char line[MAXLINE], hdrs[MAXLINE];
+  ssize_t n;
+
+  while ((n = rio_readlineb(rp, line, MAXLINE)) > 0) {
+    if (strcmp(line, "\r\n") == 0 || strcmp(line, "\n") == 0) {
+      break;
+    }
+    http_parse_resp_header(line, head);
+    // the body gets framed anew below, so the origin's framing stays behind
+    if (!http_is_hop_header(line) &&
+        !http_header_is(line, "Transfer-Encoding") && relay(r, line, n) < 0) {
+      return -1;
+    }
+  }
+  if (n <= 0) {
+    return -1;
+  }
+  // a body without a length goes to an HTTP/1.1 client in chunks, which
+  // lets the connection carry another response; any other client can only
+  // tell where it ends by the connection closing
+  r->chunk_out = 0;
+  if (http_has_body(head) && (head->chunked || head->content_length < 0)) {
+    if (r->te_chunked) {
+      r->chunk_out = 1;
+    } else {
+      r->keep_alive = 0;
+    }
+  }
+  // framing and Connection are for this client only and stay out of the cache
+  strcpy(hdrs, r->chunk_out ? "Transfer-Encoding: chunked\r\n" : "");
+  strcat(hdrs, r->keep_alive ? client_keepalive_hdr : client_close_hdr);
+  if ((!r->quiet && r->fd >= 0 && rio_writen(r->fd, hdrs, strlen(hdrs)) < 0) ||
+      relay(r, "\r\n", 2) < 0) {
+    return -1;
+  }
+  r->head_len = r->obj_len;
+  return 0;
+}
+
+// parse the head of a stored response; returns where its blank line starts
+// and sets *first_hdr past the status line, or NULL if it is malformed
+static char *cached_head(char *content, size_t size, resp_head_t *head,
+                         char **first_hdr) {
+  char line[MAXLINE], *p = content, *end = p + size, *eol;
+  size_t len;
+
+  eol = memchr(p, '\n', end - p);
+  len = eol ? eol + 1 - p : 0;
+  snprintf(line, MAXLINE, "%.*s", (int)len, p);
+  if (eol == NULL || http_parse_status(line, head) < 0) {
+    return NULL;
+  }
+  *first_hdr = eol + 1;
+  for (p = eol + 1; p < end; p = eol + 1) {
+    if ((eol = memchr(p, '\n', end - p)) == NULL) {
+      return NULL;
+    }
+    len = eol + 1 - p;
+    if (len == 1 || (len == 2 && *p == '\r')) {
+      return p;
+    }
+    snprintf(line, MAXLINE, "%.*s", (int)len, p);
+    http_parse_resp_header(line, head);
+  }
+  return NULL;
+}
+
+// send a stored response with a Connection header for this client; returns
+// whether the connection stays open, or -1 on error
+static int send_cached(int fd, char *content, size_t size, int keep_alive) {
+  char *p, *first_hdr;
+  const char *hdr;
+  struct iovec iov[3];
+  resp_head_t head;
+
+  if ((p = cached_head(content, size, &head, &first_hdr)) == NULL) {
+    return -1;
+  }
+  if (http_has_body(&head) && !head.chunked && head.content_length < 0) {
+    keep_alive = 0;
+  }
+  hdr = keep_alive ? client_keepalive_hdr : client_close_hdr;
+  iov[0].iov_base = content;
+  iov[0].iov_len = p - content;
+  iov[1].iov_base = (void *)hdr;
+  iov[1].iov_len = strlen(hdr);
+  iov[2].iov_base = p;
+  iov[2].iov_len = content + size - p;
+  return rio_writev(fd, iov, 3) < 0 ? -1 : keep_alive;
+}
+
+// answer a Range request from a cached 200: a 206 for one range, a
+// multipart/byteranges 206 for several, a 416 if none is satisfiable;
+// returns like send_cached, or -2 if the whole response should go instead
+static int send_ranges(int fd, cache_block *block, const char *spec,
+                       int keep_alive) {
+  http_range_t rg[MAX_RANGES];
+  struct iovec iov[2 * MAX_RANGES + 3];
+  char ctype[256] = "", *first_hdr, *blank, *body, *p, *eol, *out;
+  const char *hdr = keep_alive ? client_keepalive_hdr : client_close_hdr;
+  size_t cap, o, part;
+  long len, total;
+  resp_head_t head;
+  int i, n, cnt = 0, rc;
+
+  blank = cached_head(block->content, block->size, &head, &first_hdr);
+  if (blank == NULL || head.status != 200 || head.chunked) {
+    return -2;
+  }
+  body = blank + (*blank == '\r' ? 2 : 1);
+  len = block->content + block->size - body;
+  if (head.content_length != len ||
+      (n = http_parse_range(spec, len, rg, MAX_RANGES)) < 0) {
+    return -2;
+  }
+
+  cap = (blank - first_hdr) + (n + 1) * (sizeof(ctype) + 128) + 256;
+  out = Malloc(cap);
+  if (n == 0) {
+    o = snprintf(out, cap,
+                 "HTTP/1.1 416 Range Not Satisfiable\r\n"
+                 "Content-Range: bytes */%ld\r\nContent-Length: 0\r\n%s\r\n",
+                 len, hdr);
+    iov[cnt].iov_base = out;
+    iov[cnt++].iov_len = o;
   } else {
-    // connect to server
-    printf("hostname: %s, url: %s, port: %d\n", hostname, path, port_int);
-    sprintf(port, "%d", port_int);
-
-    // read response from server
-    // cache hit -> return cache content
-    // miss -> socket connect to server
-    cache_block *block = cache_find(hostname, path, port_int);
-    if (block != NULL) {
-      printf("Cache hit!\n");
-      rio_writen(fd, block->content, block->size);
-      printf("Respond %ld bytes object:\n", block->size);
-      return;
+    // the stored headers, minus those that describe the whole body
+    o = snprintf(out, cap, "HTTP/1.1 206 Partial Content\r\n");
+    for (p = first_hdr; p < blank; p = eol + 1) {
+      eol = memchr(p, '\n', blank - p);
+      if (http_header_is(p, "Content-Length") ||
+          http_header_is(p, "Content-Range")) {
+        continue;
+      }
+      if (n > 1 && http_header_is(p, "Content-Type")) {
+        http_header_copy(p, ctype, sizeof(ctype));
+        continue; // it moves into each part
+      }
+      memcpy(out + o, p, eol + 1 - p);
+      o += eol + 1 - p;
+    }
+    if (n == 1) {
+      o += snprintf(out + o, cap - o,
+                    "Content-Range: bytes %ld-%ld/%ld\r\n"
+                    "Content-Length: %ld\r\n%s\r\n",
+                    rg[0].first, rg[0].last, len,
+                    rg[0].last - rg[0].first + 1, hdr);
+      iov[cnt].iov_base = out;
+      iov[cnt++].iov_len = o;
+      iov[cnt].iov_base = body + rg[0].first;
+      iov[cnt++].iov_len = rg[0].last - rg[0].first + 1;
     } else {
-      printf("Cache miss!\n");
-      serverfd = open_clientfd(hostname, port);
-      if (serverfd < 0) {
-        printf("404: Proxy could not connect to this server\n");
-        return;
+      // the part headers are sized first, the Content-Length needs them
+      total = strlen("\r\n--" BOUNDARY "--\r\n");
+      for (i = 0; i < n; i++) {
+        total += snprintf(NULL, 0,
+                          "\r\n--" BOUNDARY "\r\nContent-Type: %s\r\n"
+                          "Content-Range: bytes %ld-%ld/%ld\r\n\r\n",
+                          ctype, rg[i].first, rg[i].last, len) +
+                 rg[i].last - rg[i].first + 1;
+      }
+      o += snprintf(out + o, cap - o,
+                    "Content-Type: multipart/byteranges; boundary=" BOUNDARY
+                    "\r\nContent-Length: %ld\r\n%s\r\n",
+                    total, hdr);
+      iov[cnt].iov_base = out;
+      iov[cnt++].iov_len = o;
+      for (i = 0; i < n; i++) {
+        part = snprintf(out + o, cap - o,
+                        "\r\n--" BOUNDARY "\r\nContent-Type: %s\r\n"
+                        "Content-Range: bytes %ld-%ld/%ld\r\n\r\n",
+                        ctype, rg[i].first, rg[i].last, len);
+        iov[cnt].iov_base = out + o;
+        iov[cnt++].iov_len = part;
+        o += part;
+        iov[cnt].iov_base = body + rg[i].first;
+        iov[cnt++].iov_len = rg[i].last - rg[i].first + 1;
       }
+      iov[cnt].iov_base = "\r\n--" BOUNDARY "--\r\n";
+      iov[cnt++].iov_len = strlen("\r\n--" BOUNDARY "--\r\n");
+    }
+  }
+  rc = rio_writev(fd, iov, cnt) < 0 ? -1 : keep_alive;
+  Free(out);
+  return rc;
+}
 
-      // send request to server
-      rio_readinitb(&rio_server, serverfd);
-      // send request header
-      sprintf(server_buf, "GET %s HTTP/1.0\r\n", path);
-      rio_writen(serverfd, server_buf, strlen(server_buf));
-      sprintf(server_buf, "Host: %s\r\n", hostname);
-      rio_writen(serverfd, server_buf, strlen(server_buf));
-      rio_writen(serverfd, (void *)user_agent_hdr, strlen(user_agent_hdr));
-      rio_writen(serverfd, (void *)connection_hdr, strlen(connection_hdr));
-      rio_writen(serverfd, (void *)proxy_connection_hdr,
-                 strlen(proxy_connection_hdr));
-      rio_writen(serverfd, "\r\n", 2);
-
-      // read response header and body
-      while ((n = rio_readnb(&rio_server, server_buf, MAXLINE)) > 0) {
-        obj_len += n;
-        if (obj_len <= MAX_OBJECT_SIZE) {
-          memcpy(obj + obj_len - n, server_buf, n);
+// If-Range: ranges only apply to the representation the client has
+static int if_range_matches(const fwd_hdrs_t *fwd, cache_block *block) {
+  cache_meta_t meta;
+
+  if (fwd->if_range[0] == '\0') {
+    return 1;
+  }
+  cache_get_meta(block, &meta);
+  if (fwd->if_range[0] == '"') { // strong ETag comparison
+    return strcmp(fwd->if_range, meta.etag) == 0;
+  }
+  return strcmp(fwd->if_range, meta.last_modified) == 0;
+}
+
+// answer from a cache block, honouring Range, and drop the reference;
+// returns whether the client connection stays open
+static int serve_cached(int fd, cache_block *block, fwd_hdrs_t *fwd,
+                        int keep_alive) {
+  int rc = -2;
+
+  if (fwd->range[0] != '\0' && if_range_matches(fwd, block)) {
+    rc = send_ranges(fd, block, fwd->range, keep_alive);
+  }
+  if (rc == -2) {
+    rc = send_cached(fd, block->content, block->size, keep_alive);
+  }
+  if (rc < 0) {
+    timed_out(T_IDLE);
+  }
+  log_debug("Respond %ld bytes object:", block->size);
+  stats_add(ST_CACHE_BYTES, block->size);
+  cache_release(block);
+  return rc > 0;
+}
+
+// discard a chunked request body, decoding it to find its end
+static int skip_chunked(rio_t *rp) {
+  chunk_dec_t d;
+  size_t used;
+
+  chunk_init(&d);
+  while (!d.done) {
+    if ((rp->rio_cnt == 0 && rio_fill(rp) <= 0) ||
+        chunk_decode(&d, rp->rio_bufptr, rp->rio_cnt, &used) < 0) {
+      return -1;
+    }
+    rp->rio_bufptr += used;
+    rp->rio_cnt -= used;
+  }
+  return 0;
+}
+
+// discard a request body of len bytes
+static int skip_body(rio_t *rp, long len) {
+  char buf[MAXBUF];
+  ssize_t n;
+
+  while (len > 0) {
+    if ((n = rio_readnb(rp, buf, len < MAXBUF ? len : MAXBUF)) <= 0) {
+      return -1;
+    }
+    len -= n;
+  }
+  return 0;
+}
+
+// send the HTTP/1.1 request for path with the client's forwarded headers,
+// asking the origin to keep the connection open; one writev, so the whole
+// request normally leaves in a single segment
+static int send_request(int serverfd, char *hostname, int port, char *path,
+                        fwd_hdrs_t *fwd) {
+  char line[MAXLINE], host[MAXLINE];
+  struct iovec iov[6];
+
+  snprintf(line, MAXLINE, "GET %s HTTP/1.1\r\n", path);
+  if (port == 80) {
+    snprintf(host, MAXLINE, "Host: %s\r\n", hostname);
+  } else {
+    snprintf(host, MAXLINE, "Host: %s:%d\r\n", hostname, port);
+  }
+  iov[0].iov_base = line;
+  iov[0].iov_len = strlen(line);
+  iov[1].iov_base = host;
+  iov[1].iov_len = strlen(host);
+  iov[2].iov_base = fwd->buf;
+  iov[2].iov_len = fwd->len;
+  iov[3].iov_base = (void *)user_agent_hdr;
+  iov[3].iov_len = strlen(user_agent_hdr);
+  iov[4].iov_base = (void *)connection_hdr;
+  iov[4].iov_len = strlen(connection_hdr);
+  iov[5].iov_base = "\r\n";
+  iov[5].iov_len = 2;
+  return rio_writev(serverfd, iov, 6) < 0 ? -1 : 0;
+}
+
+// drop the forwarded header name
+static void fwd_remove(fwd_hdrs_t *fwd, const char *name) {
+  char *p = fwd->buf, *end = fwd->buf + fwd->len, *out = fwd->buf, *eol;
+  size_t len;
+
+  for (; p < end; p += len) {
+    eol = memchr(p, '\n', end - p);
+    len = eol ? eol + 1 - p : end - p;
+    if (!http_header_is(p, name)) {
+      memmove(out, p, len);
+      out += len;
+    }
+  }
+  fwd->len = out - fwd->buf;
+}
+
+// make the origin request conditional on the cached copy's validators, in
+// place of any conditions of the client's own
+static void add_validators(fwd_hdrs_t *fwd, const cache_meta_t *meta) {
+  char *out;
+  int n;
+
+  fwd_remove(fwd, "If-None-Match");
+  fwd_remove(fwd, "If-Modified-Since");
+  out = fwd->buf + fwd->len;
+  if (meta->etag[0] != '\0') {
+    n = snprintf(out, MAXBUF - fwd->len, "If-None-Match: %s\r\n", meta->etag);
+    fwd->len += n < MAXBUF - (int)fwd->len ? n : 0;
+  }
+  out = fwd->buf + fwd->len;
+  if (meta->last_modified[0] != '\0') {
+    n = snprintf(out, MAXBUF - fwd->len, "If-Modified-Since: %s\r\n",
+                 meta->last_modified);
+    fwd->len += n < MAXBUF - (int)fwd->len ? n : 0;
+  }
+}
+
+// what to keep with a fetched or revalidated object; its lifetime comes
+// from the response's own headers
+static void make_meta(const resp_head_t *head, cache_meta_t *meta) {
+  time_t now = time(NULL);
+  meta->expires = now + http_freshness(head, now, conf.cache_ttl / 1000);
+  strcpy(meta->etag, head->etag);
+  strcpy(meta->last_modified, head->last_modified);
+  meta->vary[0] = '\0';
+  // s-maxage binds shared caches as proxy-revalidate does (RFC 9111 5.2.2.10)
+  meta->no_stale =
+      head->must_revalidate || head->no_cache || head->s_maxage >= 0;
+}
+
+// fetch path over a pooled or new origin connection and relay the response;
+// returns 0 once the whole response went through
+int fetch(char *hostname, int port, char *path, fwd_hdrs_t *fwd, relay_t *r) {
+  char port_str[16], line[MAXLINE];
+  rio_t rio_server;
+  int serverfd, reused, attempt, rc;
+  ssize_t n = -1;
+
+  for (attempt = 0;; attempt++) {
+    reused = attempt == 0 && (serverfd = upool_get(hostname, port)) >= 0;
+    if (!reused) {
+      trace_phase(TP_DNS); // open_clientfd moves on to TP_CONNECT
+      sprintf(port_str, "%d", port);
+      co_deadline(conf.connect_timeout);
+      serverfd = open_clientfd(hostname, port_str);
+      co_deadline(0);
+      if (serverfd < 0) {
+        if (!timed_out(T_CONNECT)) {
+          log_warn("404: Proxy could not connect to this server");
         }
-        rio_writen(fd, server_buf, n); // send response to client
+        return -1;
       }
-      if (obj_len <= MAX_OBJECT_SIZE) {
-        cache_insert(hostname, path, port_int, obj, obj_len, CACHE_FILE);
-        printf("Cache insert %ld bytes object:\n", obj_len);
-      } else {
-        printf("Cache failed, object over limit size!\n");
+    }
+    trace_phase(TP_FIRST_BYTE);
+    if (send_request(serverfd, hostname, port, path, fwd) == 0) {
+      // the status line is read alone so that the first-byte deadline
+      // doesn't cover the whole response head
+      rio_readinitb(&rio_server, serverfd);
+      co_idle_timeout(0);
+      co_deadline(conf.first_byte_timeout);
+      n = rio_readlineb(&rio_server, line, MAXLINE);
+      co_deadline(0);
+      co_idle_timeout(conf.idle_timeout);
+      if (n > 0) {
+        break;
+      }
+    }
+    Close(serverfd);
+    if (!reused) {
+      if (n < 0) {
+        timed_out(T_FIRST_BYTE);
       }
-      printf("Respond %ld bytes object:\n", obj_len);
-      // Close(serverfd);
+      return -1;
     }
+    // a pooled connection the origin closed meanwhile: retry on a new one
   }
+
+  if (http_parse_status(line, &r->head) < 0) {
+    log_warn("502: Bad status line from server");
+    Close(serverfd);
+    return -1;
+  }
+  trace_phase(TP_TRANSFER);
+  r->quiet = r->revalidate && r->head.status == 304;
+  // the client gets the status line in our version, which is what lets a
+  // body from an HTTP/1.0 origin reach it chunked
+  line[7] = '1';
+  rc = relay(r, line, n) < 0 || relay_head(&rio_server, r, &r->head) < 0 ? -1 : 0;
+  if (rc == 0 && http_has_body(&r->head)) {
+    if (r->head.chunked) {
+      rc = relay_chunked(&rio_server, r);
+    } else if (r->head.content_length >= 0) {
+      rc = relay_length(&rio_server, r, r->head.content_length);
+    } else {
+      r->head.keep_alive = 0;
+      rc = relay_eof(&rio_server, r);
+    }
+  }
+  if (rc < 0) {
+    timed_out(T_IDLE);
+  }
+  // reusable only if the response ended exactly where the framing said
+  if (rc == 0 && r->head.keep_alive && rio_server.rio_cnt == 0) {
+    upool_put(hostname, port, serverfd);
+  } else {
+    Close(serverfd);
+  }
+  return rc;
 }
 
-// handle the uri that user sends
-int handle_uri(char *uri, char *hostname, char *path, int *port) {
-  const char *temp_head, *temp_tail;
-  char scheme[10], port_str[10];
-  size_t temp_len;
+// give a body that came chunked or up to EOF a Content-Length in the copy
+// the cache keeps, so that hits on it need no framing of their own
+static int add_length(relay_t *r) {
+  char hdr[64];
+  char *blank = r->obj + r->head_len - 2;
+  int n = sprintf(hdr, "Content-Length: %zu\r\n", r->obj_len - r->head_len);
 
-  temp_head = uri;
+  if (r->obj_len + n > MAX_OBJECT_SIZE) {
+    return -1;
+  }
+  memmove(blank + n, blank, r->obj_len - r->head_len + 2);
+  memcpy(blank, hdr, n);
+  r->obj_len += n;
+  r->head_len += n;
+  return 0;
+}
 
-  // get scheme
-  temp_tail = strstr(temp_head, "://");
-  if (temp_tail == NULL) {
-    return 0;
+// put a complete response into the cache if it may and is worth keeping
+static void store(const cache_key_t *key, fwd_hdrs_t *fwd, relay_t *r) {
+  char vpath[MAXLINE];
+  cache_key_t variant = *key;
+  cache_meta_t meta;
+  long ttl, life;
+
+  make_meta(&r->head, &meta);
+  if (r->obj_len <= MAX_OBJECT_SIZE && http_has_body(&r->head) &&
+      (r->head.chunked || r->head.content_length < 0) && add_length(r) < 0) {
+    r->obj_len = MAX_OBJECT_SIZE + 1;
   }
-  temp_len = temp_tail - temp_head;
-  strncpy(scheme, temp_head, temp_len);
-  scheme[temp_len] = '\0';
-  if (strcasecmp(scheme, "http") != 0) {
-    return 0;
+  if (http_negative(&r->head, fwd->auth) && r->head.vary[0] == '\0') {
+    // errors go to the negative cache only, for a few seconds at most; an
+    // explicit lifetime from the origin may shorten that
+    ttl = r->head.status >= 500 ? conf.neg_cache_5xx_ttl : conf.neg_cache_ttl;
+    life = http_freshness(&r->head, time(NULL), (ttl + 999) / 1000);
+    if (life * 1000 < ttl) {
+      ttl = life * 1000;
+    }
+    if (ttl > 0 && r->obj_len <= NEG_MAX_OBJECT) {
+      neg_insert(key, r->obj, r->obj_len, ttl);
+      log_debug("Negative cache insert %ld bytes object:", r->obj_len);
+    } else {
+      log_debug("Cache skipped, error response!");
+    }
+  } else if (!http_cacheable(&r->head, fwd->auth)) {
+    log_debug("Cache skipped, response not cacheable!");
+  } else if (r->obj_len > MAX_OBJECT_SIZE) {
+    log_debug("Cache failed, object over limit size!");
+  } else if (meta.expires <= time(NULL) && meta.etag[0] == '\0' &&
+             meta.last_modified[0] == '\0') {
+    // stale on arrival with nothing to revalidate it by: never reusable
+    log_debug("Cache skipped, response already stale!");
+  } else if (r->head.vary[0] != '\0' &&
+             http_variant_key(r->head.vary, fwd->buf, fwd->len, key->path,
+                              vpath, sizeof(vpath)) < 0) {
+    log_debug("Cache skipped, variant key too long!");
+  } else {
+    if (r->head.vary[0] != '\0') {
+      // the URL gets a marker naming what its responses vary on, and the
+      // object goes under the key of the variant this request selected
+      strcpy(meta.vary, r->head.vary);
+      cache_insert(key, r->obj, 0, &meta);
+      meta.vary[0] = '\0';
+      cache_key_extend(&variant, vpath);
+    }
+    cache_insert(&variant, r->obj, r->obj_len, &meta);
+    neg_remove(key);
+    persist_request();
+    log_debug("Cache insert %ld bytes object:", r->obj_len);
   }
+}
 
-  // get hostname
-  temp_head = temp_tail + 3;
-  temp_tail = temp_head;
-  while (*temp_tail != '\0') {
-    if (*temp_tail == ':' || *temp_tail == '/') {
-      break;
+// the cache entry for path, or, if the URL's responses vary, the entry of
+// the variant the request selects: one more probe, keyed off the marker
+static cache_block *lookup(const cache_key_t *key, fwd_hdrs_t *fwd) {
+  char vpath[MAXLINE];
+  cache_key_t variant = *key;
+  cache_meta_t meta;
+  cache_block *block = cache_find(key);
+
+  if (block == NULL) {
+    return NULL;
+  }
+  cache_get_meta(block, &meta);
+  if (meta.vary[0] == '\0') {
+    return block;
+  }
+  cache_release(block);
+  if (http_variant_key(meta.vary, fwd->buf, fwd->len, key->path, vpath,
+                       sizeof(vpath)) < 0) {
+    return NULL;
+  }
+  cache_key_extend(&variant, vpath);
+  return cache_find(&variant);
+}
+
+// a background fill: the whole object behind a Range miss
+typedef struct {
+  char hostname[MAXLINE];
+  char path[MAXLINE];    // as sent to the origin
+  char keypath[MAXLINE]; // canonical, for the cache
+  int port;
+  cache_key_t key;       // points into the above
+  fwd_hdrs_t fwd;
+} fill_t;
+
+// fetch the object without a client and keep it
+void fill(void *vargp) {
+  fill_t *f = vargp;
+  relay_t r;
+  int i;
+
+  co_idle_timeout(conf.idle_timeout);
+  r.fd = -1;
+  r.obj = Malloc(MAX_OBJECT_SIZE);
+  r.obj_len = 0;
+  r.keep_alive = 0;
+  r.revalidate = r.quiet = 0;
+  r.te_chunked = 0;
+  memset(&r.head, 0, sizeof(r.head));
+  if (fetch(f->hostname, f->port, f->path, &f->fwd, &r) == 0) {
+    log_debug("Background fill of %s%s done", f->hostname, f->path);
+    store(&f->key, &f->fwd, &r);
+  }
+  Free(r.obj);
+
+  pthread_mutex_lock(&fill_lock);
+  for (i = 0; i < nfills && fills[i] != f->key.hash; i++) {
+  }
+  fills[i] = fills[--nfills];
+  pthread_mutex_unlock(&fill_lock);
+  Free(f);
+}
+
+// fetch the whole object in a coroutine of its own, unless that is already
+// happening; the request is the client's minus its ranges and conditions
+static void start_fill(char *hostname, int port, char *path,
+                       const cache_key_t *key, fwd_hdrs_t *fwd) {
+  fill_t *f;
+  int i;
+
+  pthread_mutex_lock(&fill_lock);
+  for (i = 0; i < nfills && fills[i] != key->hash; i++) {
+  }
+  if (i < nfills || nfills == FILL_SLOTS) {
+    pthread_mutex_unlock(&fill_lock);
+    return;
+  }
+  fills[nfills++] = key->hash;
+  pthread_mutex_unlock(&fill_lock);
+
+  f = Malloc(sizeof(fill_t));
+  strcpy(f->hostname, hostname);
+  strcpy(f->path, path);
+  strcpy(f->keypath, key->path);
+  f->port = port;
+  f->key = *key;
+  f->key.host = f->hostname;
+  f->key.path = f->keypath;
+  f->fwd = *fwd;
+  fwd_remove(&f->fwd, "Range");
+  fwd_remove(&f->fwd, "If-Range");
+  fwd_remove(&f->fwd, "If-None-Match");
+  fwd_remove(&f->fwd, "If-Modified-Since");
+  co_spawn(fill, f);
+}
+
+// CONNECT host:port: tunnel the client to an allowed port until both
+// directions are done; the client connection ends with the tunnel
+void handle_connect(int fd, rio_t *rp, char *target) {
+  static const char *bad_request = "HTTP/1.1 400 Bad Request\r\n"
+                                   "Content-Length: 0\r\n\r\n";
+  static const char *forbidden = "HTTP/1.1 403 Forbidden\r\n"
+                                 "Content-Length: 0\r\n\r\n";
+  static const char *bad_gateway = "HTTP/1.1 502 Bad Gateway\r\n"
+                                   "Content-Length: 0\r\n\r\n";
+  static const char *established = "HTTP/1.1 200 Connection established\r\n"
+                                   "\r\n";
+  char hostname[MAXLINE], *colon, *end, *rest;
+  tunnel_stats_t st = {0, 0, 0};
+  int serverfd;
+  long port;
+
+  // host:port, or [v6 address]:port
+  if (target[0] == '[') {
+    target++;
+    colon = strstr(target, "]:");
+    end = colon;
+    colon = colon ? colon + 1 : NULL;
+  } else {
+    end = colon = strrchr(target, ':');
+  }
+  // the port is digits to the end: "443abc" must not pass for 443
+  port = colon && isdigit((unsigned char)colon[1])
+             ? strtol(colon + 1, &rest, 10)
+             : -1;
+  if (port < 0 || *rest != '\0' || end - target >= MAXLINE) {
+    log_info("400: Bad CONNECT target %s", target);
+    stats_add(ST_BAD_REQUESTS, 1);
+    rio_writen(fd, (void *)bad_request, strlen(bad_request));
+    return;
+  }
+  if (port <= 0 || port > 65535 || !config_connect_allowed(port)) {
+    log_info("403: CONNECT to %s not allowed", target);
+    stats_add(ST_BAD_REQUESTS, 1);
+    rio_writen(fd, (void *)forbidden, strlen(forbidden));
+    return;
+  }
+  memcpy(hostname, target, end - target);
+  hostname[end - target] = '\0';
+
+  co_deadline(conf.connect_timeout);
+  serverfd = open_clientfd(hostname, colon + 1);
+  co_deadline(0);
+  if (serverfd < 0) {
+    if (!timed_out(T_CONNECT)) {
+      log_warn("502: Proxy could not connect to %s", target);
     }
-    temp_tail++;
+    rio_writen(fd, (void *)bad_gateway, strlen(bad_gateway));
+    return;
+  }
+  if (rio_writen(fd, (void *)established, strlen(established)) < 0) {
+    Close(serverfd);
+    return;
+  }
+  // bytes the client sent right behind its request head go first
+  if (rp->rio_cnt > 0) {
+    if (rio_writen(serverfd, rp->rio_bufptr, rp->rio_cnt) < 0) {
+      Close(serverfd);
+      return;
+    }
+    st.up = rp->rio_cnt;
+    rp->rio_cnt = 0;
   }
-  temp_len = temp_tail - temp_head;
-  strncpy(hostname, temp_head, temp_len);
-  hostname[temp_len] = '\0';
 
-  // get port
-  temp_head = temp_tail;
-  if (*temp_head == ':') {
-    temp_head++;
-    temp_tail = temp_head;
-    while (*temp_tail != '\0') {
-      if (*temp_tail == '/') {
-        break;
+  log_info("Tunnel to %s:%ld open", hostname, port);
+  stats_add(ST_TUNNELS, 1);
+  tunnel_run(fd, serverfd, conf.tunnel_idle_timeout, &st);
+  if (st.timed_out) {
+    stats_add(ST_TIMEOUT_IDLE, 1);
+    log_warn("408: %s timeout", phase_names[T_IDLE]);
+  }
+  stats_add(ST_TUNNEL_UP, st.up);
+  stats_add(ST_TUNNEL_DOWN, st.down);
+  log_info("Tunnel to %s:%ld closed, %ld bytes up, %ld bytes down",
+           hostname, port, st.up, st.down);
+  Close(serverfd);
+}
+
+// true if an origin-form target names one of the reports the proxy
+// answers itself: /__proxy/stats, with ?format=json for JSON, and
+// /__proxy/trace
+static int report_path(const char *target, const char *path) {
+  size_t n = strlen(path);
+  return strncmp(target, path, n) == 0 &&
+         (target[n] == '\0' || target[n] == '?');
+}
+
+// send the stats or trace report; returns whether the client connection
+// stays open
+static int serve_report(int fd, const char *target, int keep_alive) {
+  char head[MAXLINE];
+  struct iovec iov[2];
+  int trace = report_path(target, TRACE_PATH);
+  int json = trace || strstr(target, "format=json") != NULL;
+  size_t size = trace ? TRACE_MAX_TEXT : STATS_MAX_TEXT;
+  char *body = Malloc(size);
+  size_t len = trace ? trace_render(body, size)
+                     : stats_render(body, size, json);
+  int rc;
+
+  trace_phase(TP_SEND);
+  iov[0].iov_base = head;
+  iov[0].iov_len = snprintf(
+      head, sizeof(head),
+      "HTTP/1.1 200 OK\r\nContent-Type: %s\r\nContent-Length: %zu\r\n"
+      "Cache-Control: no-store\r\n%s\r\n",
+      json ? "application/json" : "text/plain; version=0.0.4", len,
+      keep_alive ? client_keepalive_hdr : client_close_hdr);
+  iov[1].iov_base = body;
+  iov[1].iov_len = len;
+  rc = rio_writev(fd, iov, 2);
+  Free(body);
+  return rc < 0 ? 0 : keep_alive;
+}
+
+// read a request head into the client's rio buffer and parse it where it
+// lies; the head starts at rp->rio_bufptr and must fit in the buffer.
+// Returns an HTTP_PARSE_* code, HTTP_PARSE_MORE when the client went away
+static int read_head(rio_t *rp, http_req_t *req, int nreq) {
+  int rc, started = 0;
+  ssize_t n;
+
+  // a new connection gets header_timeout for its head, an idle persistent
+  // one keepalive_timeout until the next request begins to arrive
+  co_idle_timeout(0);
+  co_deadline(nreq == 1 ? conf.header_timeout : conf.keepalive_timeout);
+  http_req_init(req);
+  while ((rc = http_req_parse(req, rp->rio_bufptr, rp->rio_cnt)) ==
+         HTTP_PARSE_MORE) {
+    if (!started && rp->rio_cnt > 0 && nreq > 1) {
+      co_deadline(conf.header_timeout);
+    }
+    started |= rp->rio_cnt > 0;
+    if (rp->rio_cnt == RIO_BUFSIZE) {
+      return HTTP_PARSE_LARGE;
+    }
+    if ((n = rio_fill(rp)) <= 0) {
+      if (nreq == 1 || started) {
+        timed_out(T_HEADER);
       }
-      temp_tail++;
+      return HTTP_PARSE_MORE;
+    }
+  }
+  co_deadline(0);
+  return rc;
+}
+
+// copy span s of buf to a C string; dst has room for any part of a head
+static void copy_span(char *dst, const char *buf, http_span_t s) {
+  memcpy(dst, buf + s.off, s.len);
+  dst[s.len] = '\0';
+}
+
+// collect the client headers that go on to the origin
+static int forward_fields(const http_req_t *hr, const char *buf,
+                          fwd_hdrs_t *fwd) {
+  const http_field_t *f;
+  const char *line;
+  int i;
+
+  fwd->len = 0;
+  fwd->range[0] = fwd->if_range[0] = '\0';
+  fwd->auth = 0;
+  for (i = 0; i < hr->nfields; i++) {
+    f = &hr->fields[i];
+    line = buf + f->line.off;
+    if (!http_is_forwarded(line) ||
+        http_connection_lists(hr, buf, f->name)) {
+      continue;
+    }
+    if (fwd->len + f->line.len > MAXBUF) {
+      return -1;
+    }
+    memcpy(fwd->buf + fwd->len, line, f->line.len);
+    fwd->len += f->line.len;
+    if (http_span_is(buf, f->name, "Range") &&
+        f->value.len < sizeof(fwd->range)) {
+      copy_span(fwd->range, buf, f->value);
+    } else if (http_span_is(buf, f->name, "If-Range") &&
+               f->value.len < sizeof(fwd->if_range)) {
+      copy_span(fwd->if_range, buf, f->value);
+    }
+    fwd->auth |= http_span_is(buf, f->name, "Authorization");
+  }
+  return 0;
+}
+
+// serve the next request on the client connection; returns 1 if the
+// connection can carry another one
+int handle_proxy(int fd, rio_t *rp, int nreq) {
+  static const char *too_large = "HTTP/1.1 431 Request Header Fields Too Large"
+                                 "\r\nContent-Length: 0\r\n\r\n";
+  static const char *bad_request = "HTTP/1.1 400 Bad Request\r\n"
+                                   "Content-Length: 0\r\n\r\n";
+  static const char *not_implemented = "HTTP/1.1 501 Not Implemented\r\n"
+                                       "Content-Length: 0\r\n\r\n";
+  char target[MAXLINE], hostname[MAXLINE], path[MAXLINE], keypath[MAXLINE];
+  char *p;
+  const char *buf;
+  cache_key_t key;
+  http_req_t hr;
+  fwd_hdrs_t fwd;
+  req_head_t req;
+  cache_meta_t meta;
+  relay_t r;
+  char *neg;
+  size_t neg_len;
+  int port_int, keep_alive, rc;
+  long start;
+
+  if ((rc = read_head(rp, &hr, nreq)) == HTTP_PARSE_MORE) {
+    return 0;
+  }
+  start = stats_clock();
+  stats_add(ST_REQUESTS, 1);
+  buf = rp->rio_bufptr;
+  if (rc == HTTP_PARSE_DONE && forward_fields(&hr, buf, &fwd) < 0) {
+    rc = HTTP_PARSE_LARGE;
+  }
+  if (rc != HTTP_PARSE_DONE) {
+    stats_add(ST_BAD_REQUESTS, 1);
+    if (rc == HTTP_PARSE_LARGE) {
+      log_info("431: Request header fields too large");
+      rio_writen(fd, (void *)too_large, strlen(too_large));
+    } else {
+      log_info("400: Proxy could not parse the request");
+      rio_writen(fd, (void *)bad_request, strlen(bad_request));
+    }
+    return 0;
+  }
+  trace_begin(nreq, buf + hr.target.off, hr.target.len);
+  log_info("Request: %.*s %.*s HTTP/1.%d", (int)hr.method.len,
+           buf + hr.method.off, (int)hr.target.len, buf + hr.target.off,
+           hr.minor);
+  if (http_req_head(&hr, buf, &req) < 0) {
+    // no telling where the body ends, so nothing after it can be trusted
+    log_info("400: Invalid or conflicting Content-Length");
+    stats_add(ST_BAD_REQUESTS, 1);
+    rio_writen(fd, (void *)bad_request, strlen(bad_request));
+    return 0;
+  }
+  // the head fits in the rio buffer, and so does any part of it
+  copy_span(target, buf, hr.target);
+  port_int = http_span_is(buf, hr.scheme, "http") ? hr.port : 0;
+  if (port_int > 0) {
+    copy_span(hostname, buf, hr.host);
+    path[0] = '/';
+    if (hr.path.len > 0 && buf[hr.path.off] == '/') {
+      copy_span(path, buf, hr.path);
+    } else {
+      copy_span(path + 1, buf, hr.path); // "http://host" or "http://host?q"
+    }
+  }
+  // the spans die with the head: the buffer is reused for what comes next
+  rp->rio_bufptr += hr.head_len;
+  rp->rio_cnt -= hr.head_len;
+  co_idle_timeout(conf.idle_timeout);
+
+  if (http_span_is(buf, hr.method, "CONNECT")) {
+    trace_phase(TP_TUNNEL);
+    handle_connect(fd, rp, target);
+    return 0;
+  }
+  if (!http_span_is(buf, hr.method, "GET")) {
+    log_info("501: Proxy does not implement this method");
+    stats_add(ST_BAD_REQUESTS, 1);
+    rio_writen(fd, (void *)not_implemented, strlen(not_implemented));
+    return 0;
+  }
+  if ((req.chunked && skip_chunked(rp) < 0) ||
+      (!req.chunked && req.content_length > 0 &&
+       skip_body(rp, req.content_length) < 0)) {
+    return 0;
+  }
+  keep_alive = req.keep_alive && nreq < conf.client_max_requests;
+
+  if (port_int == 0 && hr.scheme.len == 0 &&
+      (report_path(target, STATS_PATH) || report_path(target, TRACE_PATH))) {
+    return serve_report(fd, target, keep_alive);
+  }
+  if (port_int == 0) {
+    log_info("400: Proxy could not parse the request");
+    stats_add(ST_BAD_REQUESTS, 1);
+    rio_writen(fd, (void *)bad_request, strlen(bad_request));
+    return 0;
+  }
+  log_debug("hostname: %s, url: %s, port: %d", hostname, path, port_int);
+
+  // equivalent URLs share one entry: the key has the host in lowercase (the
+  // default port is already implied) and the path in canonical form
+  for (p = hostname; *p; p++) {
+    *p = tolower((unsigned char)*p);
+  }
+  strcpy(keypath, path);
+  http_normalize_path(keypath, conf.cache_strip_params, conf.cache_sort_query);
+  cache_key_init(&key, hostname, port_int, keypath);
+  trace_phase(TP_LOOKUP);
+
+  // fresh hit -> return cache content
+  // recent error -> return it from the negative cache
+  // stale hit -> revalidate with the origin, or fetch again without validators
+  // miss -> fetch from server over a pooled connection
+  cache_block *block = lookup(&key, &fwd);
+  if (block != NULL) {
+    cache_get_meta(block, &meta);
+    if (meta.expires > time(NULL)) {
+      log_info("Cache hit!");
+      stats_add(ST_HITS, 1);
+      trace_phase(TP_SEND);
+      rc = serve_cached(fd, block, &fwd, keep_alive);
+      stats_time(ST_LAT_HIT, start);
+      return rc;
+    }
+  }
+  if ((neg = neg_find(&key, &neg_len)) != NULL) {
+    log_info("Negative cache hit!");
+    if (block != NULL) {
+      cache_release(block);
+    }
+    trace_phase(TP_SEND);
+    if ((rc = send_cached(fd, neg, neg_len, keep_alive)) < 0) {
+      timed_out(T_IDLE);
+    }
+    log_debug("Respond %ld bytes object:", neg_len);
+    stats_add(ST_NEG_HITS, 1);
+    stats_add(ST_CACHE_BYTES, neg_len);
+    stats_time(ST_LAT_HIT, start);
+    Free(neg);
+    return rc > 0;
+  }
+  if (block != NULL) {
+    if (meta.etag[0] == '\0' && meta.last_modified[0] == '\0') {
+      log_info("Cache stale!");
+      stats_add(ST_MISSES, 1);
+      cache_release(block);
+      block = NULL;
+    } else {
+      log_info("Cache stale, revalidating!");
+      stats_add(ST_REVALIDATIONS, 1);
+      // ask for the whole object, a 200 replaces the entry; Range is still
+      // applied to the cached copy if it turns out unchanged
+      fwd_remove(&fwd, "Range");
+      fwd_remove(&fwd, "If-Range");
+      add_validators(&fwd, &meta);
     }
-    temp_len = temp_tail - temp_head;
-    strncpy(port_str, temp_head, temp_len);
-    port_str[temp_len] = '\0';
-    *port = atoi(port_str);
   } else {
-    *port = 80;
+    log_info("Cache miss!");
+    stats_add(ST_MISSES, 1);
   }
 
-  // get path
-  temp_head = temp_tail;
-  if (*temp_head == '/') {
-    temp_tail = temp_head;
-    while (*temp_tail != '\0') {
-      temp_tail++;
+  // the object buffer lives on the heap to keep coroutine stacks small
+  r.fd = fd;
+  r.obj = Malloc(MAX_OBJECT_SIZE);
+  r.obj_len = 0;
+  r.keep_alive = keep_alive;
+  r.te_chunked = req.minor >= 1;
+  r.revalidate = block != NULL;
+  r.quiet = 0;
+  memset(&r.head, 0, sizeof(r.head));
+  rc = fetch(hostname, port_int, path, &fwd, &r);
+  stats_add(ST_ORIGIN_BYTES, r.obj_len);
+  if (block != NULL &&
+      (r.quiet || (rc < 0 && r.obj_len == 0 && !meta.no_stale))) {
+    // not modified: the body never crossed the wire again; or the origin
+    // is unreachable and a stale copy beats no answer, unless the origin
+    // forbade that (RFC 9111 4.2.4)
+    if (rc == 0) {
+      make_meta(&r.head, &meta);
+      cache_refresh(block, &meta);
+      log_info("Cache revalidated!");
+      stats_add(ST_NOT_MODIFIED, 1);
+    } else {
+      log_info("Cache revalidation failed, serving stale copy!");
+      stats_add(ST_STALE_SERVED, 1);
+    }
+    Free(r.obj);
+    trace_phase(TP_SEND);
+    rc = serve_cached(fd, block, &fwd, keep_alive);
+    stats_time(ST_LAT_MISS, start);
+    return rc;
+  }
+  if (block != NULL) {
+    cache_release(block);
+  }
+  if (rc < 0) {
+    log_debug("Cache skipped, response incomplete!");
+    stats_add(ST_ORIGIN_ERRORS, 1);
+    r.keep_alive = 0;
+  } else if (r.head.status == 206) {
+    log_debug("Cache skipped, partial response!");
+    // small enough to keep, by the test store() applies to the whole
+    // response, head included: get all of it once, off this client's path
+    if (r.head.range_total > 0 &&
+        r.head.range_total + r.head_len <= MAX_OBJECT_SIZE) {
+      start_fill(hostname, port_int, path, &key, &fwd);
     }
-    temp_len = temp_tail - temp_head;
-    strncpy(path, temp_head, temp_len);
-    path[temp_len] = '\0';
-    return 1;
   } else {
-    path[0] = '/';
-    path[1] = '\0';
-    return 1;
+    trace_phase(TP_STORE);
+    store(&key, &fwd, &r);
   }
+  log_debug("Respond %ld bytes object:", r.obj_len);
+  stats_time(ST_LAT_MISS, start);
+  Free(r.obj);
+  return r.keep_alive;
 }
@@ -0,0 +1,124 @@
+#include "scan.h"
+#include <string.h>
+
+#if defined(__x86_64__) || (defined(__i386__) && defined(__SSE2__))
+#define SCAN_X86
+#include <immintrin.h>
+#endif
+
+typedef const char *(*scan_fn)(const char *p, const char *end,
+                               const char *set, int n);
+
+static const char *scan_scalar(const char *p, const char *end,
+                               const char *set, int n) {
+  int i;
+
+  for (; p < end; p++) {
+    for (i = 0; i < n; i++) {
+      if (*p == set[i])
+        return p;
+    }
+  }
+  return NULL;
+}
+
+#ifdef SCAN_X86
+/* Each delimiter is compared against 16 bytes at once, the hits or'ed */
+static const char *scan_sse2(const char *p, const char *end, const char *set,
+                             int n) {
+  __m128i d[SCAN_MAX_SET], v, m;
+  unsigned mask;
+  int i;
+
+  for (i = 0; i < n; i++)
+    d[i] = _mm_set1_epi8(set[i]);
+  for (; end - p >= 16; p += 16) {
+    v = _mm_loadu_si128((const __m128i *)p);
+    m = _mm_cmpeq_epi8(v, d[0]);
+    for (i = 1; i < n; i++)
+      m = _mm_or_si128(m, _mm_cmpeq_epi8(v, d[i]));
+    if ((mask = _mm_movemask_epi8(m)) != 0)
+      return p + __builtin_ctz(mask);
+  }
+  return scan_scalar(p, end, set, n);
+}
+
+__attribute__((target("avx2"))) static const char *
+scan_avx2(const char *p, const char *end, const char *set, int n) {
+  __m256i d[SCAN_MAX_SET], v, m;
+  unsigned mask;
+  int i;
+
+  for (i = 0; i < n; i++)
+    d[i] = _mm256_set1_epi8(set[i]);
+  for (; end - p >= 32; p += 32) {
+    v = _mm256_loadu_si256((const __m256i *)p);
+    m = _mm256_cmpeq_epi8(v, d[0]);
+    for (i = 1; i < n; i++)
+      m = _mm256_or_si256(m, _mm256_cmpeq_epi8(v, d[i]));
+    if ((mask = _mm256_movemask_epi8(m)) != 0)
+      return p + __builtin_ctz(mask);
+  }
+  /* At most 31 bytes left; clear the upper halves first, or the legacy SSE
+     code pays for a state transition */
+  _mm256_zeroupper();
+  return scan_sse2(p, end, set, n);
+}
+#endif
+
+static const struct {
+  const char *name;
+  scan_fn fn;
+} kernels[] = {
+#ifdef SCAN_X86
+    {"avx2", scan_avx2},
+    {"sse2", scan_sse2},
+#endif
+    {"scalar", scan_scalar},
+};
+
+static int kernel = -1; /* Index into kernels, -1 until picked */
+
+static int supported(const char *name) {
+#ifdef SCAN_X86
+  if (strcmp(name, "avx2") == 0)
+    return __builtin_cpu_supports("avx2");
+#endif
+  return 1;
+}
+
+/* The fastest kernel the CPU runs; racing threads all pick the same one */
+static int pick(void) {
+  int k = __atomic_load_n(&kernel, __ATOMIC_RELAXED), i;
+
+  if (k >= 0)
+    return k;
+  for (i = 0; !supported(kernels[i].name); i++)
+    ;
+  __atomic_store_n(&kernel, i, __ATOMIC_RELAXED);
+  return i;
+}
+
+/* The vector kernels keep one register per delimiter and need at least one;
+   other sets go through the byte loop */
+const char *scan_any(const char *p, const char *end, const char *set) {
+  size_t n = strlen(set);
+
+  if (n == 0 || n > SCAN_MAX_SET)
+    return scan_scalar(p, end, set, (int)n);
+  return kernels[pick()].fn(p, end, set, (int)n);
+}
+
+const char *scan_impl(void) { return kernels[pick()].name; }
+
+int scan_use(const char *impl) {
+  int i;
+
+  for (i = 0; i < sizeof(kernels) / sizeof(kernels[0]); i++) {
+    if (strcmp(kernels[i].name, impl) == 0 && supported(impl)) {
+      __atomic_store_n(&kernel, i, __ATOMIC_RELAXED);
+      return 0;
+    }
+  }
+  return -1;
+}
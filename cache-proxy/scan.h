@@ -0,0 +1,22 @@
+/* $begin scan.h */
+#ifndef __SCAN_H__
+#define __SCAN_H__
+
+#include <stddef.h>
+
+/*
+ * Delimiter scanning for the HTTP parsers: find the first byte of a buffer
+ * that is one of a few delimiters (line ends, ':', ' ', '/', '?'). On x86 the
+ * bytes are compared 32 (AVX2) or 16 (SSE2) at a time; the kernel is picked
+ * on first use from what the CPU supports, with a byte loop elsewhere.
+ */
+
+#define SCAN_MAX_SET 4 /* Delimiters the vector kernels look for at once */
+
+/* First byte in [p, end) found in the NUL-terminated set, NULL if none */
+const char *scan_any(const char *p, const char *end, const char *set);
+const char *scan_impl(void);    /* "avx2", "sse2" or "scalar" */
+int scan_use(const char *impl); /* Force a kernel; -1 if the CPU lacks it */
+
+#endif
+/* $end scan.h */
@@ -0,0 +1,11 @@
+#define _GNU_SOURCE
+#include "splice.h"
+#include <fcntl.h>
+#include <stddef.h>
+
+#ifdef __linux__
+ssize_t splice_move(int fd_in, int fd_out, size_t len) {
+  return splice(fd_in, NULL, fd_out, NULL, len,
+                SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+}
+#endif
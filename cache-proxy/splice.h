@@ -0,0 +1,19 @@
+/* $begin splice.h */
+#ifndef __SPLICE_H__
+#define __SPLICE_H__
+
+#include <sys/types.h>
+
+/*
+ * Linux splice(), offsets left out. <fcntl.h> declares it only under
+ * _GNU_SOURCE, and helpers.h can't be compiled that way: its gai_error()
+ * clashes with the GNU netdb.h. So splice() is wrapped in a translation
+ * unit of its own, which includes nothing else of the proxy.
+ */
+
+/* Move up to len bytes from fd_in to fd_out, one of them a pipe, without
+ * blocking; returns what splice() does */
+ssize_t splice_move(int fd_in, int fd_out, size_t len);
+
+#endif
+/* $end splice.h */
@@ -0,0 +1,319 @@
+#include "stats.h"
+#include "cache.h"
+#include "helpers.h"
+#include "log.h"
+#include "negcache.h"
+#include "workers.h"
+
+typedef struct {
+  long counts[STATS_BUCKETS];
+  long total, sum, max; /* Values recorded, their sum and the largest, us */
+} stats_hist_t;
+
+/* Written by its own thread only, read by anyone rendering a report */
+typedef struct stats_shard {
+  long counters[ST_COUNTERS];
+  stats_hist_t hists[ST_HISTS];
+  struct stats_shard *next;
+} stats_shard_t;
+
+/* Prometheus name (labels included) and JSON name of each counter */
+static const struct {
+  const char *prom, *json, *help;
+} counter_names[ST_COUNTERS] = {
+    {"requests_total", "requests", "Requests with a complete head"},
+    {"cache_hits_total", "hits", "Requests answered from a fresh entry"},
+    {"negative_hits_total", "negative_hits",
+     "Requests answered from the negative cache"},
+    {"cache_misses_total", "misses", "Requests fetched from the origin"},
+    {"revalidations_total", "revalidations",
+     "Stale entries checked with the origin"},
+    {"not_modified_total", "not_modified",
+     "Revalidations the origin answered with 304"},
+    {"stale_served_total", "stale_served",
+     "Stale entries served because the origin failed"},
+    {"cache_sent_bytes_total", "cache_sent_bytes",
+     "Response bytes sent from the caches"},
+    {"origin_received_bytes_total", "origin_received_bytes",
+     "Response bytes received from origins"},
+    {"origin_errors_total", "origin_errors",
+     "Fetches that failed or ended early"},
+    {"bad_requests_total", "bad_requests",
+     "Requests refused as malformed or unsupported"},
+    {"connections_opened_total", "connections_opened",
+     "Client connections accepted"},
+    {"connections_closed_total", "connections_closed",
+     "Client connections closed"},
+    {"tunnels_total", "tunnels", "CONNECT tunnels opened"},
+    {"tunnel_bytes_total{direction=\"up\"}", "tunnel_bytes_up",
+     "Bytes relayed by CONNECT tunnels"},
+    {"tunnel_bytes_total{direction=\"down\"}", "tunnel_bytes_down", NULL},
+    {"timeouts_total{phase=\"header\"}", "timeouts_header",
+     "Connections dropped by an expired deadline"},
+    {"timeouts_total{phase=\"connect\"}", "timeouts_connect", NULL},
+    {"timeouts_total{phase=\"first_byte\"}", "timeouts_first_byte", NULL},
+    {"timeouts_total{phase=\"idle\"}", "timeouts_idle", NULL},
+};
+
+static const char *hist_names[ST_HISTS] = {"hit", "miss"};
+static const double quantiles[] = {0.5, 0.9, 0.99, 0.999};
+static const char *quantile_names[] = {"p50", "p90", "p99", "p999"};
+
+static stats_shard_t *shards; /* Pushed at the front, never removed */
+static __thread stats_shard_t *this_shard;
+
+static stats_shard_t *shard(void) {
+  stats_shard_t *s = this_shard;
+
+  if (s == NULL) {
+    s = Calloc(1, sizeof(stats_shard_t));
+    s->next = __atomic_load_n(&shards, __ATOMIC_RELAXED);
+    while (!__atomic_compare_exchange_n(&shards, &s->next, s, 1,
+                                        __ATOMIC_RELEASE, __ATOMIC_RELAXED)) {
+    }
+    this_shard = s;
+  }
+  return s;
+}
+
+/* Single writer: a relaxed load and store, no locked instruction */
+static void bump(long *p, long n) {
+  __atomic_store_n(p, __atomic_load_n(p, __ATOMIC_RELAXED) + n,
+                   __ATOMIC_RELAXED);
+}
+
+void stats_add(int counter, long n) {
+  bump(&shard()->counters[counter], n);
+}
+
+long stats_clock(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000L + ts.tv_nsec / 1000;
+}
+
+static int bucket_of(unsigned long v) {
+  int m;
+
+  if (v < 16) {
+    return v;
+  }
+  if (v >> 41) {
+    v = (1UL << 41) - 1;
+  }
+  m = 63 - __builtin_clzl(v);
+  return 16 + ((m - 4) << STATS_SUB_BITS) +
+         (int)(v >> (m - STATS_SUB_BITS)) - (1 << STATS_SUB_BITS);
+}
+
+/* Largest value that falls in bucket i */
+static long bucket_top(int i) {
+  int m, top;
+
+  if (i < 16) {
+    return i;
+  }
+  m = ((i - 16) >> STATS_SUB_BITS) + 4;
+  top = ((i - 16) & ((1 << STATS_SUB_BITS) - 1)) + (1 << STATS_SUB_BITS);
+  return ((long)(top + 1) << (m - STATS_SUB_BITS)) - 1;
+}
+
+void stats_time(int hist, long start) {
+  stats_hist_t *h = &shard()->hists[hist];
+  long v = stats_clock() - start;
+
+  if (v < 0) {
+    v = 0;
+  }
+  bump(&h->counts[bucket_of(v)], 1);
+  bump(&h->total, 1);
+  bump(&h->sum, v);
+  if (v > h->max) {
+    __atomic_store_n(&h->max, v, __ATOMIC_RELAXED);
+  }
+}
+
+/* Sum of every shard; counts read a little apart may disagree slightly */
+static void merge(long *counters, stats_hist_t *hists) {
+  stats_shard_t *s;
+  long max;
+  int i, j;
+
+  memset(counters, 0, ST_COUNTERS * sizeof(long));
+  memset(hists, 0, ST_HISTS * sizeof(stats_hist_t));
+  for (s = __atomic_load_n(&shards, __ATOMIC_ACQUIRE); s; s = s->next) {
+    for (i = 0; i < ST_COUNTERS; i++) {
+      counters[i] += __atomic_load_n(&s->counters[i], __ATOMIC_RELAXED);
+    }
+    for (i = 0; i < ST_HISTS; i++) {
+      stats_hist_t *h = &s->hists[i];
+      for (j = 0; j < STATS_BUCKETS; j++) {
+        hists[i].counts[j] += __atomic_load_n(&h->counts[j], __ATOMIC_RELAXED);
+      }
+      hists[i].total += __atomic_load_n(&h->total, __ATOMIC_RELAXED);
+      hists[i].sum += __atomic_load_n(&h->sum, __ATOMIC_RELAXED);
+      if ((max = __atomic_load_n(&h->max, __ATOMIC_RELAXED)) > hists[i].max) {
+        hists[i].max = max;
+      }
+    }
+  }
+}
+
+/* Value below which a fraction q of the recordings fall, in us */
+static long quantile(const stats_hist_t *h, double q) {
+  long total = 0, seen = 0, want;
+  int i;
+
+  for (i = 0; i < STATS_BUCKETS; i++) {
+    total += h->counts[i];
+  }
+  if (total == 0) {
+    return 0;
+  }
+  want = (long)(q * total + 0.5);
+  if (want < 1) {
+    want = 1;
+  }
+  for (i = 0; i < STATS_BUCKETS; i++) {
+    if ((seen += h->counts[i]) >= want) {
+      break;
+    }
+  }
+  return bucket_top(i) < h->max ? bucket_top(i) : h->max;
+}
+
+/* Append to a report, keeping track of the room left */
+typedef struct {
+  char *buf;
+  size_t len, size;
+} out_t;
+
+static void put(out_t *o, const char *fmt, ...)
+    __attribute__((format(printf, 2, 3)));
+
+static void put(out_t *o, const char *fmt, ...) {
+  va_list ap;
+  int n;
+
+  if (o->len >= o->size) {
+    return;
+  }
+  va_start(ap, fmt);
+  n = vsnprintf(o->buf + o->len, o->size - o->len, fmt, ap);
+  va_end(ap);
+  o->len = n < 0 ? o->size : o->len + n;
+}
+
+/* Numbers read from the rest of the proxy at report time */
+typedef struct {
+  const char *prom, *json, *help;
+  long value;
+} gauge_t;
+
+static int gauges(long *counters, gauge_t *g) {
+  cache_usage_t u;
+  int n = 0;
+
+  cache_usage(&u);
+  g[n++] = (gauge_t){"cache_objects", "cache_objects",
+                     "Entries in the cache, variant markers included",
+                     u.objects};
+  g[n++] = (gauge_t){"cache_bytes", "cache_bytes",
+                     "Response bytes held by the cache", (long)u.bytes};
+  g[n++] = (gauge_t){"cache_meta_bytes", "cache_meta_bytes",
+                     "Bytes of cache bookkeeping: entries and index",
+                     (long)u.meta_bytes};
+  g[n++] = (gauge_t){"cache_evictions_total", "cache_evictions",
+                     "Entries evicted to make room", u.evictions};
+  g[n++] = (gauge_t){"negative_cache_objects", "negative_cache_objects",
+                     "Error responses in the negative cache", neg_cached()};
+  g[n++] = (gauge_t){"connections_active", "connections_active",
+                     "Client connections open",
+                     counters[ST_CONN_OPENED] - counters[ST_CONN_CLOSED]};
+  g[n++] = (gauge_t){"tasks_queued", "tasks_queued",
+                     "Tasks waiting in the worker deques", workers_queued()};
+  g[n++] = (gauge_t){"wait_timeouts_total", "wait_timeouts",
+                     "Coroutine waits ended by a deadline or idle limit",
+                     workers_expired()};
+  g[n++] = (gauge_t){"log_dropped_total", "log_dropped",
+                     "Log records lost to full rings", log_dropped()};
+  return n;
+}
+
+static void render_prom(out_t *o, long *counters, stats_hist_t *hists) {
+  gauge_t g[16];
+  int i, j, n, len;
+
+  for (i = 0; i < ST_COUNTERS; i++) {
+    // labelled counters share the HELP and TYPE of the first of them
+    if (counter_names[i].help != NULL) {
+      len = strcspn(counter_names[i].prom, "{");
+      put(o, "# HELP proxy_%.*s %s.\n# TYPE proxy_%.*s counter\n", len,
+          counter_names[i].prom, counter_names[i].help, len,
+          counter_names[i].prom);
+    }
+    put(o, "proxy_%s %ld\n", counter_names[i].prom, counters[i]);
+  }
+  n = gauges(counters, g);
+  for (i = 0; i < n; i++) {
+    put(o, "# HELP proxy_%s %s.\n# TYPE proxy_%s %s\nproxy_%s %ld\n",
+        g[i].prom, g[i].help, g[i].prom,
+        strstr(g[i].prom, "_total") ? "counter" : "gauge", g[i].prom,
+        g[i].value);
+  }
+  put(o, "# HELP proxy_latency_seconds Request head parsed to response "
+         "sent, by cache outcome.\n# TYPE proxy_latency_seconds summary\n");
+  for (i = 0; i < ST_HISTS; i++) {
+    for (j = 0; j < (int)(sizeof(quantiles) / sizeof(quantiles[0])); j++) {
+      put(o, "proxy_latency_seconds{path=\"%s\",quantile=\"%g\"} %.6f\n",
+          hist_names[i], quantiles[j], quantile(&hists[i], quantiles[j]) / 1e6);
+    }
+    put(o, "proxy_latency_seconds_sum{path=\"%s\"} %.6f\n", hist_names[i],
+        hists[i].sum / 1e6);
+    put(o, "proxy_latency_seconds_count{path=\"%s\"} %ld\n", hist_names[i],
+        hists[i].total);
+  }
+}
+
+static void render_json(out_t *o, long *counters, stats_hist_t *hists) {
+  gauge_t g[16];
+  int i, j, n;
+
+  put(o, "{\"counters\": {");
+  for (i = 0; i < ST_COUNTERS; i++) {
+    put(o, "%s\"%s\": %ld", i ? ", " : "", counter_names[i].json,
+        counters[i]);
+  }
+  put(o, "}, \"gauges\": {");
+  n = gauges(counters, g);
+  for (i = 0; i < n; i++) {
+    put(o, "%s\"%s\": %ld", i ? ", " : "", g[i].json, g[i].value);
+  }
+  put(o, "}, \"latency_us\": {");
+  for (i = 0; i < ST_HISTS; i++) {
+    put(o, "%s\"%s\": {\"count\": %ld, \"sum\": %ld, \"max\": %ld",
+        i ? ", " : "", hist_names[i], hists[i].total, hists[i].sum,
+        hists[i].max);
+    for (j = 0; j < (int)(sizeof(quantiles) / sizeof(quantiles[0])); j++) {
+      put(o, ", \"%s\": %ld", quantile_names[j],
+          quantile(&hists[i], quantiles[j]));
+    }
+    put(o, "}");
+  }
+  put(o, "}}\n");
+}
+
+size_t stats_render(char *buf, size_t size, int json) {
+  long counters[ST_COUNTERS];
+  stats_hist_t *hists = Malloc(ST_HISTS * sizeof(stats_hist_t));
+  out_t o = {buf, 0, size};
+
+  merge(counters, hists);
+  if (json) {
+    render_json(&o, counters, hists);
+  } else {
+    render_prom(&o, counters, hists);
+  }
+  Free(hists);
+  return o.len < size ? o.len : size - 1;
+}
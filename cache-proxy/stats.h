@@ -0,0 +1,54 @@
+/* $begin stats.h */
+#ifndef __STATS_H__
+#define __STATS_H__
+
+#include <stddef.h>
+
+/*
+ * Runtime statistics. Counters and latency histograms live in per-thread
+ * shards that only their own thread writes, so counting costs a plain add
+ * and no shared cache line; a reader sums the shards. Histograms are
+ * HDR-style: exact below 16 us, then 8 buckets per power of two, so any
+ * recorded value is off by at most 12.5%.
+ */
+
+/* Counters; the timeout ones follow the proxy's connection phases */
+enum {
+  ST_REQUESTS,
+  ST_HITS,
+  ST_NEG_HITS,
+  ST_MISSES,
+  ST_REVALIDATIONS,
+  ST_NOT_MODIFIED,
+  ST_STALE_SERVED,
+  ST_CACHE_BYTES,
+  ST_ORIGIN_BYTES,
+  ST_ORIGIN_ERRORS,
+  ST_BAD_REQUESTS,
+  ST_CONN_OPENED,
+  ST_CONN_CLOSED,
+  ST_TUNNELS,
+  ST_TUNNEL_UP,
+  ST_TUNNEL_DOWN,
+  ST_TIMEOUT_HEADER,
+  ST_TIMEOUT_CONNECT,
+  ST_TIMEOUT_FIRST_BYTE,
+  ST_TIMEOUT_IDLE,
+  ST_COUNTERS
+};
+
+/* Latency histograms, request head parsed to response sent */
+enum { ST_LAT_HIT, ST_LAT_MISS, ST_HISTS };
+
+#define STATS_SUB_BITS 3 /* 2^3 buckets per power of two */
+#define STATS_BUCKETS (16 + 37 * (1 << STATS_SUB_BITS)) /* Up to 2^40 us */
+#define STATS_MAX_TEXT 16384 /* Room for a rendered report */
+
+void stats_add(int counter, long n);
+long stats_clock(void); /* Monotonic time in us */
+void stats_time(int hist, long start); /* Record stats_clock() - start */
+/* Render all statistics as JSON or Prometheus text; returns the length */
+size_t stats_render(char *buf, size_t size, int json);
+
+#endif
+/* $end stats.h */
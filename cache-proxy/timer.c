@@ -0,0 +1,138 @@
+#include "timer.h"
+#include <stddef.h>
+#include <time.h>
+
+#define WHEEL_MASK (WHEEL_SLOTS - 1)
+#define WHEEL_SPAN ((uint64_t)1 << (WHEEL_BITS * WHEEL_LEVELS))
+
+uint64_t wheel_clock(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+void wheel_init(wheel_t *w, uint64_t now) {
+  int l, i;
+
+  w->now = now;
+  w->count = 0;
+  for (l = 0; l < WHEEL_LEVELS; l++) {
+    for (i = 0; i < WHEEL_SLOTS; i++) {
+      w->slots[l][i].prev = w->slots[l][i].next = &w->slots[l][i];
+    }
+  }
+}
+
+/* Link t into the slot matching its distance from the current tick */
+static void wheel_link(wheel_t *w, wtimer_t *t) {
+  uint64_t delta;
+  wtimer_t *head;
+  int level = 0;
+
+  if (t->expires < w->now)
+    t->expires = w->now;
+  delta = t->expires - w->now;
+  if (delta >= WHEEL_SPAN) {
+    t->expires = w->now + WHEEL_SPAN - 1;
+    delta = WHEEL_SPAN - 1;
+  }
+  while (level < WHEEL_LEVELS - 1 &&
+         delta >= (uint64_t)1 << (WHEEL_BITS * (level + 1)))
+    level++;
+  head = &w->slots[level][(t->expires >> (WHEEL_BITS * level)) & WHEEL_MASK];
+  t->prev = head->prev;
+  t->next = head;
+  head->prev->next = t;
+  head->prev = t;
+}
+
+static void wheel_unlink(wtimer_t *t) {
+  t->prev->next = t->next;
+  t->next->prev = t->prev;
+  t->prev = t->next = NULL;
+}
+
+void wheel_add(wheel_t *w, wtimer_t *t, uint64_t expires) {
+  if (t->next != NULL)
+    wheel_del(w, t);
+  t->expires = expires;
+  wheel_link(w, t);
+  w->count++;
+}
+
+void wheel_del(wheel_t *w, wtimer_t *t) {
+  if (t->next == NULL)
+    return; /* Not armed */
+  wheel_unlink(t);
+  w->count--;
+}
+
+/* Re-file every timer of a coarse slot into the finer levels */
+static int cascade(wheel_t *w, int level) {
+  int index = (w->now >> (WHEEL_BITS * level)) & WHEEL_MASK;
+  wtimer_t *head = &w->slots[level][index];
+
+  while (head->next != head) {
+    wtimer_t *t = head->next;
+    wheel_unlink(t);
+    wheel_link(w, t);
+  }
+  return index;
+}
+
+/*
+ * wheel_advance - Turn the wheel up to now and run the callbacks of every
+ *     timer that expired. Returns the number of timers fired.
+ */
+int wheel_advance(wheel_t *w, uint64_t now) {
+  int fired = 0, level;
+
+  if (w->count == 0) {
+    if (now > w->now)
+      w->now = now;
+    return 0;
+  }
+  while (w->now <= now) {
+    wtimer_t *head = &w->slots[0][w->now & WHEEL_MASK];
+    for (level = 1; level < WHEEL_LEVELS; level++) {
+      if ((w->now & (((uint64_t)1 << (WHEEL_BITS * level)) - 1)) != 0 ||
+          cascade(w, level) != 0)
+        break;
+    }
+    while (head->next != head) {
+      wtimer_t *t = head->next;
+      wheel_unlink(t);
+      w->count--;
+      fired++;
+      t->fn(t);
+    }
+    w->now++;
+    if (w->count == 0 && now >= w->now) {
+      w->now = now;
+      break;
+    }
+  }
+  return fired;
+}
+
+/*
+ * wheel_timeout - How long a caller may sleep before the next timer can be
+ *     due. Exact for timers in the first level, otherwise the time until the
+ *     next cascade; -1 if no timer is armed.
+ */
+int wheel_timeout(wheel_t *w, uint64_t now) {
+  uint64_t tick;
+  int i;
+
+  if (w->count == 0)
+    return -1;
+  for (i = 0; i < WHEEL_SLOTS; i++) {
+    tick = w->now + i;
+    if ((tick & WHEEL_MASK) == 0 && i > 0)
+      break; /* Cascade point */
+    if (w->slots[0][tick & WHEEL_MASK].next != &w->slots[0][tick & WHEEL_MASK])
+      break;
+  }
+  tick = w->now + i;
+  return tick > now ? (int)(tick - now) : 0;
+}
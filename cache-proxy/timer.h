@@ -0,0 +1,39 @@
+/* $begin timer.h */
+#ifndef __TIMER_H__
+#define __TIMER_H__
+
+#include <stdint.h>
+
+/*
+ * Hierarchical timer wheel with 1 ms ticks: four levels of 64 slots cover
+ * about 4.6 hours, longer timers are clamped. Arming and cancelling are
+ * O(1) list operations; timers in coarse levels cascade down as the wheel
+ * turns. A wheel is not thread-safe, each scheduler owns its own.
+ */
+
+#define WHEEL_BITS 6
+#define WHEEL_SLOTS (1 << WHEEL_BITS)
+#define WHEEL_LEVELS 4
+
+typedef struct wtimer {
+  struct wtimer *prev, *next; /* Slot list links, NULL when not armed */
+  uint64_t expires;           /* Absolute time in ms */
+  void (*fn)(struct wtimer *t);
+  void *arg;
+} wtimer_t;
+
+typedef struct {
+  uint64_t now; /* Current tick, ms */
+  int count;    /* Armed timers */
+  wtimer_t slots[WHEEL_LEVELS][WHEEL_SLOTS]; /* List heads */
+} wheel_t;
+
+uint64_t wheel_clock(void); /* Monotonic ms */
+void wheel_init(wheel_t *w, uint64_t now);
+void wheel_add(wheel_t *w, wtimer_t *t, uint64_t expires);
+void wheel_del(wheel_t *w, wtimer_t *t);
+int wheel_advance(wheel_t *w, uint64_t now); /* Fires due timers */
+int wheel_timeout(wheel_t *w, uint64_t now); /* ms to sleep, -1 if idle */
+
+#endif
+/* $end timer.h */
@@ -0,0 +1,274 @@
+#include "trace.h"
+#include "co.h"
+#include "helpers.h"
+#include <stdarg.h>
+
+/*
+ * Written by its owning thread only. A reader copies records while they
+ * may be overwritten, so the owner announces a slot in begun before it
+ * writes it and publishes it in head after: a copy of record i is whole
+ * if begun still shows no write past i + TRACE_RING_SIZE once it is done.
+ */
+typedef struct trace_ring {
+  trace_t recs[TRACE_RING_SIZE];
+  unsigned long begun; /* Records started */
+  unsigned long head;  /* Records complete */
+  int id;
+  struct trace_ring *next;
+} trace_ring_t;
+
+static const char *phase_names[TP_PHASES] = {
+    "queued",     "read head", "parse", "lookup", "dns",    "connect",
+    "first byte", "transfer",  "store", "send",   "tunnel", "cache save"};
+
+static int sample_every; /* 0 when tracing is off */
+static uint64_t accepted[TRACE_FDS];
+static long last_id;
+static trace_ring_t *rings; /* Pushed at the front, never removed */
+static int nrings;
+static __thread trace_ring_t *this_ring;
+static __thread unsigned long seen; /* Requests begun on this thread */
+static uint64_t base_tick;          /* trace_now() and ... */
+static long base_ns;                /* ... the monotonic clock at init */
+
+static long mono_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000L + ts.tv_nsec;
+}
+
+/*
+ * trace_now - The TSC on x86, which ticks at a constant rate on any CPU of
+ *     the last decade and costs a fraction of clock_gettime; ticks become
+ *     time only when rendered, against the monotonic clock.
+ */
+uint64_t trace_now(void) {
+#if defined(__x86_64__) || defined(__i386__)
+  return __builtin_ia32_rdtsc();
+#else
+  return mono_ns();
+#endif
+}
+
+void trace_init(int sample) {
+  sample_every = sample > 0 ? sample : 0;
+  base_ns = mono_ns();
+  base_tick = trace_now();
+}
+
+void trace_accept(int fd) {
+  if (sample_every && fd >= 0 && fd < TRACE_FDS) {
+    accepted[fd] = trace_now();
+  }
+}
+
+void trace_attach(trace_t *t, int fd) {
+  if (!sample_every) {
+    return;
+  }
+  t->id = 0;
+  t->fd = fd;
+  t->started = trace_now();
+  t->accepted = fd < TRACE_FDS ? accepted[fd] : 0;
+  co_set_local(t);
+}
+
+static void mark(trace_t *t, int phase, uint64_t at) {
+  if (t->nmarks < TRACE_MARKS) {
+    t->phase[t->nmarks] = phase;
+    t->at[t->nmarks++] = at;
+  }
+}
+
+/* Decide whether the request whose head just came in is traced */
+void trace_begin(int nreq, const char *target, size_t len) {
+  trace_t *t = co_local();
+
+  if (t == NULL || seen++ % sample_every != 0) {
+    return;
+  }
+  t->id = __atomic_add_fetch(&last_id, 1, __ATOMIC_RELAXED);
+  t->nmarks = 0;
+  if (nreq == 1) {
+    if (t->accepted != 0) {
+      mark(t, TP_QUEUED, t->accepted);
+    }
+    mark(t, TP_READ_HEAD, t->started);
+  }
+  mark(t, TP_PARSE, trace_now());
+  if (len >= TRACE_TARGET) {
+    len = TRACE_TARGET - 1;
+  }
+  memcpy(t->target, target, len);
+  t->target[len] = '\0';
+}
+
+void trace_phase(int phase) {
+  trace_t *t = co_local();
+
+  if (t != NULL && t->id != 0 && t->phase[t->nmarks - 1] != phase) {
+    mark(t, phase, trace_now());
+  }
+}
+
+static trace_ring_t *ring_new(void) {
+  trace_ring_t *r = Malloc(sizeof(trace_ring_t));
+
+  r->begun = r->head = 0;
+  r->id = __atomic_fetch_add(&nrings, 1, __ATOMIC_RELAXED);
+  r->next = __atomic_load_n(&rings, __ATOMIC_RELAXED);
+  while (!__atomic_compare_exchange_n(&rings, &r->next, r, 1, __ATOMIC_RELEASE,
+                                      __ATOMIC_RELAXED)) {
+  }
+  return this_ring = r;
+}
+
+static void commit(const trace_t *t) {
+  trace_ring_t *r = this_ring ? this_ring : ring_new();
+  unsigned long head = r->head;
+
+  __atomic_store_n(&r->begun, head + 1, __ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+  r->recs[head & (TRACE_RING_SIZE - 1)] = *t;
+  __atomic_store_n(&r->head, head + 1, __ATOMIC_RELEASE);
+}
+
+void trace_end(void) {
+  trace_t *t = co_local();
+
+  if (t != NULL && t->id != 0) {
+    t->at[t->nmarks] = trace_now();
+    commit(t);
+    t->id = 0;
+  }
+}
+
+void trace_span(int phase, uint64_t start) {
+  trace_t t;
+
+  if (!sample_every) {
+    return;
+  }
+  t.id = __atomic_add_fetch(&last_id, 1, __ATOMIC_RELAXED);
+  t.fd = -1;
+  t.nmarks = 0;
+  mark(&t, phase, start);
+  t.at[1] = trace_now();
+  strcpy(t.target, phase_names[phase]);
+  commit(&t);
+}
+
+/* Append to buf like snprintf; -1 once it doesn't fit */
+static int put(char *buf, size_t size, size_t *len, const char *fmt, ...) {
+  va_list ap;
+  int n;
+
+  va_start(ap, fmt);
+  n = vsnprintf(buf + *len, size - *len, fmt, ap);
+  va_end(ap);
+  if (n < 0 || (size_t)n >= size - *len) {
+    return -1;
+  }
+  *len += n;
+  return 0;
+}
+
+/* s as the inside of a JSON string; out has room for 6 bytes per byte */
+static void json_escape(char *out, const char *s) {
+  for (; *s; s++) {
+    unsigned char c = *s;
+    if (c == '"' || c == '\\') {
+      *out++ = '\\';
+      *out++ = c;
+    } else if (c < 0x20) {
+      out += sprintf(out, "\\u%04x", c);
+    } else {
+      *out++ = c;
+    }
+  }
+  *out = '\0';
+}
+
+/* One record's events, all or none; -1 if they don't fit */
+static int render_rec(char *buf, size_t size, size_t *len, int pid,
+                      const trace_t *t, double us_per_tick) {
+  const char *sep = *len > 0 && buf[*len - 1] == '[' ? "\n" : ",\n";
+  char name[TRACE_TARGET * 6];
+  size_t start = *len;
+  double ts, end;
+  int i;
+
+  json_escape(name, t->target);
+  end = (double)(t->at[t->nmarks] - base_tick) * us_per_tick;
+  if (t->fd >= 0) {
+    ts = (double)(t->at[0] - base_tick) * us_per_tick;
+    if (put(buf, size, len,
+            "%s{\"name\":\"%s\",\"cat\":\"request\",\"ph\":\"X\",\"ts\":%.3f,"
+            "\"dur\":%.3f,\"pid\":%d,\"tid\":%d,\"args\":{\"id\":%ld}}",
+            sep, name, ts, end - ts, pid, t->fd, t->id) < 0) {
+      goto full;
+    }
+    sep = ",\n";
+  }
+  for (i = 0; i < t->nmarks; i++) {
+    ts = (double)(t->at[i] - base_tick) * us_per_tick;
+    end = (double)(t->at[i + 1] - base_tick) * us_per_tick;
+    if (put(buf, size, len,
+            "%s{\"name\":\"%s\",\"cat\":\"phase\",\"ph\":\"X\",\"ts\":%.3f,"
+            "\"dur\":%.3f,\"pid\":%d,\"tid\":%d,\"args\":{\"id\":%ld}}",
+            sep, phase_names[t->phase[i]], ts, end - ts, pid,
+            t->fd >= 0 ? t->fd : 0, t->id) < 0) {
+      goto full;
+    }
+    sep = ",\n";
+  }
+  return 0;
+full:
+  *len = start;
+  return -1;
+}
+
+/*
+ * trace_render - Every record still in the rings, as X events: one per
+ *     request, named by its target, with its phases nested inside it. pid
+ *     is the worker, tid the client connection, whose requests never
+ *     overlap. Records that don't fit in size are left out.
+ */
+size_t trace_render(char *buf, size_t size) {
+  double us_per_tick;
+  unsigned long head, i;
+  trace_ring_t *r;
+  trace_t rec;
+  uint64_t ticks;
+  size_t len = 0;
+  int full = 0;
+
+  ticks = trace_now() - base_tick;
+  us_per_tick = ticks ? (mono_ns() - base_ns) / 1000.0 / ticks : 0;
+  size -= 4; /* For the closing "]}\n" */
+  put(buf, size, &len, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[");
+  for (r = __atomic_load_n(&rings, __ATOMIC_ACQUIRE); r && !full;
+       r = r->next) {
+    if (put(buf, size, &len,
+            "%s{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":%d,"
+            "\"args\":{\"name\":\"worker %d\"}}",
+            buf[len - 1] == '[' ? "\n" : ",\n", r->id, r->id) < 0) {
+      break;
+    }
+    head = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+    for (i = head > TRACE_RING_SIZE ? head - TRACE_RING_SIZE : 0; i < head;
+         i++) {
+      rec = r->recs[i & (TRACE_RING_SIZE - 1)];
+      __atomic_thread_fence(__ATOMIC_ACQUIRE);
+      if (__atomic_load_n(&r->begun, __ATOMIC_RELAXED) > i + TRACE_RING_SIZE) {
+        continue; /* Overwritten while we copied it */
+      }
+      if (render_rec(buf, size, &len, r->id, &rec, us_per_tick) < 0) {
+        full = 1;
+        break;
+      }
+    }
+  }
+  len += sprintf(buf + len, "\n]}\n");
+  return len;
+}
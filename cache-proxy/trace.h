@@ -0,0 +1,68 @@
+/* $begin trace.h */
+#ifndef __TRACE_H__
+#define __TRACE_H__
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Per-request phase tracing. A sampled request notes the cycle counter
+ * each time it moves on to another phase; when it is done, the marks go
+ * as one record into a ring of the thread that served it, with no lock.
+ * The rings keep the latest records and are rendered on demand in Chrome
+ * trace_event JSON, one row per client connection under each worker.
+ *
+ * The trace being built hangs off the running coroutine, so code below
+ * the request handler marks phases without being handed anything, and
+ * every call is a no-op in requests that were not sampled.
+ */
+
+/* Phases, in the order a request usually goes through them */
+enum {
+  TP_QUEUED,     /* Accepted, waiting for a worker */
+  TP_READ_HEAD,  /* First request head arriving */
+  TP_PARSE,      /* Head parsed to cache key */
+  TP_LOOKUP,     /* Main and negative cache */
+  TP_DNS,        /* Resolving the origin */
+  TP_CONNECT,    /* Connecting to the origin */
+  TP_FIRST_BYTE, /* Request sent, waiting for the status line */
+  TP_TRANSFER,   /* Relaying the response */
+  TP_STORE,      /* Putting the response into the cache */
+  TP_SEND,       /* Sending a cached or local response */
+  TP_TUNNEL,     /* CONNECT tunnel */
+  TP_SAVE,       /* Cache snapshot, off the request path */
+  TP_PHASES
+};
+
+#define TRACE_MARKS 16      /* Phase changes kept per request */
+#define TRACE_TARGET 96     /* Bytes of the request target kept */
+#define TRACE_RING_SIZE 256 /* Records per thread, a power of two */
+#define TRACE_FDS 65536     /* Descriptors whose accept time is kept */
+#define TRACE_MAX_TEXT (8 << 20) /* Room for all rings, rendered */
+
+typedef struct {
+  long id;     /* Sampled request number, 0 while not tracing */
+  int fd;      /* Client connection, -1 for background work */
+  int nmarks;
+  unsigned char phase[TRACE_MARKS];
+  uint64_t at[TRACE_MARKS + 1]; /* Phase i runs from at[i] to at[i + 1] */
+  uint64_t accepted, started;   /* The connection's, until its first head */
+  char target[TRACE_TARGET];
+} trace_t;
+
+void trace_init(int sample); /* Trace 1 in sample requests; 0 turns it off */
+uint64_t trace_now(void);    /* Cycle counter, or ns where there is none */
+void trace_accept(int fd);   /* Acceptor: fd's connection starts queueing */
+
+/* Connection coroutine: t is where its requests are traced */
+void trace_attach(trace_t *t, int fd);
+void trace_begin(int nreq, const char *target, size_t len);
+void trace_phase(int phase);
+void trace_end(void); /* Keep the record, if the request was sampled */
+void trace_span(int phase, uint64_t start); /* Background work, until now */
+
+/* Render the rings in trace_event JSON; returns the length */
+size_t trace_render(char *buf, size_t size);
+
+#endif
+/* $end trace.h */
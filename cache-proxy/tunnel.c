@@ -0,0 +1,148 @@
+#include "tunnel.h"
+#include "co.h"
+#include "helpers.h"
+#include "splice.h"
+#include "timer.h"
+#include <stdint.h>
+
+#define TUNNEL_CHUNK 65536
+
+typedef struct {
+  int fd[2];      /* Client, server; the second direction uses dups */
+  int idle_ms;
+  uint64_t last;  /* wheel_clock() when a byte last moved */
+  long moved[2];  /* Bytes client -> server, server -> client */
+  int timed_out;
+  int failed;     /* A direction broke; the other one winds down */
+  co_t *parent;
+} tunnel_t;
+
+/* Like co_wait_fd, but give up only once the whole tunnel, not just this
+ * direction, has been quiet for idle_ms */
+static int tunnel_wait(tunnel_t *t, int fd, int events) {
+  uint64_t now;
+  int rc;
+
+  do {
+    now = wheel_clock();
+    if (t->failed || now >= t->last + t->idle_ms) {
+      t->timed_out |= !t->failed;
+      errno = ETIMEDOUT;
+      return -1;
+    }
+    rc = co_wait_any(&fd, 1, events, t->last + t->idle_ms - now);
+  } while (rc == 1);
+  return rc;
+}
+
+/* Wake the other direction with EOF and errors so that it ends too */
+static void tunnel_abort(tunnel_t *t, int in, int out) {
+  t->failed = 1;
+  shutdown(in, SHUT_RDWR);
+  shutdown(out, SHUT_RDWR);
+}
+
+/* Move bytes from in to out until EOF, then half-close out */
+static void pump(tunnel_t *t, int dir, int in, int out) {
+  ssize_t n, m;
+#ifdef __linux__
+  int p[2];
+
+  if (pipe(p) < 0) {
+    tunnel_abort(t, in, out);
+    return;
+  }
+  while ((n = splice_move(in, p[1], TUNNEL_CHUNK)) != 0) {
+    if (n < 0) {
+      if (errno == EINTR ||
+          (errno == EAGAIN && tunnel_wait(t, in, CO_READ) == 0))
+        continue;
+      break;
+    }
+    while (n > 0) {
+      m = splice_move(p[0], out, n);
+      if (m < 0) {
+        if (errno == EINTR ||
+            (errno == EAGAIN && tunnel_wait(t, out, CO_WRITE) == 0))
+          continue;
+        break;
+      }
+      n -= m;
+      t->moved[dir] += m;
+      t->last = wheel_clock();
+    }
+    if (n > 0)
+      break;
+  }
+  close(p[0]);
+  close(p[1]);
+#else
+  char buf[MAXBUF];
+  ssize_t off;
+
+  while ((n = read(in, buf, sizeof(buf))) != 0) {
+    if (n < 0) {
+      if (errno == EINTR ||
+          (errno == EAGAIN && tunnel_wait(t, in, CO_READ) == 0))
+        continue;
+      break;
+    }
+    for (off = 0; off < n; off += m) {
+      if ((m = write(out, buf + off, n - off)) < 0) {
+        if (errno == EINTR ||
+            (errno == EAGAIN && tunnel_wait(t, out, CO_WRITE) == 0)) {
+          m = 0;
+          continue;
+        }
+        break;
+      }
+      t->moved[dir] += m;
+      t->last = wheel_clock();
+    }
+    if (off < n)
+      break;
+  }
+#endif
+  if (n == 0)
+    shutdown(out, SHUT_WR); /* Pass the EOF on */
+  else
+    tunnel_abort(t, in, out);
+}
+
+/* The server -> client direction, on its own descriptors so that its epoll
+ * registrations don't clash with the parent's */
+static void pump_down(void *vargp) {
+  tunnel_t *t = vargp;
+  int in = dup(t->fd[1]), out = dup(t->fd[0]);
+
+  if (in < 0 || out < 0)
+    tunnel_abort(t, t->fd[1], t->fd[0]);
+  else
+    pump(t, 1, in, out);
+  if (in >= 0)
+    close(in);
+  if (out >= 0)
+    close(out);
+  co_unpark(t->parent);
+}
+
+void tunnel_run(int client, int server, int idle_ms, tunnel_stats_t *st) {
+  tunnel_t t;
+
+  memset(&t, 0, sizeof(t));
+  t.fd[0] = client;
+  t.fd[1] = server;
+  t.idle_ms = idle_ms;
+  t.last = wheel_clock();
+  t.parent = co_current();
+  co_deadline(0);
+  co_idle_timeout(0); /* tunnel_wait does the idle accounting */
+
+  co_spawn(pump_down, &t);
+  pump(&t, 0, client, server);
+  co_park(); /* Until pump_down is done with t */
+
+  st->up += t.moved[0];
+  st->down += t.moved[1];
+  st->timed_out = t.timed_out;
+}
@@ -0,0 +1,24 @@
+/* $begin tunnel.h */
+#ifndef __TUNNEL_H__
+#define __TUNNEL_H__
+
+/*
+ * Bidirectional relay between two connected sockets, used for CONNECT.
+ * It must run inside a coroutine. The caller's coroutine moves bytes from
+ * client to server, and a second coroutine on the same scheduler moves
+ * them back, so an idle tunnel holds no thread. On Linux both directions
+ * use splice() and the bytes stay in the kernel. An EOF on one side is
+ * passed on as a half-close. The tunnel ends when both directions are done,
+ * or when no byte has moved either way for idle_ms.
+ */
+
+typedef struct {
+  long up;       /* Bytes client -> server */
+  long down;     /* Bytes server -> client */
+  int timed_out; /* Ended by the idle limit */
+} tunnel_stats_t;
+
+void tunnel_run(int client, int server, int idle_ms, tunnel_stats_t *st);
+
+#endif
+/* $end tunnel.h */
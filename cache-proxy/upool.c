@@ -0,0 +1,138 @@
+#include "upool.h"
+#include "config.h"
+#include "helpers.h"
+#include "timer.h"
+
+#define UPOOL_BUCKETS 64
+#define UPOOL_REAP_MS 1000 /* How often idle connections are swept */
+
+typedef struct upconn {
+  int fd;
+  int port;
+  uint64_t since; /* When it went idle */
+  struct upconn *next;
+  char host[];
+} upconn_t;
+
+typedef struct {
+  pthread_mutex_t lock;
+  upconn_t *head; /* Most recently returned first */
+} bucket_t;
+
+static bucket_t buckets[UPOOL_BUCKETS];
+static pthread_once_t init_once = PTHREAD_ONCE_INIT;
+static long nidle;
+static uint64_t last_reap;
+
+static void upool_init(void) {
+  int i;
+  for (i = 0; i < UPOOL_BUCKETS; i++)
+    pthread_mutex_init(&buckets[i].lock, NULL);
+}
+
+static bucket_t *bucket_of(const char *host, int port) {
+  unsigned h = 2166136261u; /* FNV-1a */
+  for (; *host; host++)
+    h = (h ^ (unsigned char)*host) * 16777619u;
+  h = (h ^ port) * 16777619u;
+  Pthread_once(&init_once, upool_init);
+  return &buckets[h % UPOOL_BUCKETS];
+}
+
+/* An idle connection is healthy if the origin neither closed it nor sent
+ * anything unsolicited while it sat in the pool */
+static int upconn_alive(int fd) {
+  char c;
+  return recv(fd, &c, 1, MSG_PEEK | MSG_DONTWAIT) < 0 &&
+         (errno == EAGAIN || errno == EWOULDBLOCK);
+}
+
+static void upconn_drop(upconn_t *c) {
+  __atomic_sub_fetch(&nidle, 1, __ATOMIC_RELAXED);
+  close(c->fd);
+  Free(c);
+}
+
+/* Close every connection idle for longer than the timeout */
+static void upool_reap(uint64_t now) {
+  upconn_t **pp, *c;
+  int i;
+
+  for (i = 0; i < UPOOL_BUCKETS; i++) {
+    pthread_mutex_lock(&buckets[i].lock);
+    for (pp = &buckets[i].head; (c = *pp) != NULL;) {
+      if (now - c->since >= (uint64_t)conf.pool_idle_timeout) {
+        *pp = c->next;
+        upconn_drop(c);
+      } else {
+        pp = &c->next;
+      }
+    }
+    pthread_mutex_unlock(&buckets[i].lock);
+  }
+}
+
+int upool_get(const char *host, int port) {
+  bucket_t *b = bucket_of(host, port);
+  uint64_t now = wheel_clock();
+  upconn_t **pp, *c;
+  int fd = -1;
+
+  pthread_mutex_lock(&b->lock);
+  for (pp = &b->head; (c = *pp) != NULL;) {
+    if (c->port != port || strcmp(c->host, host) != 0) {
+      pp = &c->next;
+      continue;
+    }
+    *pp = c->next;
+    if (now - c->since < (uint64_t)conf.pool_idle_timeout &&
+        upconn_alive(c->fd)) {
+      fd = c->fd;
+      __atomic_sub_fetch(&nidle, 1, __ATOMIC_RELAXED);
+      Free(c);
+      break;
+    }
+    upconn_drop(c); /* Stale or closed by the origin */
+  }
+  pthread_mutex_unlock(&b->lock);
+  return fd;
+}
+
+void upool_put(const char *host, int port, int fd) {
+  bucket_t *b = bucket_of(host, port);
+  uint64_t now = wheel_clock(), last;
+  upconn_t *c;
+  int same = 0;
+
+  if (__atomic_load_n(&nidle, __ATOMIC_RELAXED) >= conf.pool_max_idle) {
+    close(fd);
+    return;
+  }
+  pthread_mutex_lock(&b->lock);
+  for (c = b->head; c != NULL; c = c->next) {
+    if (c->port == port && strcmp(c->host, host) == 0)
+      same++;
+  }
+  if (same >= conf.pool_max_per_host) {
+    pthread_mutex_unlock(&b->lock);
+    close(fd);
+    return;
+  }
+  c = Malloc(sizeof(upconn_t) + strlen(host) + 1);
+  c->fd = fd;
+  c->port = port;
+  c->since = now;
+  strcpy(c->host, host);
+  c->next = b->head;
+  b->head = c;
+  __atomic_add_fetch(&nidle, 1, __ATOMIC_RELAXED);
+  pthread_mutex_unlock(&b->lock);
+
+  last = __atomic_load_n(&last_reap, __ATOMIC_RELAXED);
+  if (now - last >= UPOOL_REAP_MS &&
+      __atomic_compare_exchange_n(&last_reap, &last, now, 0, __ATOMIC_RELAXED,
+                                  __ATOMIC_RELAXED))
+    upool_reap(now);
+}
+
+long upool_idle(void) { return __atomic_load_n(&nidle, __ATOMIC_RELAXED); }
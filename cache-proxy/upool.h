@@ -0,0 +1,16 @@
+/* $begin upool.h */
+#ifndef __UPOOL_H__
+#define __UPOOL_H__
+
+/*
+ * Pool of idle keep-alive connections to origin servers, keyed by
+ * (host, port). Connections are checked before reuse and closed once they
+ * have been idle longer than conf.pool_idle_timeout.
+ */
+
+int upool_get(const char *host, int port);          /* -1 if none idle */
+void upool_put(const char *host, int port, int fd); /* Takes ownership */
+long upool_idle(void);                              /* Pooled connections */
+
+#endif
+/* $end upool.h */
@@ -0,0 +1,204 @@
+#include "workers.h"
+#include "helpers.h"
+#include "wsq.h"
+
+#define STEAL_BATCH 16 /* Tasks started per scheduler round */
+
+typedef struct {
+  task_fn fn;
+  void *arg;
+} task_t;
+
+typedef struct {
+  wsq_t q;
+  co_sched_t *sched;
+  int sleeping; /* May be blocked in its reactor, see worker_idle */
+  unsigned seed;
+} worker_t;
+
+static worker_t *workers;
+static int nworkers, max_tasks;
+static wsq_t injector; /* Owned by the acceptor thread */
+static int nsleeping;
+static __thread worker_t *this_worker;
+
+static task_t *task_new(task_fn fn, void *arg) {
+  task_t *t = Malloc(sizeof(task_t));
+  t->fn = fn;
+  t->arg = arg;
+  return t;
+}
+
+static void task_run(task_t *t) {
+  task_fn fn = t->fn;
+  void *arg = t->arg;
+  Free(t);
+  fn(arg);
+}
+
+static int claim_sleeper(worker_t *w) {
+  int one = 1;
+  if (__atomic_compare_exchange_n(&w->sleeping, &one, 0, 0, __ATOMIC_SEQ_CST,
+                                  __ATOMIC_RELAXED)) {
+    __atomic_sub_fetch(&nsleeping, 1, __ATOMIC_SEQ_CST);
+    return 1;
+  }
+  return 0;
+}
+
+/* Wake one sleeping worker, if any, so it can steal what was just pushed */
+static void wake_one(void) {
+  static unsigned next;
+  int i, start;
+
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
+  if (__atomic_load_n(&nsleeping, __ATOMIC_SEQ_CST) == 0)
+    return;
+  start = __atomic_fetch_add(&next, 1, __ATOMIC_RELAXED) % nworkers;
+  for (i = 0; i < nworkers; i++) {
+    worker_t *w = &workers[(start + i) % nworkers];
+    if (claim_sleeper(w)) {
+      co_sched_wake(w->sched);
+      return;
+    }
+  }
+}
+
+static void *steal_from(wsq_t *q) {
+  void *t;
+  while ((t = wsq_steal(q)) == WSQ_ABORT)
+    ;
+  return t;
+}
+
+/* Own deque first (LIFO, cache-warm), then new connections, then peers */
+static task_t *find_task(worker_t *w) {
+  task_t *t;
+  int i, start;
+
+  if ((t = wsq_take(&w->q)) != WSQ_EMPTY)
+    return t;
+  if (co_sched_load(w->sched) >= max_tasks)
+    return NULL; /* Saturated: leave new work to the others */
+  if ((t = steal_from(&injector)) != WSQ_EMPTY)
+    return t;
+  w->seed = w->seed * 1103515245 + 12345;
+  start = (w->seed >> 16) % nworkers;
+  for (i = 0; i < nworkers; i++) {
+    worker_t *v = &workers[(start + i) % nworkers];
+    if (v != w && (t = steal_from(&v->q)) != WSQ_EMPTY)
+      return t;
+  }
+  return NULL;
+}
+
+static int work_visible(worker_t *w) {
+  int i;
+
+  if (wsq_size(&w->q) > 0)
+    return 1;
+  if (co_sched_load(w->sched) >= max_tasks)
+    return 0;
+  if (wsq_size(&injector) > 0)
+    return 1;
+  for (i = 0; i < nworkers; i++) {
+    if (wsq_size(&workers[i].q) > 0)
+      return 1;
+  }
+  return 0;
+}
+
+/*
+ * worker_idle - Scheduler hook, run once per round. Starts a batch of
+ *     tasks; once it runs out of them it flags the worker as sleeping
+ *     before the scheduler may block, so producers know to wake it.
+ */
+static void worker_idle(co_sched_t *s, void *vargp) {
+  worker_t *w = vargp;
+  task_t *t;
+  int n;
+
+  claim_sleeper(w);
+  for (n = 0; n < STEAL_BATCH && (t = find_task(w)) != NULL; n++) {
+    task_run(t);
+  }
+  if (n == STEAL_BATCH) { /* Maybe more than we can start: get help */
+    wake_one();
+    co_sched_wake(s); /* and come back for the rest without blocking */
+    return;
+  }
+  __atomic_store_n(&w->sleeping, 1, __ATOMIC_SEQ_CST);
+  __atomic_add_fetch(&nsleeping, 1, __ATOMIC_SEQ_CST);
+  if (work_visible(w)) /* Pushed after our scan: don't block on it */
+    co_sched_wake(s);
+}
+
+static void *worker_main(void *vargp) {
+  worker_t *w = vargp;
+
+  Pthread_detach(pthread_self());
+  this_worker = w;
+  __atomic_store_n(&w->sched, co_sched_create(), __ATOMIC_RELEASE);
+  co_sched_run(w->sched, worker_idle, w);
+  return NULL;
+}
+
+void workers_init(int nthreads, int max) {
+  pthread_t tid;
+  int i;
+
+  nworkers = nthreads;
+  max_tasks = max;
+  workers = Calloc(nthreads, sizeof(worker_t));
+  wsq_init(&injector, WORKERS_QUEUE);
+  for (i = 0; i < nthreads; i++) {
+    wsq_init(&workers[i].q, WORKERS_QUEUE);
+    workers[i].seed = i + 1;
+  }
+  for (i = 0; i < nthreads; i++) {
+    Pthread_create(&tid, NULL, worker_main, &workers[i]);
+  }
+  for (i = 0; i < nthreads; i++) { /* Wait until every scheduler is up */
+    while (__atomic_load_n(&workers[i].sched, __ATOMIC_ACQUIRE) == NULL)
+      sched_yield();
+  }
+}
+
+void workers_submit(task_fn fn, void *arg) {
+  task_t *t = task_new(fn, arg);
+
+  while (wsq_push(&injector, t) < 0) { /* Full: back off until drained */
+    wake_one();
+    usleep(1000);
+  }
+  wake_one();
+}
+
+void workers_push(task_fn fn, void *arg) {
+  worker_t *w = this_worker;
+  task_t *t = task_new(fn, arg);
+
+  if (w == NULL || wsq_push(&w->q, t) < 0) {
+    task_run(t); /* Not a worker, or deque full: just do it now */
+    return;
+  }
+  wake_one();
+}
+
+long workers_queued(void) {
+  long n = wsq_size(&injector);
+  int i;
+
+  for (i = 0; i < nworkers; i++)
+    n += wsq_size(&workers[i].q);
+  return n;
+}
+
+long workers_expired(void) {
+  long n = 0;
+  int i;
+
+  for (i = 0; i < nworkers; i++)
+    n += co_sched_expired(workers[i].sched);
+  return n;
+}
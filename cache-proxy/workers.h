@@ -0,0 +1,26 @@
+/* $begin workers.h */
+#ifndef __WORKERS_H__
+#define __WORKERS_H__
+
+#include "co.h"
+
+/*
+ * Work-stealing worker pool. Every worker thread runs a coroutine scheduler
+ * and owns a deque of tasks: follow-up work pushed from a worker stays on
+ * that worker, and idle workers steal from busy ones. The acceptor thread
+ * owns one more deque that only ever gets stolen from, so handing over a
+ * new connection takes no lock.
+ */
+
+#define WORKERS_QUEUE 1024 /* Deque capacity per worker and for the acceptor */
+
+typedef void (*task_fn)(void *arg);
+
+void workers_init(int nthreads, int max_tasks);
+void workers_submit(task_fn fn, void *arg); /* Acceptor thread only */
+void workers_push(task_fn fn, void *arg);   /* From a worker thread */
+long workers_queued(void);                  /* Tasks not yet started */
+long workers_expired(void); /* Coroutine waits ended by a timeout, all told */
+
+#endif
+/* $end workers.h */
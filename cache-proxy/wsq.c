@@ -0,0 +1,70 @@
+#include "wsq.h"
+#include "helpers.h"
+
+/* Create an empty deque; capacity is rounded up to a power of two */
+void wsq_init(wsq_t *q, long capacity) {
+  long cap = 1;
+  while (cap < capacity)
+    cap <<= 1;
+  q->top = q->bottom = 0;
+  q->mask = cap - 1;
+  q->buf = Calloc(cap, sizeof(void *));
+}
+
+void wsq_deinit(wsq_t *q) { Free(q->buf); }
+
+int wsq_push(wsq_t *q, void *item) {
+  long b = __atomic_load_n(&q->bottom, __ATOMIC_RELAXED);
+  long t = __atomic_load_n(&q->top, __ATOMIC_ACQUIRE);
+
+  if (b - t > q->mask)
+    return -1; /* Full */
+  __atomic_store_n(&q->buf[b & q->mask], item, __ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+  __atomic_store_n(&q->bottom, b + 1, __ATOMIC_RELAXED);
+  return 0;
+}
+
+void *wsq_take(wsq_t *q) {
+  long b = __atomic_load_n(&q->bottom, __ATOMIC_RELAXED) - 1;
+  long t;
+  void *item = WSQ_EMPTY;
+
+  __atomic_store_n(&q->bottom, b, __ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
+  t = __atomic_load_n(&q->top, __ATOMIC_RELAXED);
+  if (t <= b) {
+    item = __atomic_load_n(&q->buf[b & q->mask], __ATOMIC_RELAXED);
+    if (t == b) { /* Last item: race thieves for it */
+      if (!__atomic_compare_exchange_n(&q->top, &t, t + 1, 0,
+                                       __ATOMIC_SEQ_CST, __ATOMIC_RELAXED))
+        item = WSQ_EMPTY;
+      __atomic_store_n(&q->bottom, b + 1, __ATOMIC_RELAXED);
+    }
+  } else { /* Already empty */
+    __atomic_store_n(&q->bottom, b + 1, __ATOMIC_RELAXED);
+  }
+  return item;
+}
+
+void *wsq_steal(wsq_t *q) {
+  long t = __atomic_load_n(&q->top, __ATOMIC_ACQUIRE);
+  long b;
+  void *item;
+
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
+  b = __atomic_load_n(&q->bottom, __ATOMIC_ACQUIRE);
+  if (t >= b)
+    return WSQ_EMPTY;
+  item = __atomic_load_n(&q->buf[t & q->mask], __ATOMIC_RELAXED);
+  if (!__atomic_compare_exchange_n(&q->top, &t, t + 1, 0, __ATOMIC_SEQ_CST,
+                                   __ATOMIC_RELAXED))
+    return WSQ_ABORT;
+  return item;
+}
+
+long wsq_size(wsq_t *q) {
+  long b = __atomic_load_n(&q->bottom, __ATOMIC_RELAXED);
+  long t = __atomic_load_n(&q->top, __ATOMIC_RELAXED);
+  return b > t ? b - t : 0;
+}
@@ -0,0 +1,29 @@
+/* $begin wsq.h */
+#ifndef __WSQ_H__
+#define __WSQ_H__
+
+/*
+ * Bounded Chase-Lev work-stealing deque. The owner thread pushes and takes
+ * at the bottom without locks; any other thread may steal from the top.
+ */
+
+#define WSQ_EMPTY ((void *)0)
+#define WSQ_ABORT ((void *)1) /* Lost a race with another thief, retry */
+
+typedef struct {
+  long top; /* Next item to steal */
+  char pad[64 - sizeof(long)];
+  long bottom;  /* Next free slot; owner only */
+  long mask;    /* Capacity - 1, capacity is a power of two */
+  void **buf;
+} wsq_t;
+
+void wsq_init(wsq_t *q, long capacity);
+void wsq_deinit(wsq_t *q);
+int wsq_push(wsq_t *q, void *item); /* Owner; returns -1 if full */
+void *wsq_take(wsq_t *q);           /* Owner; LIFO end */
+void *wsq_steal(wsq_t *q);          /* Any thread; FIFO end */
+long wsq_size(wsq_t *q);            /* Approximate */
+
+#endif
+/* $end wsq.h */
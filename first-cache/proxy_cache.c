@@ -155,13 +155,17 @@ void *handle_client(void *client_socket_ptr) {
   char response[1024] = {0};
   int bytes_received = 0;
   int is_not_modified = 0;
+  int first_chunk = 1;
 
   while ((bytes_received = read(client_fd, response, sizeof(response))) > 0) {
-    if (cache_file != NULL &&
-        strstr(response, "HTTP/1.1 304 Not Modified") != NULL) {
+    // Only the status line can say 304; later chunks are body bytes
+    if (first_chunk && cache_file != NULL && bytes_received >= 12 &&
+        memcmp(response, "HTTP/1.", 7) == 0 &&
+        memcmp(response + 8, " 304", 4) == 0) {
       is_not_modified = 1;
       break;
     }
+    first_chunk = 0;
     int bytes_sent =
         send(client_communication_socket, response, bytes_received, 0);
     if (bytes_sent < 0) {
@@ -182,7 +186,6 @@ void *handle_client(void *client_socket_ptr) {
     }
     if (cache_file != NULL)
       fwrite(response, 1, bytes_received, cache_file);
-    memset(response, 0, sizeof(response));
   }
 
   if (is_not_modified && cache_file != NULL) {
@@ -9,16 +9,56 @@
 #include <sys/socket.h>
 #include <unistd.h>
 
-// Maximum number of simultaneous connections
+// Number of worker threads handling clients
 // (needed because large sites create lots of requests)
-#define MAX_CLIENTS 20
+#define NUM_WORKERS 20
+// Accepted connections waiting for a worker; past this we shed load
+#define QUEUE_SIZE 256
 
-int server_fd;                         // Global to access across functions
-pthread_t client_threads[MAX_CLIENTS]; // Array to store client threads
+int server_fd; // Global to access across functions
 
-// Thread function to handle each client
-void *handle_client(void *client_socket_ptr) {
-  int client_communication_socket = *((int *)client_socket_ptr);
+// Bounded queue of accepted sockets shared by the acceptor and the workers
+struct client_queue {
+  int fds[QUEUE_SIZE];
+  int head, count;
+  pthread_mutex_t lock;
+  pthread_cond_t not_empty;
+} queue = {.lock = PTHREAD_MUTEX_INITIALIZER,
+           .not_empty = PTHREAD_COND_INITIALIZER};
+
+static const char overloaded_response[] =
+    "HTTP/1.1 503 Service Unavailable\r\nConnection: close\r\n"
+    "Content-Length: 0\r\n\r\n";
+
+// Add a socket to the queue; returns -1 if the queue is full
+int queue_push(int client_socket) {
+  pthread_mutex_lock(&queue.lock);
+  if (queue.count == QUEUE_SIZE) {
+    pthread_mutex_unlock(&queue.lock);
+    return -1;
+  }
+  queue.fds[(queue.head + queue.count) % QUEUE_SIZE] = client_socket;
+  queue.count++;
+  pthread_cond_signal(&queue.not_empty);
+  pthread_mutex_unlock(&queue.lock);
+  return 0;
+}
+
+// Take the oldest socket from the queue, waiting until there is one
+int queue_pop(void) {
+  pthread_mutex_lock(&queue.lock);
+  while (queue.count == 0) {
+    pthread_cond_wait(&queue.not_empty, &queue.lock);
+  }
+  int client_socket = queue.fds[queue.head];
+  queue.head = (queue.head + 1) % QUEUE_SIZE;
+  queue.count--;
+  pthread_mutex_unlock(&queue.lock);
+  return client_socket;
+}
+
+// Handle a single client connection
+void handle_client(int client_communication_socket) {
   char buffer[1024] = {0};       // To receive HTTP request
   char http_request[1024] = {0}; // To store HTTP request
 
@@ -28,7 +68,7 @@ void *handle_client(void *client_socket_ptr) {
   if (bytes_read < 0) {
     perror("SERVER: read failed");
     close(client_communication_socket);
-    return NULL;
+    return;
   }
   buffer[bytes_read] = '\0'; // Add null terminator
 
@@ -40,14 +80,14 @@ void *handle_client(void *client_socket_ptr) {
   if (ptr == NULL) {
     fprintf(stderr, "SERVER: Host header not found in HTTP request\n");
     close(client_communication_socket);
-    return NULL;
+    return;
   }
   ptr += strlen("Host: ");
   char *end_ptr = strchr(ptr, '\r');
   if (end_ptr == NULL) {
     fprintf(stderr, "SERVER: Invalid HTTP request format\n");
     close(client_communication_socket);
-    return NULL;
+    return;
   }
   *end_ptr = '\0';
   printf("SERVER: HTTP request received to %s\n", ptr);
@@ -63,7 +103,7 @@ void *handle_client(void *client_socket_ptr) {
   if (ret != 0) {
     fprintf(stderr, "SERVER: getaddrinfo failed: %s\n", gai_strerror(ret));
     close(client_communication_socket);
-    return NULL;
+    return;
   }
 
   // Create a client socket to connect to the server
@@ -71,7 +111,7 @@ void *handle_client(void *client_socket_ptr) {
   if ((client_fd = socket(AF_INET, SOCK_STREAM, 0)) < 0) {
     perror("CLIENT: socket creation failed");
     close(client_communication_socket);
-    return NULL;
+    return;
   }
   // Copy the resolved IP address to the server_address structure
   struct sockaddr_in server_address;
@@ -88,7 +128,7 @@ void *handle_client(void *client_socket_ptr) {
     perror("CLIENT: connection failed");
     close(client_communication_socket);
     close(client_fd);
-    return NULL;
+    return;
   }
 
   // Send the HTTP request to the server
@@ -105,7 +145,7 @@ void *handle_client(void *client_socket_ptr) {
       perror("SERVER: send failed");
       close(client_communication_socket);
       close(client_fd);
-      return NULL;
+      return;
     }
     printf("CLIENT: HTTP response received from %s. SERVER: HTTP response sent "
            "back to client\n",
@@ -116,13 +156,21 @@ void *handle_client(void *client_socket_ptr) {
     perror("CLIENT: read failed");
     close(client_communication_socket);
     close(client_fd);
-    return NULL;
+    return;
   } else if (bytes_received == 0) {
     printf("CLIENT: Server closed connection\n");
   }
 
   close(client_communication_socket);
   close(client_fd);
+}
+
+// Worker thread: serve queued clients one after another, forever
+void *worker(void *arg) {
+  (void)arg;
+  while (1) {
+    handle_client(queue_pop());
+  }
   return NULL;
 }
 
@@ -146,6 +194,8 @@ int main(int argc, char **argv) {
   // close server socket on Ctrl-C
   signal(SIGINT, handle_signal);
   signal(SIGTERM, handle_signal);
+  // a client hanging up mid-response must not kill the whole pool
+  signal(SIGPIPE, SIG_IGN);
 
   // Create server socket, bind, and listen for connection
   struct sockaddr_in address;
@@ -163,12 +213,23 @@ int main(int argc, char **argv) {
     close(server_fd);
     exit(EXIT_FAILURE);
   }
-  if (listen(server_fd, 3) < 0) {
+  if (listen(server_fd, SOMAXCONN) < 0) {
     perror("SERVER: listen failed");
     close(server_fd);
     exit(EXIT_FAILURE);
   }
 
+  // Start the worker pool
+  for (int i = 0; i < NUM_WORKERS; i++) {
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, worker, NULL) != 0) {
+      perror("SERVER: pthread_create failed");
+      close(server_fd);
+      exit(EXIT_FAILURE);
+    }
+    pthread_detach(thread);
+  }
+
   // Print server information
   printf("SERVER: started succesfully. Listening on port %d\n\n", port);
   printf(
@@ -187,20 +248,12 @@ int main(int argc, char **argv) {
       exit(EXIT_FAILURE);
     }
 
-    // Create a new thread to handle each client connection
-    pthread_t thread;
-    if (pthread_create(&thread, NULL, handle_client,
-                       &client_communication_socket) != 0) {
-      perror("SERVER: pthread_create failed");
+    // Hand the socket to the pool by value; shed load if it is saturated
+    if (queue_push(client_communication_socket) < 0) {
+      fprintf(stderr, "SERVER: too many pending clients, rejecting\n");
+      send(client_communication_socket, overloaded_response,
+           sizeof(overloaded_response) - 1, MSG_DONTWAIT | MSG_NOSIGNAL);
       close(client_communication_socket);
-    } else {
-      // Store thread in the array
-      for (int i = 0; i < MAX_CLIENTS; i++) {
-        if (client_threads[i] == 0) {
-          client_threads[i] = thread;
-          break;
-        }
-      }
     }
   }
 